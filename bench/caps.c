@@ -0,0 +1,171 @@
+// Cost of walking the capabilities of a device in setup_device (hid.c): testing each of the KEY_MAX bits of every event type
+// the device reports (how it used to be done), against walking the set bits of the mapped types a word at a time (how it is
+// done now). The ioctls are replaced by copies from the bitmaps of a gamepad, so only the walk is measured.
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SETUPS 100000
+
+// Capability bitmaps of the mocked device, by event type
+static uint8_t device_bits[EV_CNT][(KEY_CNT + 7) / 8];
+
+typedef struct {
+    uint16_t abs_indices[ABS_CNT];
+    uint16_t rel_indices[REL_CNT];
+    uint16_t key_indices[KEY_CNT];
+    int      abs_len, rel_len, key_len;
+} Mapping;
+
+static size_t bitmap_size(int type) {
+    switch (type) {
+    case 0:
+        return (EV_CNT + 7) / 8;
+    case EV_ABS:
+        return (ABS_CNT + 7) / 8;
+    case EV_REL:
+        return (REL_CNT + 7) / 8;
+    default:
+        return (KEY_CNT + 7) / 8;
+    }
+}
+
+// EVIOCGBIT(type, len)
+static void get_bits(int type, size_t len, void *buf) {
+    size_t size = bitmap_size(type);
+    memcpy(buf, device_bits[type], len < size ? len : size);
+}
+
+static void map(Mapping *m, int type, int i) {
+    if (type == EV_ABS) {
+        m->abs_indices[i] = m->abs_len++;
+    } else if (type == EV_REL) {
+        m->rel_indices[i] = m->rel_len++;
+    } else if (type == EV_KEY) {
+        m->key_indices[i] = m->key_len++;
+    }
+}
+
+static inline bool bit_set(uint8_t *bits, int i) { return bits[i / 8] & (1 << (i % 8)); }
+
+static void setup_per_bit(Mapping *m) {
+    m->abs_len = m->rel_len = m->key_len = 0;
+    for (int i = 0; i < ABS_CNT; i++)
+        m->abs_indices[i] = -1;
+    for (int i = 0; i < REL_CNT; i++)
+        m->rel_indices[i] = -1;
+    for (int i = 0; i < KEY_CNT; i++)
+        m->key_indices[i] = -1;
+
+    uint8_t type_bits[EV_MAX]            = {0};
+    uint8_t feat_bits[(KEY_MAX + 7) / 8] = {0};
+
+    get_bits(0, EV_MAX, type_bits);
+    for (int type = 0; type < EV_MAX; type++) {
+        if (!bit_set(type_bits, type)) {
+            continue;
+        }
+        memset(feat_bits, 0, sizeof(feat_bits));
+        get_bits(type, KEY_MAX, feat_bits);
+
+        for (int i = 0; i < KEY_MAX; i++) {
+            if (bit_set(feat_bits, i)) {
+                map(m, type, i);
+            }
+        }
+    }
+}
+
+static void setup_per_word(Mapping *m) {
+    static const struct {
+        int    type;
+        size_t count;
+    } types[] = {
+        {EV_KEY, KEY_CNT},
+        {EV_REL, REL_CNT},
+        {EV_ABS, ABS_CNT},
+    };
+
+    m->abs_len = m->rel_len = m->key_len = 0;
+    memset(m->abs_indices, 0xff, sizeof(m->abs_indices));
+    memset(m->rel_indices, 0xff, sizeof(m->rel_indices));
+    memset(m->key_indices, 0xff, sizeof(m->key_indices));
+
+    uint64_t type_bits[(EV_CNT + 63) / 64] = {0};
+    uint64_t code_bits[(KEY_CNT + 63) / 64];
+
+    get_bits(0, sizeof(type_bits), type_bits);
+    for (int t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        int    type  = types[t].type;
+        size_t words = (types[t].count + 63) / 64;
+        if (!((type_bits[type / 64] >> (type % 64)) & 1)) {
+            continue;
+        }
+
+        memset(code_bits, 0, words * sizeof(uint64_t));
+        get_bits(type, (types[t].count + 7) / 8, code_bits);
+        for (size_t w = 0; w < words; w++) {
+            uint64_t bits = code_bits[w];
+            while (bits != 0) {
+                map(m, type, w * 64 + __builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set(int type, int code) { device_bits[type][code / 8] |= 1 << (code % 8); }
+
+int main(void) {
+    // A gamepad: 31 buttons, 8 axes, 2 relative axes, and a few types that aren't mapped
+    int types[] = {EV_SYN, EV_KEY, EV_REL, EV_ABS, EV_MSC};
+    for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        set(0, types[i]);
+    }
+    for (int k = BTN_MISC; k < BTN_MISC + 16; k++) {
+        set(EV_KEY, k);
+    }
+    for (int k = BTN_SOUTH; k <= BTN_THUMBR; k++) {
+        set(EV_KEY, k);
+    }
+    for (int a = 0; a < 8; a++) {
+        set(EV_ABS, a);
+    }
+    set(EV_REL, REL_X);
+    set(EV_REL, REL_Y);
+    set(EV_MSC, MSC_SCAN);
+
+    static Mapping per_bit, per_word;
+    setup_per_bit(&per_bit);
+    setup_per_word(&per_word);
+    if (memcmp(&per_bit, &per_word, sizeof(Mapping)) != 0) {
+        printf("The walks don't map the same codes\n");
+        return 1;
+    }
+
+    double start = now();
+    for (int i = 0; i < SETUPS; i++) {
+        setup_per_bit(&per_bit);
+    }
+    double per_bit_time = (now() - start) / SETUPS;
+
+    start = now();
+    for (int i = 0; i < SETUPS; i++) {
+        setup_per_word(&per_word);
+    }
+    double per_word_time = (now() - start) / SETUPS;
+
+    printf("%d keys, %d axes, %d relative axes\n", per_word.key_len, per_word.abs_len, per_word.rel_len);
+    printf("%-30s %8.0f ns/device\n", "each bit of every type", per_bit_time * 1e9);
+    printf("%-30s %8.0f ns/device\n", "set bits of the mapped types", per_word_time * 1e9);
+    return 0;
+}
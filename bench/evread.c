@@ -0,0 +1,66 @@
+// Syscalls and time spent reading evdev frames with one event per read (how the server used to do it) against as many events
+// as fit in a 64 event buffer per read (how it is done now). Each frame moves a few axes and ends with an EV_SYN; it is
+// written to a pipe as a device would make it available, in one go, then read back until its EV_SYN, as a reader keeping up
+// with the device would.
+#include <linux/input.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAMES 200000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read every frame back with reads of up to batch events, returns the number of reads
+static unsigned long run(int fds[2], int axes, int batch, double *elapsed) {
+    struct input_event frame[ABS_CNT + 1] = {0};
+    for (int i = 0; i < axes; i++) {
+        frame[i] = (struct input_event){.type = EV_ABS, .code = i, .value = i};
+    }
+    frame[axes] = (struct input_event){.type = EV_SYN, .code = SYN_REPORT};
+
+    struct input_event events[64];
+    unsigned long      reads = 0;
+
+    double start = now();
+    for (int f = 0; f < FRAMES; f++) {
+        write(fds[1], frame, (axes + 1) * sizeof(struct input_event));
+
+        bool synced = false;
+        while (!synced) {
+            int len = read(fds[0], events, batch * sizeof(struct input_event));
+            reads++;
+            for (int i = 0; i < len / (int)sizeof(struct input_event); i++) {
+                synced |= events[i].type == EV_SYN;
+            }
+        }
+    }
+    *elapsed = now() - start;
+    return reads;
+}
+
+int main(void) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    int axes[] = {1, 2, 4, 8};
+
+    printf("%12s %24s %24s\n", "axes/frame", "1 event per read", "64 events per read");
+    for (int a = 0; a < sizeof(axes) / sizeof(axes[0]); a++) {
+        double        single_time, batch_time;
+        unsigned long single = run(fds, axes[a], 1, &single_time);
+        unsigned long batch  = run(fds, axes[a], 64, &batch_time);
+
+        printf("%12d %6.2f reads %8.0f ns/frame %6.2f reads %8.0f ns/frame\n", axes[a], (double)single / FRAMES,
+               single_time / FRAMES * 1e9, (double)batch / FRAMES, batch_time / FRAMES * 1e9);
+    }
+    return 0;
+}
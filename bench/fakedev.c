@@ -0,0 +1,166 @@
+// Preloaded (LD_PRELOAD) in the benchmarks to make the fifos and regular files of a fake FSROOT tree look like evdev and
+// uinput nodes: the evdev and uinput ioctls on them are answered here, as a gamepad with 15 buttons and 8 axes. Everything
+// else goes to libc.
+//
+// When FAKEDEV_STATS is set, the reads of /dev/input/event* nodes are counted and printed to stderr on exit (not the ones
+// submitted to an io_uring).
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_FDS 4096
+
+// Event nodes opened, by fd
+static bool     event_fds[MAX_FDS];
+static uint64_t event_reads  = 0;
+static uint64_t event_events = 0;
+
+static void set_bit(uint8_t *bits, int i, size_t len) {
+    if (i / 8 < len) {
+        bits[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static bool is_fake(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode));
+}
+
+// Answer an evdev ioctl, returns what the kernel would
+static int evdev_ioctl(unsigned long req, void *arg) {
+    int    nr   = _IOC_NR(req);
+    size_t size = _IOC_SIZE(req);
+
+    // EVIOCGBIT, like the kernel at most the size of the bitmap of the type is written
+    if (nr >= 0x20 && nr < 0x40) {
+        uint8_t *bits = arg;
+        int      type = nr - 0x20;
+        size_t   max  = type == 0 ? (EV_CNT + 7) / 8 : type == EV_ABS ? (ABS_CNT + 7) / 8 : (KEY_CNT + 7) / 8;
+        size          = size < max ? size : max;
+        memset(bits, 0, size);
+        switch (type) {
+        case 0:
+            set_bit(bits, EV_SYN, size);
+            set_bit(bits, EV_KEY, size);
+            set_bit(bits, EV_ABS, size);
+            break;
+        case EV_KEY:
+            for (int k = BTN_SOUTH; k <= BTN_THUMBR; k++) {
+                set_bit(bits, k, size);
+            }
+            break;
+        case EV_ABS:
+            for (int a = ABS_X; a <= ABS_RZ; a++) {
+                set_bit(bits, a, size);
+            }
+            set_bit(bits, ABS_HAT0X, size);
+            set_bit(bits, ABS_HAT0Y, size);
+            break;
+        }
+        return size;
+    }
+
+    // EVIOCGABS
+    if (nr >= 0x40 && nr < 0x80) {
+        struct input_absinfo *abs = arg;
+        memset(abs, 0, sizeof(*abs));
+        abs->minimum = -32768;
+        abs->maximum = 32767;
+        return 0;
+    }
+
+    switch (nr) {
+    case 0x02: { // EVIOCGID
+        struct input_id *id = arg;
+        *id                 = (struct input_id){.bustype = BUS_USB, .vendor = 0x6969, .product = 0x0420, .version = 1};
+        return 0;
+    }
+    case 0x06: // EVIOCGNAME
+        strncpy(arg, "Fake Gamepad", size);
+        return strlen("Fake Gamepad") + 1;
+    case 0x08: // EVIOCGUNIQ
+    case 0x18: // EVIOCGKEY
+        memset(arg, 0, size);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+int ioctl(int fd, unsigned long req, ...) {
+    va_list ap;
+    va_start(ap, req);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if ((_IOC_TYPE(req) == 'E' || _IOC_TYPE(req) == UINPUT_IOCTL_BASE) && is_fake(fd)) {
+        return _IOC_TYPE(req) == 'E' ? evdev_ioctl(req, arg) : 0;
+    }
+
+    int (*real)(int, unsigned long, void *) = dlsym(RTLD_NEXT, "ioctl");
+    return real(fd, req, arg);
+}
+
+int open(const char *path, int flags, ...) {
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+
+    int (*real)(const char *, int, mode_t) = dlsym(RTLD_NEXT, "open");
+    int fd                                 = real(path, flags, mode);
+    if (fd >= 0 && fd < MAX_FDS) {
+        event_fds[fd] = strstr(path, "/dev/input/event") != NULL;
+    }
+    return fd;
+}
+
+// The epoll workers read a dup of the device
+int dup(int old) {
+    int (*real)(int) = dlsym(RTLD_NEXT, "dup");
+    int fd           = real(old);
+    if (fd >= 0 && fd < MAX_FDS && old >= 0 && old < MAX_FDS) {
+        event_fds[fd] = event_fds[old];
+    }
+    return fd;
+}
+
+int close(int fd) {
+    int (*real)(int) = dlsym(RTLD_NEXT, "close");
+    if (fd >= 0 && fd < MAX_FDS) {
+        event_fds[fd] = false;
+    }
+    return real(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t len) {
+    static ssize_t (*real)(int, void *, size_t) = NULL;
+    if (real == NULL) {
+        real = dlsym(RTLD_NEXT, "read");
+    }
+
+    ssize_t res = real(fd, buf, len);
+    if (fd >= 0 && fd < MAX_FDS && event_fds[fd]) {
+        __atomic_add_fetch(&event_reads, 1, __ATOMIC_RELAXED);
+        if (res > 0) {
+            __atomic_add_fetch(&event_events, res / sizeof(struct input_event), __ATOMIC_RELAXED);
+        }
+    }
+    return res;
+}
+
+__attribute__((destructor)) static void print_stats(void) {
+    if (getenv("FAKEDEV_STATS") != NULL) {
+        fprintf(stderr, "fakedev: %lu reads of event nodes, %lu events\n", event_reads, event_events);
+    }
+}
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+# Forwarding benchmark: N clients each hold one of N fake gamepads, fed at a fixed rate, for every server mode. Reports the
+# threads and resident memory of the server under load, and the event->uinput latency the clients measured (their "timing"
+# histograms, from the time the event was written to the device node to the write to uinput).
+#
+# Runs against the build of `make -C bench`: jsfw_bench reads its devices from a fake FSROOT tree of fifos, fakedev.so makes
+# them look like evdev nodes. See bench/Makefile.
+import argparse
+import json
+import os
+import re
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+EV_SYN, EV_ABS = 0, 3
+ABS_X, ABS_Y = 0, 1
+
+
+def event(now_ns, type_, code, value):
+    us = now_ns // 1000
+    return struct.pack("<qqHHi", us // 1000000, us % 1000000, type_, code, value)
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def make_root(root, devices):
+    shutil.rmtree(root, ignore_errors=True)
+    os.makedirs(f"{root}/dev/input")
+    os.makedirs(f"{root}/sys/class/input")
+    open(f"{root}/dev/uinput", "w").close()
+
+    # The writers are opened first, the server's blocking opens would wait for them otherwise
+    fds = []
+    for i in range(devices):
+        os.mkfifo(f"{root}/dev/input/event{i}")
+        os.symlink(f"../../../dev/input/event{i}", f"{root}/sys/class/input/event{i}")
+        fds.append(os.open(f"{root}/dev/input/event{i}", os.O_RDWR))
+    return fds
+
+
+def proc_status(pid):
+    threads, rss = 0, 0
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("Threads:"):
+                threads = int(line.split()[1])
+            elif line.startswith("VmRSS:"):
+                rss = int(line.split()[1])
+    return threads, rss
+
+
+def wait_for(predicate, timeout):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        if predicate():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def run_mode(args, mode, tmp):
+    fds = make_root(args.root, args.clients)
+    env = dict(os.environ, LD_PRELOAD=f"{HERE}/fakedev.so")
+    port = free_port()
+
+    server_cfg = f"{tmp}/server_{mode}.json"
+    with open(server_cfg, "w") as f:
+        json.dump({"controllers": [{"tag": "Pad"}], "mode": mode, "workers": args.workers}, f)
+
+    server_log = open(f"{tmp}/server_{mode}.log", "w")
+    server = subprocess.Popen([args.jsfw, "server", str(port), server_cfg], env=env, stdout=server_log, stderr=subprocess.STDOUT)
+    time.sleep(0.3)
+
+    clients, logs = [], []
+    for i in range(args.clients):
+        cfg = f"{tmp}/client_{mode}_{i}.json"
+        with open(cfg, "w") as f:
+            json.dump({"slots": [{"controllers": [{"tag": "Pad"}]}], "fifo_path": f"{tmp}/fifo_{mode}_{i}", "timing": True}, f)
+        logs.append(f"{tmp}/client_{mode}_{i}.log")
+        clients.append(
+            subprocess.Popen(
+                ["stdbuf", "-oL", args.jsfw, "client", "127.0.0.1", str(port), cfg],
+                env=env,
+                stdout=open(logs[-1], "w"),
+                stderr=subprocess.STDOUT,
+            )
+        )
+
+    def stop():
+        for p in clients + [server]:
+            p.send_signal(signal.SIGINT)
+        for p in clients + [server]:
+            try:
+                p.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                p.kill()
+        for fd in fds:
+            os.close(fd)
+
+    def all_attached():
+        return all("Got device" in open(log).read() for log in logs)
+
+    # The writes to the devices would block once nobody reads them
+    if not wait_for(all_attached, 10):
+        stop()
+        sys.exit(f"{mode}: not every client got a device, see {tmp}")
+
+    # Feed every device at the rate, sampling the server as it goes
+    threads, rss = 0, 0
+    period = 1 / args.rate
+    frames = int(args.duration * args.rate)
+    next_tick = time.monotonic()
+    for n in range(frames):
+        for i, fd in enumerate(fds):
+            now = time.time_ns()
+            value = (n * 97 + i) % 65536 - 32768
+            os.write(fd, event(now, EV_ABS, ABS_X, value) + event(now, EV_ABS, ABS_Y, -value) + event(now, EV_SYN, 0, 0))
+        if n % args.rate == args.rate // 2:
+            t, r = proc_status(server.pid)
+            threads, rss = max(threads, t), max(rss, r)
+
+        next_tick += period
+        delay = next_tick - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+    time.sleep(0.5)
+    for c in clients:
+        c.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+
+    stop()
+
+    # event->uinput histogram of every client
+    pattern = re.compile(r"event->uinput: (\d+) samples, p50 ([\d.]+)us, p90 [\d.]+us, p99 ([\d.]+)us")
+    samples, p50s, p99s = 0, [], []
+    for log in logs:
+        matches = pattern.findall(open(log).read())
+        if matches:
+            count, p50, p99 = matches[-1]
+            samples += int(count)
+            p50s.append(float(p50))
+            p99s.append(float(p99))
+
+    p50s.sort()
+    p99s.sort()
+    median = lambda values: values[len(values) // 2] if values else float("nan")
+    return {
+        "mode": mode,
+        "threads": threads,
+        "rss": rss,
+        "samples": samples,
+        # Every client also gets a full report when it gets its device
+        "expected": (frames + 1) * args.clients,
+        "p50": median(p50s),
+        "p99": median(p99s),
+        "p99_max": p99s[-1] if p99s else float("nan"),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--jsfw", default=f"{HERE}/jsfw_bench")
+    parser.add_argument("--root", default="/tmp/jsfw_bench", help="FSROOT jsfw_bench was built with")
+    parser.add_argument("--clients", type=int, default=32)
+    parser.add_argument("--rate", type=int, default=250, help="frames per second of every device")
+    parser.add_argument("--duration", type=float, default=10)
+    parser.add_argument("--workers", type=int, default=1, help="workers of the epoll and io_uring modes")
+    parser.add_argument("--modes", default="threaded,epoll,io_uring")
+    args = parser.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix="jsfw_forward_")
+    results = [run_mode(args, mode, tmp) for mode in args.modes.split(",")]
+    shutil.rmtree(args.root, ignore_errors=True)
+
+    print(f"{args.clients} clients, {args.rate} frames/s each for {args.duration}s, {args.workers} worker(s), logs in {tmp}")
+    print(f"{'mode':<10} {'threads':>7} {'rss KiB':>8} {'reports':>13} {'p50 us':>8} {'p99 us':>8} {'max p99 us':>10}")
+    for r in results:
+        reports = f"{r['samples']}/{r['expected']}"
+        print(
+            f"{r['mode']:<10} {r['threads']:>7} {r['rss']:>8} {reports:>13} {r['p50']:>8.1f} {r['p99']:>8.1f} "
+            f"{r['p99_max']:>10.1f}"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,72 @@
+// Cost of the known device checks of a rescan: every accepted event node is looked up in the known devices, which used to be a
+// Vec of ids scanned linearly and is now a Hashmap (see hid.c).
+#include "../hashmap.h"
+#include "../vec.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define RESCANS 20
+
+// Same as hid.c
+static uint32_t id_hash(Hasher state, const void *id) { return hash(state, id, sizeof(uint64_t)); }
+static bool     id_equal(const void *a, const void *b) { return *(uint64_t *)a == *(uint64_t *)b; }
+
+static volatile uint64_t sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool vec_known(Vec *known, uint64_t id) {
+    for (int i = 0; i < known->len; i++) {
+        if (*(uint64_t *)vec_get(known, i) == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(void) {
+    int counts[] = {16, 256, 1000, 4000};
+
+    printf("%8s %18s %18s\n", "devices", "Vec us/rescan", "Hashmap us/rescan");
+    for (int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int      n     = counts[c];
+        Vec      vec   = vec_of(uint64_t);
+        Hashmap *map   = hashmap_init(id_hash, id_equal, NULL, sizeof(uint64_t));
+        uint64_t found = 0;
+
+        for (uint64_t id = 0; id < n; id++) {
+            vec_push(&vec, &id);
+            hashmap_set(map, &id);
+        }
+
+        double start = now();
+        for (int r = 0; r < RESCANS; r++) {
+            for (uint64_t id = 0; id < n; id++) {
+                found += vec_known(&vec, id);
+            }
+        }
+        double vec_time = (now() - start) / RESCANS;
+
+        start = now();
+        for (int r = 0; r < RESCANS; r++) {
+            for (uint64_t id = 0; id < n; id++) {
+                found += hashmap_has(map, &id);
+            }
+        }
+        double map_time = (now() - start) / RESCANS;
+
+        sink = found;
+        printf("%8d %18.1f %18.1f\n", n, vec_time * 1e6, map_time * 1e6);
+
+        vec_free(vec);
+        hashmap_drop(map);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Cost of writing a report to uinput with one write per event (how the client used to do it) against one write for the whole
+// report (how it is done now), for reports of a few sizes. The events go to a pipe drained by another process, as a stand-in
+// for /dev/uinput.
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPORTS 20000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+
+    pid_t drain = fork();
+    if (drain == 0) {
+        static char buf[1 << 16];
+        close(fds[1]);
+        while (read(fds[0], buf, sizeof(buf)) > 0) {
+        }
+        return 0;
+    }
+    close(fds[0]);
+
+    // A frame moving an axis, a relative axis and a key, a gamepad's full report, and a full report of a 768 key device
+    int                       sizes[] = {4, 90, 849};
+    static struct input_event events[1024];
+
+    printf("%14s %20s %20s\n", "events/report", "write per event", "write per report");
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+
+        double start = now();
+        for (int r = 0; r < REPORTS; r++) {
+            for (int i = 0; i < n; i++) {
+                write(fds[1], &events[i], sizeof(struct input_event));
+            }
+        }
+        double per_event = now() - start;
+
+        start = now();
+        for (int r = 0; r < REPORTS; r++) {
+            write(fds[1], events, n * sizeof(struct input_event));
+        }
+        double per_report = now() - start;
+
+        printf("%14d %14.2fM ev/s %14.2fM ev/s\n", n, REPORTS * n / per_event / 1e6, REPORTS * n / per_report / 1e6);
+    }
+
+    close(fds[1]);
+    waitpid(drain, NULL, 0);
+    return 0;
+}
@@ -1,18 +1,22 @@
 #include "client.h"
 
 #include "const.h"
+#include "hist.h"
 #include "json.h"
 #include "net.h"
+#include "recvq.h"
 #include "util.h"
 #include "vec.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/input-event-codes.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -20,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -30,17 +35,57 @@ static int fifo_attempt = 0;
 static struct sockaddr_in server_addr      = {0};
 static char               server_addrp[64] = {0};
 static uint16_t           server_port      = -1;
+// Address of the server as seen on the TCP connection, report datagrams must come from it
+static struct sockaddr_in server_peer = {0};
 
-static struct pollfd  poll_fds[2];
+static struct pollfd  poll_fds[4];
 static struct pollfd *fifo_poll   = &poll_fds[0];
 static struct pollfd *socket_poll = &poll_fds[1];
+static struct pollfd *udp_poll    = &poll_fds[2];
+static struct pollfd *signal_poll = &poll_fds[3];
 static int            fifo        = -1;
 static int            sock        = -1;
+static int            udp         = -1;
 // static to avoid having this on the stack because a message is about 2kb in memory
 static DeviceMessage message;
+// Bytes received from the server, many messages are decoded from a single recv
+static RecvQueue recv_queue;
 
 static Vec devices_fd;
 static Vec devices_info;
+// Last state received for each device, delta reports are applied to it
+static Vec devices_state;
+
+// Events of a report of a slot, written to uinput at once. Only the controls that changed since the last state applied get
+// an event.
+typedef struct {
+    // Room for an event for every control of the device, and the EV_SYN
+    struct input_event *events;
+    size_t              len;
+    // Event of every control of the device, and the EV_SYN, built from its DeviceInfo: only the value is filled in when one
+    // is added to events. They follow events in the same allocation.
+    struct input_event *abs;
+    struct input_event *rel;
+    struct input_event *key;
+    struct input_event *syn;
+} UinputBatch;
+
+// UinputBatch of each slot
+static Vec devices_batch;
+
+// Latency histograms of a slot, when reports carry their timing
+typedef struct {
+    // From the server sending a report to its reception (across the clocks of both hosts), from then to the write of its
+    // EV_SYN to uinput, and from the event on the server to that write
+    Histogram send_recv;
+    Histogram recv_uinput;
+    Histogram event_uinput;
+} SlotTimings;
+
+// SlotTimings of each slot
+static Vec devices_timings;
+// When the message being handled was received (in ns, CLOCK_REALTIME)
+static uint64_t received_ns;
 
 static ClientConfig  config;
 static DeviceRequest device_request;
@@ -95,7 +140,9 @@ static const JSONAdapter SlotAdapter = {
 static const JSONPropertyAdapter ClientConfigAdapterProps[] = {
     {".slots[]",     &SlotAdapter,   offsetof(ClientConfig, slots),       default_to_null,     NULL                  },
     {".fifo_path",   &StringAdapter, offsetof(ClientConfig, fifo_path),   default_fifo_path,   NULL                  },
-    {".retry_delay", &NumberAdapter, offsetof(ClientConfig, retry_delay), default_retry_delay, tsf_numsec_to_timespec}
+    {".retry_delay", &NumberAdapter, offsetof(ClientConfig, retry_delay), default_retry_delay, tsf_numsec_to_timespec},
+    {".udp",         &BooleanAdapter, offsetof(ClientConfig, udp),        default_to_false,    NULL                  },
+    {".timing",      &BooleanAdapter, offsetof(ClientConfig, timing),     default_to_false,    NULL                  },
 };
 static const JSONAdapter ConfigAdapter = {
     .props      = ClientConfigAdapterProps,
@@ -110,6 +157,8 @@ static void print_config() {
     printf("CLIENT: Config\n");
     printf("  fifo_path: %s\n", config.fifo_path);
     printf("  retry_delay: %fs\n", timespec_to_double(&config.retry_delay));
+    printf("  udp: %s\n", config.udp ? "true" : "false");
+    printf("  timing: %s\n", config.timing ? "true" : "false");
     printf("  slots: \n");
     for (size_t i = 0; i < config.slot_count; i++) {
         ClientSlot *slot = &config.slots[i];
@@ -221,27 +270,101 @@ void device_init(DeviceInfo *dev) {
     DeviceInfo *dst = vec_get(&devices_info, dev->slot);
 
     memcpy(dst, dev, sizeof(DeviceInfo));
+
+    UinputBatch *batch  = vec_get(&devices_batch, dev->slot);
+    size_t       events = dev->abs.len + dev->rel.len + dev->key.len + 1;
+    batch->len          = 0;
+    batch->events       = realloc(batch->events, 2 * events * sizeof(struct input_event));
+    if (batch->events == NULL) {
+        panicf("CLIENT: Couldn't allocate the uinput events of a device\n");
+    }
+    memset(batch->events, 0, 2 * events * sizeof(struct input_event));
+
+    batch->abs = batch->events + events;
+    batch->rel = batch->abs + dev->abs.len;
+    batch->key = batch->rel + dev->rel.len;
+    batch->syn = batch->key + dev->key.len;
+    for (int i = 0; i < dev->abs.len; i++) {
+        batch->abs[i].type = EV_ABS;
+        batch->abs[i].code = dev->abs.data[i].id;
+    }
+    for (int i = 0; i < dev->rel.len; i++) {
+        batch->rel[i].type = EV_REL;
+        batch->rel[i].code = dev->rel.data[i].id;
+    }
+    for (int i = 0; i < dev->key.len; i++) {
+        batch->key[i].type = EV_KEY;
+        batch->key[i].code = dev->key.data[i].id;
+    }
+    batch->syn->type = EV_SYN;
+    batch->syn->code = SYN_REPORT;
+
+    // The server starts sending deltas from a zeroed state, sequence numbers carry on across devices
+    DeviceReport *state = vec_get(&devices_state, dev->slot);
+    uint32_t      seq   = state->seq;
+    memset(state, 0, sizeof(DeviceReport));
+    state->seq     = seq;
+    state->abs.len = dev->abs.len;
+    state->rel.len = dev->rel.len;
+    state->key.len = dev->key.len;
     printf("CLIENT: Got device [%d]: '%s' (abs: %d, rel: %d, key: %d)\n", dev->slot, ctr->device_name, dev->abs.len, dev->rel.len,
            dev->key.len);
 }
 
-// Send an event to uinput, device must exist
-bool device_emit(int index, uint16_t type, uint16_t id, uint32_t value) {
-    if (index >= devices_fd.len) {
-        return true;
+// Add the event of a control to the batch of a slot, from its prebuilt event (see UinputBatch)
+static inline void batch_push(UinputBatch *batch, const struct input_event *control, int32_t value) {
+    struct input_event *event = &batch->events[batch->len++];
+
+    *event       = *control;
+    event->value = value;
+}
+
+// Close the batch of a slot with an EV_SYN and write it to uinput in one go. Reports are sent by the server every time the
+// server receives an EV_SYN from the physical device, so one is sent for each to match (unless nothing changed).
+static void batch_write(int slot, UinputBatch *batch) {
+    if (batch->len == 0) {
+        return;
     }
+    batch_push(batch, batch->syn, 0);
 
-    int                fd    = *(int *)vec_get(&devices_fd, index);
-    struct input_event event = {0};
+    int    fd   = *(int *)vec_get(&devices_fd, slot);
+    size_t size = batch->len * sizeof(struct input_event);
+    if (write(fd, batch->events, size) != size) {
+        printf("CLIENT: Error writing events to uinput\n");
+    }
+    batch->len = 0;
+}
 
-    event.type  = type;
-    event.code  = id;
-    event.value = value;
+// Record the latencies of a report of a slot whose EV_SYN has just been written to uinput, if it carries its timing
+static void device_record_timing(int slot, uint8_t timing_len, Timing *timing) {
+    if (timing_len == 0 || slot >= devices_timings.len) {
+        return;
+    }
 
-    return write(fd, &event, sizeof(event)) != sizeof(event);
+    uint64_t     written = realtime_ns();
+    SlotTimings *t       = vec_get(&devices_timings, slot);
+    hist_record_span(&t->send_recv, timing->sent, received_ns);
+    hist_record_span(&t->recv_uinput, received_ns, written);
+    hist_record_span(&t->event_uinput, timing->event, written);
 }
 
-// Update device with report
+static void print_timings(void) {
+    char line[256];
+
+    printf("CLIENT: Timings of %lu slots\n", devices_timings.len);
+    for (int i = 0; i < devices_timings.len; i++) {
+        SlotTimings *t = vec_get(&devices_timings, i);
+
+        hist_format(&t->send_recv, line, sizeof(line));
+        printf("CLIENT: [%d] send->recv: %s\n", i, line);
+        hist_format(&t->recv_uinput, line, sizeof(line));
+        printf("CLIENT: [%d] recv->uinput: %s\n", i, line);
+        hist_format(&t->event_uinput, line, sizeof(line));
+        printf("CLIENT: [%d] event->uinput: %s\n", i, line);
+    }
+}
+
+// Update device with report, only the controls that changed since the last state applied are emitted
 void device_handle_report(DeviceReport *report) {
     if (!device_exists(report->slot)) {
         printf("CLIENT: [%d] Got report before device info\n", report->slot);
@@ -256,35 +379,124 @@ void device_handle_report(DeviceReport *report) {
         return;
     }
 
+    DeviceReport *state = vec_get(&devices_state, report->slot);
+    UinputBatch  *batch = vec_get(&devices_batch, report->slot);
+
     for (int i = 0; i < report->abs.len; i++) {
-        if (device_emit(report->slot, EV_ABS, info->abs.data[i].id, report->abs.data[i]) != 0) {
-            printf("CLIENT: Error writing abs event to uinput\n");
+        if (report->abs.data[i] != state->abs.data[i]) {
+            batch_push(batch, &batch->abs[i], report->abs.data[i]);
         }
     }
 
+    // Relative axes only hold the motion of the report
     for (int i = 0; i < report->rel.len; i++) {
-        if (device_emit(report->slot, EV_REL, info->rel.data[i].id, report->rel.data[i]) != 0) {
-            printf("CLIENT: Error writing rel event to uinput\n");
+        if (report->rel.data[i] != 0) {
+            batch_push(batch, &batch->rel[i], report->rel.data[i]);
         }
     }
 
-    for (int i = 0; i < report->key.len; i++) {
-        if (device_emit(report->slot, EV_KEY, info->key.data[i].id, (uint32_t)(!report->key.data[i]) - 1) != 0) {
-            printf("CLIENT: Error writing key event to uinput\n");
+    // Only the keys that changed are emitted, found by comparing the bitsets a word at a time
+    for (size_t w = 0; w < words_for_bits(report->key.len); w++) {
+        uint64_t changed = report->key.data[w] ^ state->key.data[w];
+        while (changed != 0) {
+            int i = w * 64 + __builtin_ctzll(changed);
+            changed &= changed - 1;
+
+            batch_push(batch, &batch->key[i], word_bit_get(report->key.data, i));
         }
     }
-    // Reports are sent by the server every time the server receives an EV_SYN from the physical device, so we
-    // send one when we receive the report to match
-    device_emit(report->slot, EV_SYN, 0, 0);
+
+    memcpy(state, report, sizeof(DeviceReport));
+    batch_write(report->slot, batch);
+    device_record_timing(report->slot, report->timing.len, report->timing.data);
+}
+
+// Update device with the changes of a delta report, only the controls that changed are emitted
+void device_handle_report_delta(DeviceReportDelta *delta) {
+    if (!device_exists(delta->slot)) {
+        printf("CLIENT: [%d] Got report before device info\n", delta->slot);
+        return;
+    }
+
+    DeviceInfo   *info  = vec_get(&devices_info, delta->slot);
+    DeviceReport *state = vec_get(&devices_state, delta->slot);
+    UinputBatch  *batch = vec_get(&devices_batch, delta->slot);
+
+    for (int i = 0; i < delta->abs.len; i++) {
+        if (delta->abs.data[i].index >= info->abs.len) {
+            printf("CLIENT: Delta report doesn't match with device info (abs index %u)\n", delta->abs.data[i].index);
+            return;
+        }
+    }
+    for (int i = 0; i < delta->rel.len; i++) {
+        if (delta->rel.data[i].index >= info->rel.len) {
+            printf("CLIENT: Delta report doesn't match with device info (rel index %u)\n", delta->rel.data[i].index);
+            return;
+        }
+    }
+    for (int i = 0; i < delta->key.len; i++) {
+        if (delta->key.data[i].index >= info->key.len) {
+            printf("CLIENT: Delta report doesn't match with device info (key index %u)\n", delta->key.data[i].index);
+            return;
+        }
+    }
+
+    for (int i = 0; i < delta->abs.len; i++) {
+        AbsDelta d = delta->abs.data[i];
+        if (state->abs.data[d.index] != d.value) {
+            state->abs.data[d.index] = d.value;
+            batch_push(batch, &batch->abs[d.index], d.value);
+        }
+    }
+
+    for (int i = 0; i < delta->rel.len; i++) {
+        RelDelta d = delta->rel.data[i];
+        if (d.value != 0) {
+            batch_push(batch, &batch->rel[d.index], d.value);
+        }
+    }
+
+    for (int i = 0; i < delta->key.len; i++) {
+        KeyDelta d = delta->key.data[i];
+        if (word_bit_get(state->key.data, d.index) != (d.value != 0)) {
+            word_bit_put(state->key.data, d.index, d.value);
+            batch_push(batch, &batch->key[d.index], d.value);
+        }
+    }
+
+    batch_write(delta->slot, batch);
+    device_record_timing(delta->slot, delta->timing.len, delta->timing.data);
+}
+
+// Update device with a report received over UDP, reports older than the last one applied are dropped
+void device_handle_datagram(DeviceReport *report) {
+    if (report->slot >= devices_state.len) {
+        printf("CLIENT: Got wrong device index\n");
+        return;
+    }
+
+    DeviceReport *state = vec_get(&devices_state, report->slot);
+    // Compare in a way that survives the sequence number wrapping around
+    if ((int32_t)(report->seq - state->seq) <= 0) {
+        return;
+    }
+
+    device_handle_report(report);
 }
 
 void setup_devices(void) {
-    devices_fd   = vec_of(int);
-    devices_info = vec_of(DeviceInfo);
+    devices_fd    = vec_of(int);
+    devices_info  = vec_of(DeviceInfo);
+    devices_state = vec_of(DeviceReport);
+    devices_batch = vec_of(UinputBatch);
+    devices_timings = vec_of(SlotTimings);
 
     DeviceInfo no_info = {0};
     no_info.tag        = DeviceTagNone;
 
+    DeviceReport no_state = {0};
+    UinputBatch  no_batch = {0};
+
     for (int i = 0; i < config.slot_count; i++) {
         int fd = open(FSROOT "/dev/uinput", O_WRONLY | O_NONBLOCK);
         if (fd < 0) {
@@ -294,6 +506,15 @@ void setup_devices(void) {
 
         vec_push(&devices_fd, &fd);
         vec_push(&devices_info, &no_info);
+        vec_push(&devices_state, &no_state);
+        vec_push(&devices_batch, &no_batch);
+    }
+
+    // Histograms are rather large, they are only kept if asked for
+    if (config.timing) {
+        SlotTimings *timings = calloc(config.slot_count, sizeof(SlotTimings));
+        vec_extend(&devices_timings, timings, config.slot_count);
+        free(timings);
     }
 }
 
@@ -333,8 +554,15 @@ void connect_server(void) {
             shutdown(sock, SHUT_RDWR);
             destroy_devices();
             close(sock);
+
+            // The new connection numbers its reports from the start again
+            for (int i = 0; i < devices_state.len; i++) {
+                ((DeviceReport *)vec_get(&devices_state, i))->seq = 0;
+            }
         }
 
+        recvq_reset(&recv_queue);
+
         sock = socket(AF_INET, SOCK_STREAM, 0);
         if (sock < 0) {
             panicf("Couldn't create socket\n");
@@ -350,6 +578,9 @@ void connect_server(void) {
         // because we want to block on the connection itself
         fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
         socket_poll->fd = sock;
+
+        socklen_t peer_len = sizeof(server_peer);
+        getpeername(sock, (struct sockaddr *)&server_peer, &peer_len);
         printf("CLIENT: Connected !\n");
 
         uint8_t buf[2048] __attribute__((aligned(8))) = {0};
@@ -365,6 +596,49 @@ void connect_server(void) {
     }
 }
 
+// Open the UDP socket reports are received on and put its port in the request, if enabled (+ setup poll_fd)
+void setup_udp(void) {
+    udp_poll->fd     = -1;
+    udp_poll->events = POLLIN;
+
+    if (!config.udp) {
+        return;
+    }
+
+    udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (udp < 0) {
+        panicf("Couldn't create UDP socket\n");
+    }
+
+    struct sockaddr_in addr = {0};
+    socklen_t          len  = sizeof(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_ANY);
+    addr.sin_port           = 0;
+
+    if (bind(udp, (struct sockaddr *)&addr, sizeof(addr)) != 0 || getsockname(udp, (struct sockaddr *)&addr, &len) != 0) {
+        panicf("Couldn't bind UDP socket\n");
+    }
+
+    device_request.udp_port = ntohs(addr.sin_port);
+    udp_poll->fd            = udp;
+    printf("CLIENT: Receiving reports over UDP (port %u)\n", device_request.udp_port);
+}
+
+// Receive SIGUSR1, which prints the timings, on a signalfd (+ setup poll_fd)
+void setup_signals(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    signal_poll->fd     = signalfd(-1, &set, SFD_NONBLOCK);
+    signal_poll->events = POLLIN;
+    if (signal_poll->fd < 0) {
+        panicf("Couldn't create signalfd\n");
+    }
+}
+
 // Setup server address and connects to it (+ setup poll_fd)
 void setup_server(char *address, uint16_t port) {
     // setup address
@@ -385,6 +659,7 @@ void setup_server(char *address, uint16_t port) {
 
 void build_device_request(void) {
     device_request.tag           = DeviceTagRequest;
+    device_request.timing        = config.timing;
     device_request.requests.len  = config.slot_count;
     device_request.requests.data = malloc(config.slot_count * sizeof(TagList));
     for (int i = 0; i < config.slot_count; i++) {
@@ -431,13 +706,16 @@ void client_run(char *address, uint16_t port, char *config_path) {
     setup_fifo();
     build_device_request();
     setup_devices();
+    setup_udp();
+    setup_signals();
+    recvq_init(&recv_queue, RECV_QUEUE_SIZE);
     setup_server(address, port);
 
     uint8_t buf[2048] __attribute__((aligned(8)));
     uint8_t json_buf[2048] __attribute__((aligned(8)));
 
     while (true) {
-        int rc = poll(poll_fds, 2, -1);
+        int rc = poll(poll_fds, 4, -1);
         if (rc < 0) {
             perror("CLIENT: Error on poll");
             exit(1);
@@ -470,51 +748,76 @@ void client_run(char *address, uint16_t port, char *config_path) {
             }
         }
 
-        // A broken or closed socket produces a POLLIN event, so we check for error on the recv
-        if (socket_poll->revents & POLLIN) {
-            int len = recv(sock, buf, 2048, MSG_PEEK);
-            if (len <= 0) {
-                printf("CLIENT: Lost connection to server, reconnecting\n");
-                connect_server();
-                // we can use continue here because there's nothing after, unlike above for fifo (this reduces
-                // indentation instead of needing an else block)
-                continue;
+        if (signal_poll->revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(signal_poll->fd, &info, sizeof(info)) == sizeof(info)) {
+                print_timings();
             }
+        }
 
-            int msg_len = msg_device_deserialize(buf, len, &message);
-            // We've got data from the server
-            if (msg_len < 0) {
-                recv(sock, buf, 2048, 0);
-                printf("CLIENT: Couldn't parse message (code: %d, len: %d)\n", buf[4], len);
+        if (udp_poll->revents & POLLIN) {
+            // Drain every datagram, only reports from the server are accepted
+            while (true) {
+                struct sockaddr_in from;
+                socklen_t          from_len = sizeof(from);
 
-                int l = len > 100 ? 100 : len;
-                for (int i = 0; i < l; i++) {
-                    printf("%02x", buf[i]);
+                int len = recvfrom(udp, buf, 2048, 0, (struct sockaddr *)&from, &from_len);
+                if (len < 0) {
+                    break;
                 }
+                received_ns = realtime_ns();
 
-                if (len > 100) {
-                    printf(" ... %d more bytes", len - 100);
+                // The server sends them from the address and port of the TCP connection
+                if (from.sin_addr.s_addr != server_peer.sin_addr.s_addr || from.sin_port != server_peer.sin_port) {
+                    continue;
                 }
 
-                printf("\n");
-                continue;
+                // The lengths of the lists are checked before deserializing: the datagram has to be exactly one report
+                if (msg_device_length(buf, len) != len || *(uint16_t *)&buf[MSG_MAGIC_SIZE] != DeviceTagReport ||
+                    msg_device_deserialize(buf, len, &message) != len) {
+                    printf("CLIENT: Couldn't parse datagram (len: %d)\n", len);
+                    continue;
+                }
+
+                device_handle_datagram((DeviceReport *)&message);
             }
+        }
 
-            recv(sock, buf, msg_len, 0);
+        // A broken or closed socket produces a POLLIN event, so we check for error on the recv
+        if (socket_poll->revents & POLLIN) {
+            ssize_t len = recvq_fill(&recv_queue, sock);
+            received_ns = realtime_ns();
+            if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                printf("CLIENT: Lost connection to server, reconnecting\n");
+                connect_server();
+                // we can use continue here because there's nothing after, unlike above for fifo (this reduces
+                // indentation instead of needing an else block)
+                continue;
+            }
 
-            if (message.tag == DeviceTagInfo) {
-                if (device_exists(message.info.slot)) {
-                    printf("CLIENT: Got more than one device info for same device\n");
+            // Handle every message received entirely, what is left of the last one stays queued until the next recv
+            while ((rc = recvq_next(&recv_queue, &message)) != 0) {
+                if (rc < 0) {
+                    printf("CLIENT: Couldn't parse message, skipped %lu bytes\n", recv_queue.skipped);
+                    continue;
                 }
 
-                device_init((DeviceInfo *)&message);
-            } else if (message.tag == DeviceTagReport) {
-                device_handle_report((DeviceReport *)&message);
-            } else if (message.tag == DeviceTagDestroy) {
-                device_destroy(message.destroy.index);
-                printf("CLIENT: Lost device %d\n", message.destroy.index);
-            } else {
-                printf("CLIENT: Illegal message\n");
+                if (message.tag == DeviceTagInfo) {
+                    if (device_exists(message.info.slot)) {
+                        printf("CLIENT: Got more than one device info for same device\n");
+                    }
+
+                    device_init((DeviceInfo *)&message);
+                } else if (message.tag == DeviceTagReport) {
+                    device_handle_report((DeviceReport *)&message);
+                } else if (message.tag == DeviceTagReportDelta) {
+                    device_handle_report_delta((DeviceReportDelta *)&message);
+                } else if (message.tag == DeviceTagDestroy) {
+                    device_destroy(message.destroy.index);
+                    printf("CLIENT: Lost device %d\n", message.destroy.index);
+                } else {
+                    printf("CLIENT: Illegal message\n");
+                }
             }
         }
     }
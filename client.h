@@ -1,6 +1,7 @@
 // vi:ft=c
 #ifndef CLIENT_H_
 #define CLIENT_H_
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -24,6 +25,10 @@ typedef struct {
 
     char           *fifo_path;
     struct timespec retry_delay;
+    // Receive reports over UDP instead of TCP
+    bool udp;
+    // Ask for the timing of reports and keep latency histograms, printed on SIGUSR1
+    bool timing;
 } ClientConfig;
 
 #endif
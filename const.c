@@ -6,8 +6,12 @@
 // These are default values for the most part
 // Any value updated here should also be updated in README.md
 
-// How long between each device poll
+// How long between each device poll, when new devices can't be watched for
 const struct timespec POLL_DEVICE_INTERVAL = {.tv_sec = 1, .tv_nsec = 0};
+// How long between each full rescan of devices, when new ones are watched for
+const struct timespec RESCAN_DEVICE_INTERVAL = {.tv_sec = 30, .tv_nsec = 0};
+// Minimum time between two writes to the hidraw interface of a device (Bluetooth controllers can't take much more)
+const struct timespec HIDRAW_OUTPUT_INTERVAL = {.tv_sec = 0, .tv_nsec = 10000000};
 // How long (in ms) to wait for a request message on a connection before giving up
 const int REQUEST_TIMEOUT = 2000;
 // Default name for physical device, only visible in logs
@@ -32,3 +36,11 @@ const int TCP_KEEPALIVE_IDLE_TIME = 10;
 const int TCP_KEEPALIVE_RETRY_COUNT = 5;
 // How long (in seconds) between each probes
 const int TCP_KEEPALIVE_RETRY_INTERVAL = 2;
+// How many unsent bytes the socket of a connection can hold before it stops being writable, reports are coalesced past that
+const int TCP_NOTSENT_LOW_WATERMARK = 4096;
+// How many delta reports can be sent before a full report is sent again
+const int REPORT_KEYFRAME_INTERVAL = 128;
+// How many frames of a cloneable device are kept for the slots holding it to catch up
+const int SHARED_DEVICE_RING_SIZE = 32;
+// Size of the buffer the messages of a connection are received into, it holds many of them and always more than the largest
+const size_t RECV_QUEUE_SIZE = 65536;
@@ -1,6 +1,7 @@
 // vi:ft=c
 #ifndef CONST_H_
 #define CONST_H_
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -13,6 +14,8 @@
 #endif
 
 extern const struct timespec POLL_DEVICE_INTERVAL;
+extern const struct timespec RESCAN_DEVICE_INTERVAL;
+extern const struct timespec HIDRAW_OUTPUT_INTERVAL;
 extern const int             REQUEST_TIMEOUT;
 extern const char           *DEVICE_DEFAULT_NAME;
 extern const char           *FIFO_PATH;
@@ -25,5 +28,9 @@ extern const int             TCP_KEEPALIVE_ENABLE;
 extern const int             TCP_KEEPALIVE_IDLE_TIME;
 extern const int             TCP_KEEPALIVE_RETRY_COUNT;
 extern const int             TCP_KEEPALIVE_RETRY_INTERVAL;
+extern const int             TCP_NOTSENT_LOW_WATERMARK;
+extern const int             REPORT_KEYFRAME_INTERVAL;
+extern const int             SHARED_DEVICE_RING_SIZE;
+extern const size_t          RECV_QUEUE_SIZE;
 
 #endif
@@ -0,0 +1,265 @@
+#include "hashmap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define U8TO32_LE(p) (((uint32_t)((p)[0])) | ((uint32_t)((p)[1]) << 8) | ((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24))
+
+#define ROTL(x, b) (uint32_t)(((x) << (b)) | ((x) >> (32 - (b))))
+#define SIPROUND                                                                                                                 \
+    do {                                                                                                                         \
+        v0 += v1;                                                                                                                \
+        v1 = ROTL(v1, 5);                                                                                                        \
+        v1 ^= v0;                                                                                                                \
+        v0 = ROTL(v0, 16);                                                                                                       \
+        v2 += v3;                                                                                                                \
+        v3 = ROTL(v3, 8);                                                                                                        \
+        v3 ^= v2;                                                                                                                \
+        v0 += v3;                                                                                                                \
+        v3 = ROTL(v3, 7);                                                                                                        \
+        v3 ^= v0;                                                                                                                \
+        v2 += v1;                                                                                                                \
+        v1 = ROTL(v1, 13);                                                                                                       \
+        v1 ^= v2;                                                                                                                \
+        v2 = ROTL(v2, 16);                                                                                                       \
+    } while (0)
+
+// HalfSipHash-2-4
+uint32_t hash(Hasher state, const uint8_t *data, const size_t len) {
+    uint32_t v0 = 0, v1 = 0, v2 = UINT32_C(0x6c796765), v3 = UINT32_C(0x74656462);
+    uint32_t k0 = (uint32_t)state.key, k1 = (uint32_t)(state.key >> 32);
+    uint32_t m;
+    // Pointer to the end of the last 4 byte block
+    const uint8_t *end  = data + len - (len % sizeof(uint32_t));
+    const int      left = len % sizeof(uint32_t);
+    uint32_t       b    = ((uint32_t)len) << 24;
+    v3 ^= k1;
+    v2 ^= k0;
+    v1 ^= k1;
+    v0 ^= k0;
+
+    for (; data != end; data += 4) {
+        m = U8TO32_LE(data);
+        v3 ^= m;
+        for (int i = 0; i < 2; i++) {
+            SIPROUND;
+        }
+        v0 ^= m;
+    }
+
+    switch (left) {
+    case 3:
+        b |= ((uint32_t)data[2]) << 16;
+        // fallthrough
+    case 2:
+        b |= ((uint32_t)data[1]) << 8;
+        // fallthrough
+    case 1:
+        b |= ((uint32_t)data[0]);
+    }
+
+    v3 ^= b;
+    v2 ^= 0xff;
+
+    for (int i = 0; i < 4; i++) {
+        SIPROUND;
+    }
+
+    return v1 ^ v3;
+}
+
+Hasher hasher_init(void) {
+    static const Hasher HASHER = {.key = UINT64_C(0x5E3514A61CC01657)};
+    static uint64_t     count  = 0;
+    struct timespec     ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    ts.tv_sec ^= ts.tv_nsec;
+
+    uint64_t k0 = hash(HASHER, (uint8_t *)&ts.tv_sec, sizeof(ts.tv_sec));
+    uint64_t k1 = hash(HASHER, (uint8_t *)&ts.tv_nsec, sizeof(ts.tv_nsec));
+    return (Hasher){.key = k0 | k1 << 32};
+}
+
+// Must be a power of 2
+#define HASHMAP_BASE_CAP 64
+// Grow once half full, probe sequences stay short
+#define MAX_ITEMS(cap) ((cap) / 2)
+
+typedef struct {
+    uint32_t hash;
+    bool     occupied;
+} __attribute__((aligned(8))) Bucket;
+
+static void handle_alloc_error(void) {
+    printf("Error when allocating memory.\n");
+    exit(2);
+}
+
+static inline Bucket *hashmap_entry(Hashmap *map, size_t index) { return (Bucket *)(map->buckets + index * map->entry_size); }
+static inline void   *bucket_item(Bucket *bucket) { return (uint8_t *)bucket + sizeof(Bucket); }
+
+static void hashmap_alloc_buckets(Hashmap *map, size_t cap) {
+    map->cap     = cap;
+    map->mask    = cap - 1;
+    map->count   = 0;
+    map->max     = MAX_ITEMS(cap);
+    map->buckets = malloc(cap * map->entry_size);
+    if (map->buckets == NULL) {
+        handle_alloc_error();
+    }
+
+    for (size_t i = 0; i < cap; i++) {
+        hashmap_entry(map, i)->occupied = false;
+    }
+}
+
+Hashmap *hashmap_init(HashFunction hash, EqualFunction equal, DropFunction drop, size_t data_size) {
+    Hashmap *map = malloc(sizeof(Hashmap));
+    if (map == NULL) {
+        handle_alloc_error();
+    }
+
+    map->size       = data_size;
+    map->entry_size = sizeof(Bucket) + ((((data_size - 1) >> 3) + 1) << 3);
+    map->state      = hasher_init();
+    map->hash       = hash;
+    map->equal      = equal;
+    map->drop       = drop;
+    hashmap_alloc_buckets(map, HASHMAP_BASE_CAP);
+
+    return map;
+}
+
+// Return the index of the matching bucket, or of the first empty bucket if there is none
+static size_t hashmap_bucket(Hashmap *map, const void *item, uint32_t hash) {
+    size_t index = hash & map->mask;
+    while (1) {
+        Bucket *bucket = hashmap_entry(map, index);
+        if (!bucket->occupied || (bucket->hash == hash && map->equal(item, bucket_item(bucket)))) {
+            return index;
+        }
+        index = (index + 1) & map->mask;
+    }
+}
+
+static bool hashmap_insert(Hashmap *map, const void *item, uint32_t hash) {
+    Bucket *bucket  = hashmap_entry(map, hashmap_bucket(map, item, hash));
+    bool    replace = bucket->occupied;
+    if (map->drop != NULL && replace) {
+        map->drop(bucket_item(bucket));
+    }
+
+    bucket->hash     = hash;
+    bucket->occupied = true;
+    memcpy(bucket_item(bucket), item, map->size);
+    if (!replace) {
+        map->count++;
+    }
+    return replace;
+}
+
+// Grow hashmap to double the size
+static void hashmap_grow(Hashmap *map) {
+    uint8_t *old_buckets = map->buckets;
+    size_t   old_cap     = map->cap;
+
+    hashmap_alloc_buckets(map, old_cap * 2);
+
+    for (size_t i = 0; i < old_cap; i++) {
+        Bucket *bucket = (Bucket *)(old_buckets + i * map->entry_size);
+        if (bucket->occupied) {
+            hashmap_insert(map, bucket_item(bucket), bucket->hash);
+        }
+    }
+
+    free(old_buckets);
+}
+
+bool hashmap_set(Hashmap *map, const void *item) {
+    if (map->count >= map->max) {
+        hashmap_grow(map);
+    }
+
+    return hashmap_insert(map, item, map->hash(map->state, item));
+}
+
+void *hashmap_get(Hashmap *map, const void *key) {
+    Bucket *bucket = hashmap_entry(map, hashmap_bucket(map, key, map->hash(map->state, key)));
+    return bucket->occupied ? bucket_item(bucket) : NULL;
+}
+
+bool hashmap_has(Hashmap *map, const void *key) { return hashmap_get(map, key) != NULL; }
+
+bool hashmap_take(Hashmap *map, const void *key, void *dst) {
+    size_t  hole   = hashmap_bucket(map, key, map->hash(map->state, key));
+    Bucket *bucket = hashmap_entry(map, hole);
+    if (!bucket->occupied) {
+        return false;
+    }
+
+    map->count--;
+    if (dst != NULL) {
+        memcpy(dst, bucket_item(bucket), map->size);
+    } else if (map->drop != NULL) {
+        map->drop(bucket_item(bucket));
+    }
+
+    // Shift back the items after the hole that can't be found anymore: the ones whose home bucket isn't (cyclically) between
+    // the hole and where they are
+    for (size_t index = (hole + 1) & map->mask;; index = (index + 1) & map->mask) {
+        Bucket *next = hashmap_entry(map, index);
+        if (!next->occupied) {
+            break;
+        }
+
+        size_t home = next->hash & map->mask;
+        if (((index - home) & map->mask) >= ((index - hole) & map->mask)) {
+            memcpy(hashmap_entry(map, hole), next, map->entry_size);
+            hole = index;
+        }
+    }
+
+    hashmap_entry(map, hole)->occupied = false;
+    return true;
+}
+
+bool hashmap_delete(Hashmap *map, const void *key) { return hashmap_take(map, key, NULL); }
+
+void hashmap_clear(Hashmap *map) {
+    for (size_t i = 0; i < map->cap; i++) {
+        Bucket *bucket = hashmap_entry(map, i);
+        if (bucket->occupied && map->drop != NULL) {
+            map->drop(bucket_item(bucket));
+        }
+        bucket->occupied = false;
+    }
+    map->count = 0;
+}
+
+bool hashmap_iter(Hashmap *map, void *iter_) {
+    void **iter  = (void **)iter_;
+    size_t index = 0;
+    if (*iter != NULL) {
+        index = ((uint8_t *)*iter - sizeof(Bucket) - map->buckets) / map->entry_size + 1;
+    }
+
+    for (; index < map->cap; index++) {
+        Bucket *bucket = hashmap_entry(map, index);
+        if (bucket->occupied) {
+            *iter = bucket_item(bucket);
+            return true;
+        }
+    }
+    return false;
+}
+
+void hashmap_drop(Hashmap *map) {
+    hashmap_clear(map);
+    free(map->buckets);
+    free(map);
+}
@@ -0,0 +1,68 @@
+// vi:ft=c
+#ifndef HASHMAP_H_
+#define HASHMAP_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Open addressed (linear probing) hashmap of fixed size items, hashed with SipHash (ported from ser/hashmap.c)
+
+typedef struct {
+    uint64_t key;
+} Hasher;
+
+// Create new hasher with a pseudo random state
+Hasher hasher_init(void);
+// Hash given data with hasher
+uint32_t hash(Hasher state, const uint8_t *data, const size_t len);
+
+// Hash and compare the key of items, an item is used as a key to look up the items with the same key
+typedef uint32_t (*HashFunction)(Hasher state, const void *item);
+typedef bool (*EqualFunction)(const void *a, const void *b);
+typedef void (*DropFunction)(void *item);
+
+typedef struct {
+    size_t        size;
+    size_t        entry_size;
+    size_t        cap;
+    size_t        mask;
+    size_t        count;
+    size_t        max;
+    Hasher        state;
+    uint8_t      *buckets;
+    HashFunction  hash;
+    EqualFunction equal;
+    DropFunction  drop;
+} Hashmap;
+
+// Initialize a new hashmap, drop (if not NULL) is called on items overwritten or deleted
+Hashmap *hashmap_init(HashFunction hash, EqualFunction equal, DropFunction drop, size_t data_size);
+// Insert value in hashmap, returns true if the value was overwritten
+bool hashmap_set(Hashmap *map, const void *item);
+// Get value of hashmap, return NULL if not found. The pointer is invalidated by any insertion or removal.
+void *hashmap_get(Hashmap *map, const void *key);
+// Take a value from a hashmap and put it into dst (if not NULL), returns false if not found
+bool hashmap_take(Hashmap *map, const void *key, void *dst);
+// Delete entry from hashmap, returns false if not found
+bool hashmap_delete(Hashmap *map, const void *key);
+// Check if hashmap contains key
+bool hashmap_has(Hashmap *map, const void *key);
+// Clear hashmap of all entries
+void hashmap_clear(Hashmap *map);
+// Iterate hashmap: iter is a pointer to an item pointer, that must be NULL to get the first item. Returns false once every
+// item has been seen. The hashmap can't be modified while iterating.
+bool hashmap_iter(Hashmap *map, void *iter);
+// Destroy hashmap
+void hashmap_drop(Hashmap *map);
+
+// Define the hash and equal functions of a hashmap of items of type, with the key of the items at accessor
+#define impl_hashmap_key(prefix, type, accessor)                                                                                 \
+    static uint32_t prefix##_hash(Hasher state, const void *v) {                                                                 \
+        return hash(state, (const uint8_t *)&((const type *)v)->accessor, sizeof(((const type *)v)->accessor));                \
+    }                                                                                                                            \
+    static bool prefix##_equal(const void *a, const void *b) {                                                                   \
+        return ((const type *)a)->accessor == ((const type *)b)->accessor;                                                       \
+    }                                                                                                                            \
+    _Static_assert(1, "Semicolon required")
+
+#endif
@@ -1,6 +1,10 @@
 #include "hid.h"
 
 #include "const.h"
+#include "hashmap.h"
+#include "hidraw.h"
+#include "hotplug.h"
+#include "metrics.h"
 #include "server.h"
 #include "util.h"
 #include "vec.h"
@@ -14,22 +18,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-// List of ids of the currently known devices
-static Vec known_devices;
-// Queue of available devices, devices that can only be given to one client
-static Vec available_devices;
-// List of cloneable devices, devices that can be handed out to multiple clients
-static Vec cloneable_devices;
+// Set of ids (uint64_t) of the currently known devices
+static Hashmap *known_devices;
+
+// A get_device call waiting for a device, parked on the queue of every tag it asked for
+typedef struct {
+    pthread_cond_t cond;
+    bool          *stop;
+    // Set when signaled, until the waiter leaves. A woken waiter keeps its place but isn't woken again.
+    bool woken;
+} DeviceWaiter;
+
+// Devices with a tag, and what waits for them
+typedef struct {
+    // NULL for controllers without a tag
+    char *name;
+    // Queue of available devices (Controller), devices that can only be given to one client
+    Vec available;
+    // Cloneable devices (Controller) by id, devices that can be handed out to multiple clients
+    Hashmap *cloneable;
+    // DeviceWaiter *, in the order they started waiting
+    Vec waiters;
+} TagPool;
+
+// TagPool by tag id, the tags of the controllers of the config are interned by hid_init
+static TagPool *tag_pools;
+static size_t   tag_pool_count;
 // Mutex for devices
 static pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
-// Condvar notified on devices update
-static pthread_cond_t devices_cond = PTHREAD_COND_INITIALIZER;
 // Mutex for devices
 static pthread_mutex_t known_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+// eventfds written to on devices update, for threads that wait with epoll instead of devices_cond
+static Vec device_listeners = {0};
+
+// Number of times get_device had to wait for a device, and total time waited (in ns)
+static uint64_t device_waits   = 0;
+static uint64_t device_wait_ns = 0;
+
+// What probing an event node found out, kept until the node changes: a node created again is a new inode (or at least has a new
+// ctime), and so is one udev changed the permissions of. Only used by the hid thread.
+typedef struct {
+    uint64_t        id;
+    ino_t           ino;
+    dev_t           rdev;
+    struct timespec ctime;
+    // Filtered out by every controller, the node is ignored until it changes
+    bool rejected;
+    // Last scan the node was seen by, the entries of nodes that are gone are dropped after each full scan
+    uint64_t seen;
+} DeviceCacheEntry;
+
+// DeviceCacheEntry by id
+static Hashmap *device_cache;
+static uint64_t scan_count = 0;
+
+// Output worker of the hidraw interface of a device
+typedef struct {
+    uint64_t      id;
+    HidrawOutput *output;
+} HidrawOutputEntry;
+
+// HidrawOutputEntry by id, the workers are looked up for every state: controllers can outlive their device
+static Hashmap        *hidraw_outputs;
+static pthread_mutex_t hidraw_outputs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t id_hash(Hasher state, const void *id) { return hash(state, id, sizeof(uint64_t)); }
+static bool     id_equal(const void *a, const void *b) { return *(uint64_t *)a == *(uint64_t *)b; }
+impl_hashmap_key(controller, Controller, dev.id);
+impl_hashmap_key(device_cache, DeviceCacheEntry, id);
+impl_hashmap_key(hidraw_output, HidrawOutputEntry, id);
 
 static ServerConfig *config;
 
@@ -53,189 +116,435 @@ uniq_t parse_uniq(char uniq[17]) {
     return res;
 }
 
-// Finish setup of a partially initialized device (set device_info and mapping)
-void setup_device(PhysicalDevice *dev) {
-    dev->device_info.tag     = DeviceTagInfo;
-    dev->device_info.abs.len = 0;
-    dev->device_info.rel.len = 0;
-    dev->device_info.key.len = 0;
-
-    for (int i = 0; i < ABS_CNT; i++)
-        dev->mapping.abs_indices[i] = -1;
-    for (int i = 0; i < REL_CNT; i++)
-        dev->mapping.rel_indices[i] = -1;
-    for (int i = 0; i < KEY_CNT; i++)
-        dev->mapping.key_indices[i] = -1;
-
-    uint8_t type_bits[EV_MAX]            = {0};
-    uint8_t feat_bits[(KEY_MAX + 7) / 8] = {0};
-
-    ioctl(dev->event, EVIOCGBIT(0, EV_MAX), type_bits);
-    // Loop over all event types
-    for (int type = 0; type < EV_MAX; type++) {
+// Event types mapped for a device, with their number of codes (the other types are ignored)
+static const struct {
+    int    type;
+    size_t count;
+} MAPPED_TYPES[] = {
+    {EV_KEY, KEY_CNT},
+    {EV_REL, REL_CNT},
+    {EV_ABS, ABS_CNT},
+};
+
+// Look up the capabilities of a device (its device_info and mapping), the caps start with one reference
+static DeviceCaps *setup_device(int event) {
+    DeviceCaps *caps = malloc(sizeof(DeviceCaps));
+    if (caps == NULL) {
+        printf("Error when allocating memory.\n");
+        exit(2);
+    }
+    caps->refs = 1;
+
+    caps->device_info.tag     = DeviceTagInfo;
+    caps->device_info.abs.len = 0;
+    caps->device_info.rel.len = 0;
+    caps->device_info.key.len = 0;
+
+    // All ones is DEVICE_MAP_NONE
+    memset(caps->mapping.abs_indices, 0xff, sizeof(caps->mapping.abs_indices));
+    memset(caps->mapping.rel_indices, 0xff, sizeof(caps->mapping.rel_indices));
+    memset(caps->mapping.key_indices, 0xff, sizeof(caps->mapping.key_indices));
+
+    // Capability bitmaps, the kernel fills them as arrays of longs: read as words, bit i is at word i / 64
+    uint64_t type_bits[(EV_CNT + 63) / 64] = {0};
+    uint64_t code_bits[(KEY_CNT + 63) / 64];
+
+    ioctl(event, EVIOCGBIT(0, sizeof(type_bits)), type_bits);
+    for (int t = 0; t < sizeof(MAPPED_TYPES) / sizeof(MAPPED_TYPES[0]); t++) {
+        int    type  = MAPPED_TYPES[t].type;
+        size_t count = MAPPED_TYPES[t].count;
         // Ignore if the the device doesn't have any of this event type
-        if (!bit_set(type_bits, type)) {
+        if (!word_bit_get(type_bits, type)) {
             continue;
         }
-        // Clear feat_bits to only have the features of the current type
-        memset(feat_bits, 0, sizeof(feat_bits));
-        ioctl(dev->event, EVIOCGBIT(type, KEY_MAX), feat_bits);
 
-        // Loop over "instances" of type (i.e Each axis of a controller for EV_ABS)
-        for (int i = 0; i < KEY_MAX; i++) {
-            // "instances" don't have to be consecutive (this is why we do all this instead of just worrying
-            // about the count)
-            if (!bit_set(feat_bits, i)) {
-                continue;
-            }
-
-            if (type == EV_ABS) {
-                struct input_absinfo abs;
-                ioctl(dev->event, EVIOCGABS(i), &abs);
-
-                uint16_t index = dev->device_info.abs.len++;
-
-                Abs *dev_abs  = &dev->device_info.abs.data[index];
-                dev_abs->min  = abs.minimum;
-                dev_abs->max  = abs.maximum;
-                dev_abs->fuzz = abs.fuzz;
-                dev_abs->flat = abs.flat;
-                dev_abs->res  = abs.resolution;
-                dev_abs->id   = i;
-                // Bidirectional mapping id <-> index
-                // We need this to avoid wasting space in packets because ids are sparse
-                dev->mapping.abs_indices[i] = index;
-            } else if (type == EV_REL) {
-                uint16_t index = dev->device_info.rel.len++;
-
-                dev->device_info.rel.data[index].id = i;
-                dev->mapping.rel_indices[i]    = index;
-            } else if (type == EV_KEY) {
-                uint16_t index = dev->device_info.key.len++;
-
-                dev->device_info.key.data[index].id = i;
-                dev->mapping.key_indices[i]    = index;
+        // Only ask for the codes of the type, the words past them are left cleared
+        memset(code_bits, 0, words_for_bits(count) * sizeof(uint64_t));
+        ioctl(event, EVIOCGBIT(type, (count + 7) / 8), code_bits);
+
+        // Loop over the "instances" of type (i.e Each axis of a controller for EV_ABS), they don't have to be consecutive (this is
+        // why we do all this instead of just worrying about the count)
+        for (size_t w = 0; w < words_for_bits(count); w++) {
+            uint64_t bits = code_bits[w];
+            while (bits != 0) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                if (type == EV_ABS) {
+                    struct input_absinfo abs;
+                    ioctl(event, EVIOCGABS(i), &abs);
+
+                    uint16_t index = caps->device_info.abs.len++;
+
+                    Abs *dev_abs  = &caps->device_info.abs.data[index];
+                    dev_abs->min  = abs.minimum;
+                    dev_abs->max  = abs.maximum;
+                    dev_abs->fuzz = abs.fuzz;
+                    dev_abs->flat = abs.flat;
+                    dev_abs->res  = abs.resolution;
+                    dev_abs->id   = i;
+                    // Bidirectional mapping id <-> index
+                    // We need this to avoid wasting space in packets because ids are sparse
+                    caps->mapping.abs_indices[i] = index;
+                } else if (type == EV_REL) {
+                    uint16_t index = caps->device_info.rel.len++;
+
+                    caps->device_info.rel.data[index].id = i;
+                    caps->mapping.rel_indices[i]         = index;
+                } else if (type == EV_KEY) {
+                    uint16_t index = caps->device_info.key.len++;
+
+                    caps->device_info.key.data[index].id = i;
+                    caps->mapping.key_indices[i]         = index;
+                }
             }
         }
     }
+
+    return caps;
 }
 
-bool filter_event(int fd, char *event, ControllerFilter *filter, uniq_t uniq) {
+DeviceCaps *device_caps_ref(DeviceCaps *caps) {
+    if (caps != NULL) {
+        __atomic_add_fetch(&caps->refs, 1, __ATOMIC_RELAXED);
+    }
+    return caps;
+}
+
+static void device_caps_unref(DeviceCaps *caps) {
+    if (caps != NULL && __atomic_sub_fetch(&caps->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(caps);
+    }
+}
+
+// Have the kernel drop the events of the types that aren't forwarded (EV_MSC scan codes, EV_LED, EV_FF status...) instead of
+// queuing them for us. Every code of the mapped types gets mapped (see setup_device), so those are left unmasked. Kernels older
+// than 4.4 don't have EVIOCSMASK, the events are then skipped once read.
+static void mask_device_events(int event) {
+    uint64_t types[(EV_CNT + 63) / 64] = {0};
+    word_bit_put(types, EV_SYN, true);
+    for (int t = 0; t < sizeof(MAPPED_TYPES) / sizeof(MAPPED_TYPES[0]); t++) {
+        word_bit_put(types, MAPPED_TYPES[t].type, true);
+    }
+
+    struct input_mask mask = {.type = 0, .codes_size = sizeof(types), .codes_ptr = (uint64_t)(uintptr_t)types};
+    ioctl(event, EVIOCSMASK, &mask);
+}
+
+// Whether a device passes a filter, given its name, uniq and ids. retry is set when the device is only filtered out for lacking a
+// joystick node, which may show up later.
+static bool filter_event(const char *event, ControllerFilter *filter, const char *name, uniq_t uniq, struct input_id *ids,
+                         bool *retry) {
+    if (filter->name != NULL && strcmp(name, filter->name) != 0) {
+        return false;
+    }
+
+    if (filter->uniq > 0 && uniq != filter->uniq) {
+        return false;
+    }
+
+    if (filter->vendor > 0 && filter->vendor != ids->vendor)
+        return false;
+    if (filter->product > 0 && filter->product != ids->product)
+        return false;
+
     if (filter->js) {
         char device_path[64];
-        snprintf(device_path, 64, "/sys/class/input/%s/device", event);
+        snprintf(device_path, 64, FSROOT "/sys/class/input/%s/device", event);
 
         DIR           *device_dir = opendir(device_path);
         struct dirent *device_dirent;
 
         bool found = false;
-        while ((device_dirent = readdir(device_dir)) != NULL) {
+        while (device_dir != NULL && (device_dirent = readdir(device_dir)) != NULL) {
             if (device_dirent->d_type == DT_DIR && strncmp(device_dirent->d_name, "js", 2) == 0) {
                 found = true;
                 break;
             }
         }
 
-        closedir(device_dir);
+        if (device_dir != NULL) {
+            closedir(device_dir);
+        }
 
         if (!found) {
+            *retry = true;
             return false;
         }
     }
 
-    if (filter->name != NULL) {
-        char name[256] = {0};
-        ioctl(fd, EVIOCGNAME(256), name);
-        if (strcmp(name, filter->name) != 0) {
-            return false;
+    return true;
+}
+
+void hid_init(ServerConfig *server_config) {
+    config = server_config;
+
+    known_devices    = hashmap_init(id_hash, id_equal, NULL, sizeof(uint64_t));
+    device_cache     = hashmap_init(device_cache_hash, device_cache_equal, NULL, sizeof(DeviceCacheEntry));
+    hidraw_outputs   = hashmap_init(hidraw_output_hash, hidraw_output_equal, NULL, sizeof(HidrawOutputEntry));
+    device_listeners = vec_of(int);
+
+    // Intern the tags, controllers with the same tag share their id
+    tag_pools      = malloc(config->controller_count * sizeof(TagPool));
+    tag_pool_count = 0;
+    for (int i = 0; i < config->controller_count; i++) {
+        ServerConfigController *ctr = &config->controllers[i];
+
+        ctr->tag_id = -1;
+        for (int j = 0; j < tag_pool_count && ctr->tag_id < 0; j++) {
+            char *name = tag_pools[j].name;
+            if (name == ctr->tag || (name != NULL && ctr->tag != NULL && strcmp(name, ctr->tag) == 0)) {
+                ctr->tag_id = j;
+            }
+        }
+
+        if (ctr->tag_id < 0) {
+            ctr->tag_id            = tag_pool_count++;
+            tag_pools[ctr->tag_id] = (TagPool){
+                .name      = ctr->tag,
+                .available = vec_of(Controller),
+                .cloneable = hashmap_init(controller_hash, controller_equal, NULL, sizeof(Controller)),
+                .waiters   = vec_of(DeviceWaiter *),
+            };
         }
     }
+}
 
-    if (filter->uniq > 0 && uniq != filter->uniq) {
-        return false;
+int hid_tag_id(const char *name, size_t len) {
+    for (int i = 0; i < tag_pool_count; i++) {
+        char *tag = tag_pools[i].name;
+        if (tag != NULL && strncmp(tag, name, len) == 0 && tag[len] == '\0') {
+            return i;
+        }
     }
+    return -1;
+}
 
-    struct input_id ids;
-    ioctl(fd, EVIOCGID, &ids);
+static void wake_waiter(DeviceWaiter *waiter) {
+    waiter->woken = true;
+    pthread_cond_signal(&waiter->cond);
+}
 
-    if (filter->vendor > 0 && filter->vendor != ids.vendor)
-        return false;
-    if (filter->product > 0 && filter->product != ids.product)
-        return false;
+// Wake up the waiters of a tag that can get a device: every one of them if there is a cloneable device, otherwise the first
+// ones (in order) until there are as many woken as there are available devices. devices_mutex must be held.
+static void notify_tag(int tag) {
+    TagPool *pool = &tag_pools[tag];
 
-    return true;
+    if (pool->cloneable->count > 0) {
+        for (int i = 0; i < pool->waiters.len; i++) {
+            wake_waiter(*(DeviceWaiter **)vec_get(&pool->waiters, i));
+        }
+        return;
+    }
+
+    size_t woken = 0;
+    for (int i = 0; i < pool->waiters.len; i++) {
+        woken += (*(DeviceWaiter **)vec_get(&pool->waiters, i))->woken;
+    }
+    for (int i = 0; i < pool->waiters.len && woken < pool->available.len; i++) {
+        DeviceWaiter *waiter = *(DeviceWaiter **)vec_get(&pool->waiters, i);
+        if (!waiter->woken) {
+            wake_waiter(waiter);
+            woken++;
+        }
+    }
+}
+
+// Wake up what waits for devices of a tag that just became available, devices_mutex must be held
+static void notify_devices(int tag) {
+    notify_tag(tag);
+    // Workers don't wait on a tag, they look at every slot waiting for a device
+    for (int i = 0; i < device_listeners.len; i++) {
+        int fd = *(int *)vec_get(&device_listeners, i);
+        eventfd_write(fd, 1);
+    }
+}
+
+void wake_device_waiters(bool *stop) {
+    pthread_mutex_lock(&devices_mutex);
+    for (int i = 0; i < tag_pool_count; i++) {
+        for (int j = 0; j < tag_pools[i].waiters.len; j++) {
+            DeviceWaiter *waiter = *(DeviceWaiter **)vec_get(&tag_pools[i].waiters, j);
+            if (waiter->stop == stop) {
+                wake_waiter(waiter);
+            }
+        }
+    }
+    pthread_mutex_unlock(&devices_mutex);
 }
 
-// Initialize vectors for polling
-void poll_devices_init(void) {
-    known_devices     = vec_of(uint64_t);
-    cloneable_devices = vec_of(Controller);
-    available_devices = vec_of(Controller);
+// Register an eventfd to be written to every time devices may have become available
+void add_device_listener(int fd) {
+    pthread_mutex_lock(&devices_mutex);
+    vec_push(&device_listeners, &fd);
+    pthread_mutex_unlock(&devices_mutex);
 }
 
-// Find index of tag that matches any of the tags specified in the tags array (of length tag_count), returns -1 otherwise
-static int match_tags(char *tag, char **tags, size_t tag_count) {
+// Take a device with any of the tags out of the pool, devices_mutex must be held. Available devices go first, then the tags
+// are tried in order. A cloneable device is copied with a new reference on its caps (if it has any yet).
+static bool take_device(const int *tags, size_t tag_count, Controller *res, uint8_t *ref_index) {
     for (int i = 0; i < tag_count; i++) {
-        if (strcmp(tag, tags[i]) == 0) {
-            return i;
+        if (tags[i] >= 0 && tag_pools[tags[i]].available.len > 0) {
+            *ref_index = i;
+            vec_remove(&tag_pools[tags[i]].available, 0, res);
+            return true;
         }
     }
 
-    return -1;
+    for (int i = 0; i < tag_count; i++) {
+        Controller *c = NULL;
+        if (tags[i] >= 0 && hashmap_iter(tag_pools[tags[i]].cloneable, &c)) {
+            *ref_index    = i;
+            *res          = *c;
+            res->dev.caps = device_caps_ref(c->dev.caps);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Park a waiter on the queue of each of the tags
+static void park_waiter(DeviceWaiter *waiter, const int *tags, size_t tag_count) {
+    for (int i = 0; i < tag_count; i++) {
+        if (tags[i] >= 0) {
+            vec_push(&tag_pools[tags[i]].waiters, &waiter);
+        }
+    }
+}
+
+// Remove a waiter from the queues it is parked on, and pass on the wake ups it may have gotten for devices it didn't take
+static void unpark_waiter(DeviceWaiter *waiter, const int *tags, size_t tag_count) {
+    for (int i = 0; i < tag_count; i++) {
+        if (tags[i] < 0) {
+            continue;
+        }
+
+        Vec *waiters = &tag_pools[tags[i]].waiters;
+        for (int j = 0; j < waiters->len; j++) {
+            if (*(DeviceWaiter **)vec_get(waiters, j) == waiter) {
+                vec_remove(waiters, j, NULL);
+                break;
+            }
+        }
+    }
+
+    if (waiter->woken) {
+        for (int i = 0; i < tag_count; i++) {
+            if (tags[i] >= 0) {
+                notify_tag(tags[i]);
+            }
+        }
+    }
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Count the wait of a get_device call that started waiting at since, if it did wait
+static void count_device_wait(uint64_t since) {
+    if (since != 0) {
+        counter_add(&device_waits, 1);
+        counter_add(&device_wait_ns, monotonic_ns() - since);
+    }
+}
+
+// Set up the caps of a device that was just taken, if this is its first claim. This is done outside of devices_mutex: the
+// ioctls can take a while. The caps of a cloneable device are kept in its pool for the next claims, unless another claim set
+// them up first.
+static void claim_device(Controller *c) {
+    if (c->dev.caps != NULL) {
+        return;
+    }
+
+    c->dev.caps = setup_device(c->dev.event);
+    if (!c->ctr.duplicate) {
+        return;
+    }
+
+    pthread_mutex_lock(&devices_mutex);
+    Controller *pooled = hashmap_get(tag_pools[c->ctr.tag_id].cloneable, c);
+    if (pooled != NULL && pooled->dev.caps == NULL) {
+        pooled->dev.caps = device_caps_ref(c->dev.caps);
+    } else if (pooled != NULL) {
+        device_caps_unref(c->dev.caps);
+        c->dev.caps = device_caps_ref(pooled->dev.caps);
+    }
+    pthread_mutex_unlock(&devices_mutex);
 }
 
 // Block to get a device, this is thread safe
 // stop: additional condition to check before doing anything,
 // if the condition is ever found to be true the function will return immediately with a NULL pointer.
-bool get_device(char **tags, size_t tag_count, bool *stop, Controller *res, uint8_t *ref_index) {
+bool get_device(const int *tags, size_t tag_count, bool *stop, Controller *res, uint8_t *ref_index) {
+    uint64_t     waiting_since = 0;
+    DeviceWaiter waiter        = {.cond = PTHREAD_COND_INITIALIZER, .stop = stop, .woken = false};
+    bool         found;
+
     // Check if we can get one right away
     pthread_mutex_lock(&devices_mutex);
 
     while (1) {
         if (*stop) {
-            pthread_mutex_unlock(&devices_mutex);
-            return false;
+            found = false;
+            break;
         }
 
-        for (int i = 0; i < available_devices.len; i++) {
-            Controller *c     = vec_get(&available_devices, i);
-            int         index = match_tags(c->ctr.tag, tags, tag_count);
-            if (index >= 0) {
-                *ref_index = index;
-                *res       = *c;
-                vec_remove(&available_devices, i, NULL);
-                pthread_mutex_unlock(&devices_mutex);
-                return true;
-            }
+        if (take_device(tags, tag_count, res, ref_index)) {
+            found = true;
+            break;
         }
 
-        for (int i = 0; i < cloneable_devices.len; i++) {
-            Controller *c     = vec_get(&cloneable_devices, i);
-            int         index = match_tags(c->ctr.tag, tags, tag_count);
-            if (index >= 0) {
-                *ref_index = index;
-                *res       = *c;
-                pthread_mutex_unlock(&devices_mutex);
-                return true;
-            }
+        // Wait in line on the tags until woken up for a device (or to stop)
+        if (waiting_since == 0) {
+            waiting_since = monotonic_ns();
+            park_waiter(&waiter, tags, tag_count);
+        }
+
+        waiter.woken = false;
+        while (!waiter.woken) {
+            pthread_cond_wait(&waiter.cond, &devices_mutex);
         }
+    }
 
-        // Wait on condvar until there's a device and we can unlock the mutex
-        pthread_cond_wait(&devices_cond, &devices_mutex);
+    if (waiting_since != 0) {
+        unpark_waiter(&waiter, tags, tag_count);
+    }
+    pthread_mutex_unlock(&devices_mutex);
+    pthread_cond_destroy(&waiter.cond);
+    count_device_wait(waiting_since);
+    if (found) {
+        claim_device(res);
     }
+    return found;
 }
 
-// Return a device that isn't used anymore, this really only makes sense for non cloneable devices.
+// Same as get_device but never blocks, returns false if no matching device is available right now
+bool try_get_device(const int *tags, size_t tag_count, Controller *res, uint8_t *ref_index) {
+    pthread_mutex_lock(&devices_mutex);
+    bool found = take_device(tags, tag_count, res, ref_index);
+    pthread_mutex_unlock(&devices_mutex);
+    if (found) {
+        claim_device(res);
+    }
+    return found;
+}
+
+// Return a device that isn't used anymore
 void return_device(Controller *c) {
-    // If device is cloneable there is nothing to return
+    // If device is cloneable there is nothing to return, only the reference of this copy on the caps
     if (c->ctr.duplicate) {
+        device_caps_unref(c->dev.caps);
         return;
     }
 
     pthread_mutex_lock(&devices_mutex);
-    vec_push(&available_devices, c);
+    vec_push(&tag_pools[c->ctr.tag_id].available, c);
     // Signal that there are new devices
-    pthread_cond_broadcast(&devices_cond);
+    notify_devices(c->ctr.tag_id);
     pthread_mutex_unlock(&devices_mutex);
 }
 
@@ -245,14 +554,16 @@ void forget_device(Controller *c) {
 
     // If controller is cloneable we need to remove it from the cloneable list
     if (c->ctr.duplicate) {
-        for (int i = 0; i < cloneable_devices.len; i++) {
-            Controller *d = *(Controller **)vec_get(&cloneable_devices, i);
-            if (d->dev.id == c->dev.id) {
-                vec_remove(&cloneable_devices, i, NULL);
-                break;
-            }
+        Controller pooled;
+        pthread_mutex_lock(&devices_mutex);
+        bool found = hashmap_take(tag_pools[c->ctr.tag_id].cloneable, c, &pooled);
+        pthread_mutex_unlock(&devices_mutex);
+        if (found) {
+            device_caps_unref(pooled.dev.caps);
         }
     }
+    // The copies of a cloneable controller still in use keep the caps alive
+    device_caps_unref(c->dev.caps);
 
     // Free the name if it was allocated
     if (c->dev.name != NULL && c->dev.name != DEVICE_DEFAULT_NAME) {
@@ -264,225 +575,352 @@ void forget_device(Controller *c) {
 
     // try to close the file descriptor, they may be already closed if the device was unpugged.
     close(c->dev.event);
-    close(c->dev.hidraw);
 
-    // Safely remove device from the known device list
-    for (int i = 0; i < known_devices.len; i++) {
-        uint64_t *id = vec_get(&known_devices, i);
-        if (*id == c->dev.id) {
-            vec_remove(&known_devices, i, NULL);
-            break;
-        }
+    // The hidraw interface belongs to the output worker, that closes it
+    HidrawOutputEntry output = {.id = c->dev.id};
+    pthread_mutex_lock(&hidraw_outputs_mutex);
+    bool has_output = hashmap_take(hidraw_outputs, &output, &output);
+    pthread_mutex_unlock(&hidraw_outputs_mutex);
+    if (has_output) {
+        hidraw_output_stop(output.output);
     }
+
+    // Safely remove device from the known device list
+    hashmap_delete(known_devices, &c->dev.id);
     pthread_mutex_unlock(&known_devices_mutex);
 }
 
 uint64_t parse_event_name(const char *event) { return atol(event + 5); }
 
-// Find all available devices and pick up on new ones
-void poll_devices(void) {
-    // loop over all entries of /sys/class/input
-    DIR           *input_dir = opendir(FSROOT "/sys/class/input");
-    struct dirent *input;
-
-    while ((input = readdir(input_dir)) != NULL) {
-        // Ignore if the entry isn't a link or doesn't start with event
-        if (input->d_type != DT_LNK || strncmp(input->d_name, "event", 5) != 0) {
-            continue;
-        }
+// Get the cache entry of a node, NULL if there is none or it is stale (which is then dropped)
+static DeviceCacheEntry *device_cache_get(uint64_t id, struct stat *st) {
+    DeviceCacheEntry  key   = {.id = id};
+    DeviceCacheEntry *entry = hashmap_get(device_cache, &key);
+    if (entry == NULL) {
+        return NULL;
+    }
 
-        PhysicalDevice dev;
-        dev.hidraw = -1;
-        dev.uniq   = 0;
-        dev.id     = parse_event_name(input->d_name);
+    if (entry->ino == st->st_ino && entry->rdev == st->st_rdev && entry->ctime.tv_sec == st->st_ctim.tv_sec &&
+        entry->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+        entry->seen = scan_count;
+        return entry;
+    }
+    hashmap_delete(device_cache, &key);
+    return NULL;
+}
 
-        // Open /dev/input/eventXX
-        {
-            char event_path[64];
-            snprintf(event_path, 64, FSROOT "/dev/input/%s", input->d_name);
+// Set the cache entry of a node
+static void device_cache_put(uint64_t id, struct stat *st, bool rejected) {
+    DeviceCacheEntry entry = {
+        .id       = id,
+        .ino      = st->st_ino,
+        .rdev     = st->st_rdev,
+        .ctime    = st->st_ctim,
+        .rejected = rejected,
+        .seen     = scan_count,
+    };
+    hashmap_set(device_cache, &entry);
+}
 
-            dev.event = open(event_path, O_RDONLY);
+static bool device_known(uint64_t id) {
+    pthread_mutex_lock(&known_devices_mutex);
+    bool found = hashmap_has(known_devices, &id);
+    pthread_mutex_unlock(&known_devices_mutex);
+    return found;
+}
 
-            if (dev.event < 0) { // Ignore device if we couldn't open
-                continue;
-            }
+// Pick up on the device of an event node (eventXX) if it is new and passes the filters
+static void probe_device(const char *event) {
+    PhysicalDevice dev;
+    dev.hidraw = -1;
+    dev.uniq   = 0;
+    dev.id     = parse_event_name(event);
+    dev.name   = (char *)DEVICE_DEFAULT_NAME;
+    dev.caps   = NULL;
+
+    char event_path[64];
+    snprintf(event_path, 64, FSROOT "/dev/input/%s", event);
+
+    // Nodes that didn't change since they were last probed only cost a stat: rejected ones are ignored, and accepted ones only
+    // probed again if the device has been forgotten since
+    struct stat st;
+    {
+        if (stat(event_path, &st) != 0) {
+            return;
         }
 
-        // Try to get the name, default to DEFAULT_NAME if impossible
-        char *name;
-        {
-            static char name_buf[256] = {0};
-            if (ioctl(dev.event, EVIOCGNAME(256), name_buf) >= 0) {
-                name = name_buf;
-            } else {
-                name = (char *)DEVICE_DEFAULT_NAME;
-            }
+        DeviceCacheEntry *entry = device_cache_get(dev.id, &st);
+        if (entry != NULL && (entry->rejected || device_known(dev.id))) {
+            return;
         }
+    }
 
-        // Try to get uniq, drop device if we can't
-        {
-            char uniq_str[17] = {0};
+    // Open /dev/input/eventXX
+    {
+        dev.event = open(event_path, O_RDONLY);
 
-            ioctl(dev.event, EVIOCGUNIQ(17), uniq_str);
-            dev.uniq = parse_uniq(uniq_str);
+        if (dev.event < 0) { // Ignore device if we couldn't open (it may not be readable yet)
+            return;
         }
+    }
 
-        // Used for linear searches
-        bool found;
+    // Try to get the name, default to DEFAULT_NAME if impossible
+    char *name;
+    static char name_buf[256] = {0};
+    {
+        if (ioctl(dev.event, EVIOCGNAME(256), name_buf) >= 0) {
+            name = name_buf;
+        } else {
+            name_buf[0] = '\0';
+            name        = (char *)DEVICE_DEFAULT_NAME;
+        }
+    }
 
-        // Filter devices according server config
-        ServerConfigController *ctr;
-        {
-            found = false;
-            for (int i = 0; i < config->controller_count; i++) {
-                ctr = &config->controllers[i];
+    // Try to get uniq, drop device if we can't
+    {
+        char uniq_str[17] = {0};
 
-                if (filter_event(dev.event, input->d_name, &ctr->filter, dev.uniq)) {
-                    found = true;
-                    break;
-                }
+        ioctl(dev.event, EVIOCGUNIQ(17), uniq_str);
+        dev.uniq = parse_uniq(uniq_str);
+    }
+
+    // Filter devices according server config
+    ServerConfigController *ctr;
+    {
+        struct input_id ids = {0};
+        ioctl(dev.event, EVIOCGID, &ids);
+
+        bool found = false;
+        bool retry = false;
+        for (int i = 0; i < config->controller_count; i++) {
+            ctr = &config->controllers[i];
+
+            if (filter_event(event, &ctr->filter, name_buf, dev.uniq, &ids, &retry)) {
+                found = true;
+                break;
             }
+        }
 
-            if (!found) {
-                goto skip;
+        if (!found) {
+            if (!retry) {
+                device_cache_put(dev.id, &st, true);
             }
+            goto skip;
         }
+    }
+
+    // Check if we already know of this device
+    if (device_known(dev.id)) { // Device isn't new
+        device_cache_put(dev.id, &st, false);
+        goto skip;
+    }
 
-        // Check if we already know of this device
+    // Look for hidraw if the device should have one (Dualshock 4 only, with ps4_hidraw property set)
+    if (ctr->ps4_hidraw) {
+        // Attempt to find the path
+        char hidraw_path[64];
         {
-            found = false;
+            char hidraw_dir_path[256];
+            snprintf(hidraw_dir_path, 256, FSROOT "/sys/class/input/%s/device/device/hidraw", event);
 
-            pthread_mutex_lock(&known_devices_mutex);
-            for (int i = 0; i < known_devices.len; i++) {
-                uint64_t *id = vec_get(&known_devices, i);
-                if (*id == dev.id) {
-                    found = true;
+            DIR           *hidraw_dir = opendir(hidraw_dir_path);
+            struct dirent *hidraw     = NULL;
+            while (hidraw_dir != NULL && (hidraw = readdir(hidraw_dir)) != NULL) {
+                if (strncmp(hidraw->d_name, "hidraw", 6) == 0) {
                     break;
                 }
             }
-            pthread_mutex_unlock(&known_devices_mutex);
 
-            if (found) { // Device isn't new
+            if (hidraw == NULL) {
+                printf("HID:     Couldn't get hidraw of %s\n", event);
+                if (hidraw_dir != NULL) {
+                    closedir(hidraw_dir);
+                }
                 goto skip;
             }
-        }
 
-        // Look for hidraw if the device should have one (Dualshock 4 only, with ps4_hidraw property set)
-        if (ctr->ps4_hidraw) {
-            // Attempt to find the path
-            char hidraw_path[64];
-            {
-                char hidraw_dir_path[256];
-                snprintf(hidraw_dir_path, 256, FSROOT "/sys/class/input/%s/device/device/hidraw", input->d_name);
-
-                DIR           *hidraw_dir = opendir(hidraw_dir_path);
-                struct dirent *hidraw     = NULL;
-                while ((hidraw = readdir(hidraw_dir)) != NULL) {
-                    if (strncmp(hidraw->d_name, "hidraw", 6) == 0) {
-                        break;
-                    }
-                }
+            snprintf(hidraw_path, 64, FSROOT "/dev/%s", hidraw->d_name);
 
-                if (hidraw == NULL) {
-                    printf("HID:    Couldn't get hidraw of %s", input->d_name);
-                    goto skip;
-                }
+            closedir(hidraw_dir);
+        }
+        // Try to open
+        dev.hidraw = open(hidraw_path, O_WRONLY);
+        if (dev.hidraw < 0) {
+            goto skip;
+        }
+    }
 
-                snprintf(hidraw_path, 64, FSROOT "/dev/%s", hidraw->d_name);
+    // Allocate for name (only now to avoid unecessary allocations)
+    if (name != DEVICE_DEFAULT_NAME) {
+        dev.name = malloc(256);
 
-                closedir(hidraw_dir);
-            }
-            // Try to open
-            dev.hidraw = open(hidraw_path, O_WRONLY);
-            if (dev.hidraw < 0) {
-                goto skip;
-            }
+        if (dev.name == NULL) {
+            dev.name = (char *)DEVICE_DEFAULT_NAME;
+        } else {
+            strcpy(dev.name, name);
         }
+    }
 
-        // Allocate for name (only now to avoid unecessary allocations)
-        if (name != DEVICE_DEFAULT_NAME) {
-            dev.name = malloc(256);
-
-            if (dev.name == NULL) {
-                dev.name = (char *)DEVICE_DEFAULT_NAME;
+    // This code is only run if the device has passed all filters and requirements, its caps are only set up once claimed
+    {
+        mask_device_events(dev.event);
+
+        if (dev.hidraw >= 0) {
+            HidrawOutputEntry output = {.id = dev.id};
+            output.output            = hidraw_output_start(dev.hidraw, dev.id, config->hidraw_interval);
+            if (output.output == NULL) {
+                printf("HID:     Couldn't start the hidraw output of %s\n", event);
+                close(dev.hidraw);
+                dev.hidraw = -1;
             } else {
-                strcpy(dev.name, name);
+                pthread_mutex_lock(&hidraw_outputs_mutex);
+                hashmap_set(hidraw_outputs, &output);
+                pthread_mutex_unlock(&hidraw_outputs_mutex);
             }
         }
 
-        // This code is only run if the device has passed all filters and requirements
-        {
-            setup_device(&dev);
-            Controller c = {.dev = dev, .ctr = *ctr};
+        Controller c = {.dev = dev, .ctr = *ctr};
+        device_cache_put(dev.id, &st, false);
 
-            pthread_mutex_lock(&known_devices_mutex);
-            vec_push(&known_devices, &c.dev.id);
-            pthread_mutex_unlock(&known_devices_mutex);
+        pthread_mutex_lock(&known_devices_mutex);
+        hashmap_set(known_devices, &c.dev.id);
+        pthread_mutex_unlock(&known_devices_mutex);
 
-            printf("HID:     New device, %s [%s] (%s: %lu)\n", name, ctr->tag, input->d_name, dev.id);
+        printf("HID:     New device, %s [%s] (%s: %lu)\n", name, ctr->tag, event, dev.id);
 
-            if (ctr->duplicate) {
-                pthread_mutex_lock(&devices_mutex);
-                vec_push(&cloneable_devices, &c);
-                // Signal that there are new cloneable devices
-                pthread_cond_broadcast(&devices_cond);
-                pthread_mutex_unlock(&devices_mutex);
-            } else {
-                pthread_mutex_lock(&devices_mutex);
-                vec_push(&available_devices, &c);
-                // Signal that there are new devices
-                pthread_cond_broadcast(&devices_cond);
-                pthread_mutex_unlock(&devices_mutex);
-            }
+        if (ctr->duplicate) {
+            pthread_mutex_lock(&devices_mutex);
+            hashmap_set(tag_pools[ctr->tag_id].cloneable, &c);
+            // Signal that there are new cloneable devices
+            notify_devices(ctr->tag_id);
+            pthread_mutex_unlock(&devices_mutex);
+        } else {
+            pthread_mutex_lock(&devices_mutex);
+            vec_push(&tag_pools[ctr->tag_id].available, &c);
+            // Signal that there are new devices
+            notify_devices(ctr->tag_id);
+            pthread_mutex_unlock(&devices_mutex);
         }
-        // Continue here avoids running cleanup code
-        continue;
+    }
+    // Return here avoids running cleanup code
+    return;
 
-    // close open file descriptor and continue
-    skip:
-        close(dev.event);
-    };
-    closedir(input_dir);
+// close open file descriptor
+skip:
+    close(dev.event);
+}
+
+// Find all available devices and pick up on new ones
+void poll_devices(void) {
+    // loop over all entries of /sys/class/input
+    DIR           *input_dir = opendir(FSROOT "/sys/class/input");
+    struct dirent *input;
+
+    scan_count++;
+    while (input_dir != NULL && (input = readdir(input_dir)) != NULL) {
+        // Ignore if the entry isn't a link or doesn't start with event
+        if (input->d_type == DT_LNK && strncmp(input->d_name, "event", 5) == 0) {
+            probe_device(input->d_name);
+        }
+    }
+    if (input_dir != NULL) {
+        closedir(input_dir);
+    }
+
+    // Forget about the nodes that are gone (the cache can't change while being iterated)
+    Vec               gone  = vec_of(DeviceCacheEntry);
+    DeviceCacheEntry *entry = NULL;
+    while (hashmap_iter(device_cache, &entry)) {
+        if (entry->seen != scan_count) {
+            vec_push(&gone, entry);
+        }
+    }
+    for (int i = 0; i < gone.len; i++) {
+        hashmap_delete(device_cache, vec_get(&gone, i));
+    }
+    vec_free(gone);
 }
 
-// "Execute" a MessageControllerState: set the led color, rumble and flash using the hidraw interface (Dualshock 4 only)
+// Hand a MessageControllerState to the output worker of the device, to set the led color, rumble and flash using the hidraw
+// interface (Dualshock 4 only). Never waits on the device.
 void apply_controller_state(Controller *c, DeviceControllerState *state) {
-    if (c->ctr.ps4_hidraw && c->dev.hidraw < 0) {
+    HidrawOutputEntry key = {.id = c->dev.id};
+
+    pthread_mutex_lock(&hidraw_outputs_mutex);
+    HidrawOutputEntry *output = c->dev.hidraw >= 0 ? hashmap_get(hidraw_outputs, &key) : NULL;
+    if (output != NULL) {
+        hidraw_output_post(output->output, state);
+    }
+    pthread_mutex_unlock(&hidraw_outputs_mutex);
+
+    if (output == NULL) {
         printf("HID:     Trying to apply controller state on incompatible device (%lu)\n", c->dev.id);
-        return;
     }
+}
 
-    printf("HID:     (%lu) Controller state: #%02x%02x%02x flash: (%d, %d) rumble: (%d, %d)\n", c->dev.id, state->led[0],
-           state->led[1], state->led[2], state->flash_on, state->flash_off, state->small_rumble, state->big_rumble);
+void hid_metrics(Vec *out) {
+    pthread_mutex_lock(&known_devices_mutex);
+    size_t known = known_devices->count;
+    pthread_mutex_unlock(&known_devices_mutex);
 
-    uint8_t buf[32] = {0x05, 0xff, 0x00, 0x00};
+    size_t available = 0, cloneable = 0, waiting = 0;
+    pthread_mutex_lock(&devices_mutex);
+    for (int i = 0; i < tag_pool_count; i++) {
+        available += tag_pools[i].available.len;
+        cloneable += tag_pools[i].cloneable->count;
+        waiting += tag_pools[i].waiters.len;
+    }
+    pthread_mutex_unlock(&devices_mutex);
 
-    buf[4]  = state->small_rumble;
-    buf[5]  = state->big_rumble;
-    buf[6]  = state->led[0];
-    buf[7]  = state->led[1];
-    buf[8]  = state->led[2];
-    buf[9]  = state->flash_on;
-    buf[10] = state->flash_off;
+    metrics_describe(out, "jsfw_devices_known", "gauge", "Devices currently known");
+    metrics_sample(out, "jsfw_devices_known", NULL, known);
+    metrics_describe(out, "jsfw_devices_available", "gauge", "Devices waiting for a client to take them");
+    metrics_sample(out, "jsfw_devices_available", NULL, available);
+    metrics_describe(out, "jsfw_devices_cloneable", "gauge", "Cloneable devices, that any number of clients can hold");
+    metrics_sample(out, "jsfw_devices_cloneable", NULL, cloneable);
+    metrics_describe(out, "jsfw_device_waiters", "gauge", "Slots waiting in line for a device, once per tag (threaded mode)");
+    metrics_sample(out, "jsfw_device_waiters", NULL, waiting);
+    metrics_describe(out, "jsfw_get_device_waits_total", "counter", "Slots that had to wait for a device (threaded mode)");
+    metrics_sample(out, "jsfw_get_device_waits_total", NULL, counter_get(&device_waits));
+    metrics_describe(out, "jsfw_get_device_wait_seconds_total", "counter", "Time slots spent waiting for a device");
+    metrics_sample_double(out, "jsfw_get_device_wait_seconds_total", NULL, counter_get(&device_wait_ns) / 1e9);
+
+    hidraw_metrics(out);
+}
 
-    write(c->dev.hidraw, buf, 32);
-    if (state->flash_on == 0 && state->flash_off == 0) {
-        // May not be necessary
-        fsync(c->dev.hidraw);
-        // Send a second time, to reenable the led
-        write(c->dev.hidraw, buf, 32);
-    };
+// Called by hotplug_wait for every device that may have shown up
+static void hotplug_found(const char *event) {
+    if (event != NULL) {
+        probe_device(event);
+    } else {
+        poll_devices();
+    }
 }
 
 // Body of the hid thread
 void *hid_thread(void *arg) {
     printf("HID:     start\n");
-    config = arg;
+    metrics_thread_enter();
+
+    // New devices are picked up as they show up, and everything is looked at again every rescan_interval in case some were
+    // missed. Without anything to watch, that's every poll_interval instead.
+    Hotplug          hotplug;
+    struct timespec *interval = &config->poll_interval;
+    if (hotplug_open(&hotplug, config->uevent)) {
+        interval = &config->rescan_interval;
+    } else {
+        printf("HID:     Can't watch for new devices, polling instead\n");
+    }
+    uint64_t interval_ns = (uint64_t)interval->tv_sec * 1000000000 + interval->tv_nsec;
 
-    poll_devices_init();
     while (1) {
         poll_devices();
-        nanosleep(&config->poll_interval, NULL);
+
+        uint64_t rescan_at = monotonic_ns() + interval_ns;
+        uint64_t now;
+        while ((now = monotonic_ns()) < rescan_at) {
+            hotplug_wait(&hotplug, (rescan_at - now + 999999) / 1000000, hotplug_found);
+        }
     }
 
     return NULL;
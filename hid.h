@@ -3,6 +3,7 @@
 #define HID_H_
 #include "net.h"
 #include "server.h"
+#include "vec.h"
 
 #include <linux/input-event-codes.h>
 #include <stdbool.h>
@@ -21,16 +22,26 @@ typedef struct {
     uint16_t rel_indices[REL_CNT];
     uint16_t key_indices[KEY_CNT];
 } DeviceMap;
+// Index of the events a device doesn't have
+#define DEVICE_MAP_NONE UINT16_MAX
 
-// A struct representing a connected device
+// What a device can do, only looked up once a client claims the device (see get_device). Shared by the copies of a controller,
+// each holding a reference.
 typedef struct {
-    int               event;
-    int               hidraw;
-    uniq_t            uniq;
-    uint64_t          id;
-    char             *name;
-    DeviceMap         mapping;
+    uint32_t   refs;
+    DeviceMap  mapping;
     DeviceInfo device_info;
+} DeviceCaps;
+
+// A struct representing a connected device
+typedef struct {
+    int         event;
+    int         hidraw;
+    uniq_t      uniq;
+    uint64_t    id;
+    char       *name;
+    // NULL until the device is first claimed
+    DeviceCaps *caps;
 } PhysicalDevice;
 
 typedef struct {
@@ -38,10 +49,27 @@ typedef struct {
     ServerConfigController ctr;
 } Controller;
 
+// Intern the tags of the controllers of the config (setting their tag_id), before any other function is called
+void  hid_init(ServerConfig *config);
+// Get the id of a tag, -1 if no controller has it
+int   hid_tag_id(const char *name, size_t len);
 void *hid_thread(void *arg);
+// Give back a device gotten from get_device: available devices go back to their pool, cloneable ones drop their reference on
+// caps
 void  return_device(Controller *c);
 void  forget_device(Controller *c);
-bool  get_device(char **tags, size_t tag_count, bool *stop, Controller *res, uint8_t *index);
+// Take another reference on the caps of a device, for a new copy of its controller that is given back on its own
+DeviceCaps *device_caps_ref(DeviceCaps *caps);
+// Block to get a device with any of the tags (ids, -1 never matches), index is set to the index of its tag in tags. Slots
+// waiting for the same tag get devices in the order they started waiting. Returns false once *stop is true, see
+// wake_device_waiters. The caps of the device are set up if this is its first claim.
+bool  get_device(const int *tags, size_t tag_count, bool *stop, Controller *res, uint8_t *index);
+bool  try_get_device(const int *tags, size_t tag_count, Controller *res, uint8_t *index);
+// Wake up the get_device calls waiting with stop, to have them check it
+void  wake_device_waiters(bool *stop);
+void  add_device_listener(int fd);
 void  apply_controller_state(Controller *c, DeviceControllerState *state);
+// Append the metrics of devices to a snapshot
+void  hid_metrics(Vec *out);
 
 #endif
@@ -0,0 +1,141 @@
+#include "hidraw.h"
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Size of a Dualshock 4 output report (over USB)
+#define OUTPUT_REPORT_SIZE 32
+
+// States written, states replaced by a newer one before they could be written, and writes skipped because the report was
+// the same as the last one
+static uint64_t output_writes  = 0;
+static uint64_t output_merged  = 0;
+static uint64_t output_skipped = 0;
+
+static void build_output_report(DeviceControllerState *state, uint8_t buf[OUTPUT_REPORT_SIZE]) {
+    memset(buf, 0, OUTPUT_REPORT_SIZE);
+    buf[0]  = 0x05;
+    buf[1]  = 0xff;
+    buf[4]  = state->small_rumble;
+    buf[5]  = state->big_rumble;
+    buf[6]  = state->led[0];
+    buf[7]  = state->led[1];
+    buf[8]  = state->led[2];
+    buf[9]  = state->flash_on;
+    buf[10] = state->flash_off;
+}
+
+// "Execute" a DeviceControllerState: set the led color, rumble and flash
+static void write_output_report(HidrawOutput *out, DeviceControllerState *state, uint8_t buf[OUTPUT_REPORT_SIZE]) {
+    printf("HID:     (%lu) Controller state: #%02x%02x%02x flash: (%d, %d) rumble: (%d, %d)\n", out->id, state->led[0],
+           state->led[1], state->led[2], state->flash_on, state->flash_off, state->small_rumble, state->big_rumble);
+
+    write(out->fd, buf, OUTPUT_REPORT_SIZE);
+    if (state->flash_on == 0 && state->flash_off == 0) {
+        // May not be necessary
+        fsync(out->fd);
+        // Send a second time, to reenable the led
+        write(out->fd, buf, OUTPUT_REPORT_SIZE);
+    }
+    counter_add(&output_writes, 1);
+}
+
+static void *hidraw_output_thread(void *arg) {
+    HidrawOutput *out = arg;
+    metrics_thread_enter();
+
+    uint8_t last[OUTPUT_REPORT_SIZE];
+    bool    written = false;
+
+    pthread_mutex_lock(&out->lock);
+    while (true) {
+        while (!out->has_pending && !out->stop) {
+            pthread_cond_wait(&out->cond, &out->lock);
+        }
+        if (out->stop) {
+            break;
+        }
+
+        DeviceControllerState state = out->pending;
+        out->has_pending            = false;
+        pthread_mutex_unlock(&out->lock);
+
+        uint8_t buf[OUTPUT_REPORT_SIZE];
+        build_output_report(&state, buf);
+        if (written && memcmp(buf, last, OUTPUT_REPORT_SIZE) == 0) {
+            counter_add(&output_skipped, 1);
+        } else {
+            write_output_report(out, &state, buf);
+            memcpy(last, buf, OUTPUT_REPORT_SIZE);
+            written = true;
+
+            // States posted in the meantime are merged, only the latest one is written next
+            nanosleep(&out->interval, NULL);
+        }
+
+        pthread_mutex_lock(&out->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    close(out->fd);
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->cond);
+    free(out);
+    metrics_thread_exit();
+    return NULL;
+}
+
+HidrawOutput *hidraw_output_start(int fd, uint64_t id, struct timespec interval) {
+    HidrawOutput *out = calloc(1, sizeof(HidrawOutput));
+    if (out == NULL) {
+        return NULL;
+    }
+
+    out->fd       = fd;
+    out->id       = id;
+    out->interval = interval;
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->cond, NULL);
+
+    if (pthread_create(&out->thread, NULL, hidraw_output_thread, out) != 0) {
+        pthread_mutex_destroy(&out->lock);
+        pthread_cond_destroy(&out->cond);
+        free(out);
+        return NULL;
+    }
+    pthread_detach(out->thread);
+    return out;
+}
+
+void hidraw_output_post(HidrawOutput *out, DeviceControllerState *state) {
+    pthread_mutex_lock(&out->lock);
+    if (out->has_pending) {
+        counter_add(&output_merged, 1);
+    }
+    out->pending     = *state;
+    out->has_pending = true;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+}
+
+void hidraw_output_stop(HidrawOutput *out) {
+    pthread_mutex_lock(&out->lock);
+    out->stop = true;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+}
+
+void hidraw_metrics(Vec *out) {
+    metrics_describe(out, "jsfw_hidraw_writes_total", "counter", "Controller states written to hidraw interfaces");
+    metrics_sample(out, "jsfw_hidraw_writes_total", NULL, counter_get(&output_writes));
+    metrics_describe(out, "jsfw_hidraw_states_merged_total", "counter",
+                     "Controller states replaced by a newer one before they could be written");
+    metrics_sample(out, "jsfw_hidraw_states_merged_total", NULL, counter_get(&output_merged));
+    metrics_describe(out, "jsfw_hidraw_writes_skipped_total", "counter",
+                     "Controller states not written because they were the same as the last one");
+    metrics_sample(out, "jsfw_hidraw_writes_skipped_total", NULL, counter_get(&output_skipped));
+}
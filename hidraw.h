@@ -0,0 +1,37 @@
+// vi:ft=c
+#ifndef HIDRAW_H_
+#define HIDRAW_H_
+#include "net.h"
+#include "vec.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Writes the controller states of a device to its hidraw interface (Dualshock 4 only) from a thread of its own, so that
+// connections never wait on the device. Only the latest state is kept until it can be written.
+typedef struct {
+    int      fd;
+    uint64_t id;
+    // Minimum time between two writes
+    struct timespec interval;
+    pthread_t       thread;
+    // Protects the fields below, cond is signaled when a state is posted or the worker is stopped
+    pthread_mutex_t       lock;
+    pthread_cond_t        cond;
+    DeviceControllerState pending;
+    bool                  has_pending;
+    bool                  stop;
+} HidrawOutput;
+
+// Start the output worker of a device, it takes ownership of fd. Returns NULL on failure.
+HidrawOutput *hidraw_output_start(int fd, uint64_t id, struct timespec interval);
+// Hand a state to the worker, replacing the one still waiting to be written if any
+void hidraw_output_post(HidrawOutput *out, DeviceControllerState *state);
+// Stop the worker, it closes fd and frees itself once done with the write it may be doing
+void hidraw_output_stop(HidrawOutput *out);
+// Append the metrics of the output workers to a snapshot
+void hidraw_metrics(Vec *out);
+
+#endif
@@ -0,0 +1,65 @@
+#include "hist.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+static int hist_bucket(uint64_t value) {
+    if (value < 2 * HIST_HALF) {
+        return value;
+    }
+
+    // Number of low bits dropped so that HIST_SUB_BITS remain, the top one of which is always set
+    int shift = 64 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return shift * HIST_HALF + (value >> shift);
+}
+
+// Highest value falling in a bucket
+static uint64_t hist_bucket_max(int bucket) {
+    if (bucket < 2 * HIST_HALF) {
+        return bucket;
+    }
+
+    int      shift = bucket / HIST_HALF - 1;
+    uint64_t sub   = bucket - shift * HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_record_span(Histogram *h, uint64_t from, uint64_t to) {
+    uint64_t value = to > from ? to - from : 0;
+
+    __atomic_add_fetch(&h->counts[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t hist_quantile(const Histogram *h, double q) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t max   = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t rank  = q * count;
+    uint64_t seen  = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen > rank) {
+            uint64_t value = hist_bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+
+    return max;
+}
+
+void hist_format(const Histogram *h, char *buf, size_t size) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        snprintf(buf, size, "no samples");
+        return;
+    }
+
+    snprintf(buf, size, "%lu samples, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus", count,
+             hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3, hist_quantile(h, 0.99) / 1e3,
+             hist_quantile(h, 0.999) / 1e3, __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+}
@@ -0,0 +1,27 @@
+// vi:ft=c
+#ifndef HIST_H_
+#define HIST_H_
+#include <stddef.h>
+#include <stdint.h>
+
+// Values are bucketed linearly within each power of two, with 2^(HIST_SUB_BITS - 1) buckets per power of two (so a relative
+// error of at most 1/8), and exactly below 2^HIST_SUB_BITS.
+#define HIST_SUB_BITS 4
+#define HIST_HALF     (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+// HDR style histogram of durations in ns. Recording is lock free, a histogram can be printed while being recorded to.
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} Histogram;
+
+// Record the duration between from and to (0 if to is before from, as with timestamps of different clocks)
+void hist_record_span(Histogram *h, uint64_t from, uint64_t to);
+// Value below which the fraction q of the recorded values are (as the highest value of the bucket it falls in)
+uint64_t hist_quantile(const Histogram *h, double q);
+// Format the number of values, some quantiles and the max (in µs) of a histogram into buf
+void hist_format(const Histogram *h, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,147 @@
+#include "hotplug.h"
+
+#include "const.h"
+
+#include <linux/netlink.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Multicast group of the uevents sent by the kernel (udev rebroadcasts them on another one, after processing)
+#define UEVENT_KERNEL_GROUP 1
+
+// Nodes are created by the kernel (devtmpfs), but may only become readable once udev changes their permissions: IN_ATTRIB
+// catches that.
+#define HOTPLUG_WATCH_MASK (IN_CREATE | IN_ATTRIB | IN_MOVED_TO)
+
+static void hotplug_watch_input(Hotplug *h) {
+    h->input_watch = inotify_add_watch(h->inotify, FSROOT "/dev/input", HOTPLUG_WATCH_MASK);
+    if (h->input_watch < 0) {
+        printf("HID:     Can't watch " FSROOT "/dev/input yet\n");
+    }
+}
+
+bool hotplug_open(Hotplug *h, bool uevent) {
+    h->input_watch = -1;
+    h->dev_watch   = -1;
+    h->uevent      = -1;
+
+    h->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (h->inotify < 0) {
+        perror("HID:     Couldn't create inotify instance");
+    } else {
+        // /dev/input only exists once there is an input device, watching /dev tells when it gets created
+        h->dev_watch = inotify_add_watch(h->inotify, FSROOT "/dev", HOTPLUG_WATCH_MASK);
+        hotplug_watch_input(h);
+        if (h->dev_watch < 0 && h->input_watch < 0) {
+            close(h->inotify);
+            h->inotify = -1;
+        }
+    }
+
+    if (uevent) {
+        h->uevent = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = UEVENT_KERNEL_GROUP};
+        if (h->uevent < 0 || bind(h->uevent, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror("HID:     Couldn't listen to uevents");
+            if (h->uevent >= 0) {
+                close(h->uevent);
+            }
+            h->uevent = -1;
+        }
+    }
+
+    return h->inotify >= 0 || h->uevent >= 0;
+}
+
+static void hotplug_read_inotify(Hotplug *h, void (*found)(const char *name)) {
+    uint8_t buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(h->inotify, buf, sizeof(buf))) > 0) {
+        for (uint8_t *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                found(NULL);
+            } else if (ev->len == 0) {
+                continue;
+            } else if (ev->wd == h->input_watch && strncmp(ev->name, "event", 5) == 0) {
+                found(ev->name);
+            } else if ((ev->wd == h->input_watch && strncmp(ev->name, "js", 2) == 0) ||
+                       (ev->wd == h->dev_watch && strncmp(ev->name, "hidraw", 6) == 0)) {
+                // Devices filtered out because their joystick or hidraw node was missing have to be looked at again
+                found(NULL);
+            } else if (ev->wd == h->dev_watch && h->input_watch < 0 && strcmp(ev->name, "input") == 0) {
+                hotplug_watch_input(h);
+                found(NULL);
+            }
+        }
+    }
+}
+
+// Get the value of key in a uevent (key=value strings separated by '\0'), or NULL
+static const char *uevent_get(const char *msg, size_t len, const char *key) {
+    size_t key_len = strlen(key);
+    for (const char *s = msg; s < msg + len; s += strlen(s) + 1) {
+        if (strncmp(s, key, key_len) == 0 && s[key_len] == '=') {
+            return s + key_len + 1;
+        }
+    }
+    return NULL;
+}
+
+static void hotplug_read_uevent(Hotplug *h, void (*found)(const char *name)) {
+    char               msg[8192];
+    struct sockaddr_nl addr;
+    socklen_t          addr_len = sizeof(addr);
+    ssize_t            len;
+    while ((len = recvfrom(h->uevent, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&addr, &addr_len)) > 0) {
+        msg[len] = '\0';
+        // Only trust the kernel
+        if (addr.nl_pid != 0) {
+            continue;
+        }
+
+        const char *action    = uevent_get(msg, len, "ACTION");
+        const char *subsystem = uevent_get(msg, len, "SUBSYSTEM");
+        const char *devname   = uevent_get(msg, len, "DEVNAME");
+        if (action == NULL || subsystem == NULL || devname == NULL || strcmp(action, "add") != 0 ||
+            strcmp(subsystem, "input") != 0 || strncmp(devname, "input/event", 11) != 0) {
+            continue;
+        }
+
+        found(devname + 6);
+    }
+}
+
+bool hotplug_wait(Hotplug *h, int timeout, void (*found)(const char *name)) {
+    struct pollfd fds[2];
+    int           count = 0;
+    if (h->inotify >= 0) {
+        fds[count++] = (struct pollfd){.fd = h->inotify, .events = POLLIN};
+    }
+    if (h->uevent >= 0) {
+        fds[count++] = (struct pollfd){.fd = h->uevent, .events = POLLIN};
+    }
+
+    if (poll(fds, count, timeout) <= 0) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!(fds[i].revents & POLLIN)) {
+            continue;
+        }
+
+        if (fds[i].fd == h->inotify) {
+            hotplug_read_inotify(h, found);
+        } else {
+            hotplug_read_uevent(h, found);
+        }
+    }
+    return true;
+}
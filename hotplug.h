@@ -0,0 +1,23 @@
+// vi:ft=c
+#ifndef HOTPLUG_H_
+#define HOTPLUG_H_
+#include <stdbool.h>
+
+// Watches for input devices showing up: inotify on FSROOT/dev/input (and FSROOT/dev for hidraw nodes), and optionally the
+// kernel's uevents over netlink
+typedef struct {
+    // -1 when unavailable
+    int inotify;
+    int input_watch;
+    int dev_watch;
+    // -1 when unused
+    int uevent;
+} Hotplug;
+
+// Start watching, uevent enables the netlink socket. Returns false if nothing could be watched.
+bool hotplug_open(Hotplug *h, bool uevent);
+// Wait up to timeout ms for devices to show up. found is called with the name of each event node (eventXX) that may be new,
+// or with NULL when every device has to be looked at again (hidraw node created, events lost). Returns false on timeout.
+bool hotplug_wait(Hotplug *h, int timeout, void (*found)(const char *name));
+
+#endif
@@ -0,0 +1,158 @@
+#include "metrics.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Time (in ms) a connection has to send a request before being answered without HTTP, and to make room for each send of
+// the answer
+#define METRICS_REQUEST_TIMEOUT 100
+
+static uint64_t threads = 0;
+
+static char *socket_path;
+static void (*collect_metrics)(Vec *out);
+
+void metrics_thread_enter(void) { counter_add(&threads, 1); }
+void metrics_thread_exit(void) { __atomic_fetch_sub(&threads, 1, __ATOMIC_RELAXED); }
+
+static void metrics_printf(Vec *out, const char *fmt, ...) {
+    char    line[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len > 0) {
+        vec_extend(out, line, len < sizeof(line) ? len : sizeof(line) - 1);
+    }
+}
+
+void metrics_describe(Vec *out, const char *name, const char *type, const char *help) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(Vec *out, const char *name, const char *labels, uint64_t value) {
+    if (labels != NULL) {
+        metrics_printf(out, "%s{%s} %lu\n", name, labels, value);
+    } else {
+        metrics_printf(out, "%s %lu\n", name, value);
+    }
+}
+
+void metrics_sample_double(Vec *out, const char *name, const char *labels, double value) {
+    if (labels != NULL) {
+        metrics_printf(out, "%s{%s} %.9g\n", name, labels, value);
+    } else {
+        metrics_printf(out, "%s %.9g\n", name, value);
+    }
+}
+
+void metrics_escape(char *dst, size_t size, const char *value) {
+    size_t len = 0;
+    for (; *value != '\0' && len + 3 <= size; value++) {
+        if (*value == '"' || *value == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = *value;
+        } else if (*value == '\n') {
+            dst[len++] = '\\';
+            dst[len++] = 'n';
+        } else {
+            dst[len++] = *value;
+        }
+    }
+    dst[len] = '\0';
+}
+
+// Answer a connection to the metrics socket with a snapshot
+static void metrics_serve(int fd) {
+    // Prometheus (or curl) sends an HTTP request, tools like socat or nc usually don't send anything
+    char          request[512];
+    bool          http = false;
+    struct pollfd pfd  = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) > 0) {
+        ssize_t len = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+        http        = len >= 4 && strncmp(request, "GET ", 4) == 0;
+    }
+
+    Vec out = vec_of(char);
+    if (http) {
+        metrics_printf(&out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    }
+
+    metrics_describe(&out, "jsfw_threads", "gauge", "Threads currently running");
+    metrics_sample(&out, "jsfw_threads", NULL, counter_get(&threads));
+    collect_metrics(&out);
+
+    // A peer that doesn't read mustn't block the thread, the answer is cut short instead
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = METRICS_REQUEST_TIMEOUT * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    size_t sent = 0;
+    while (sent < out.len) {
+        ssize_t n = send(fd, out.data + sent, out.len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    vec_free(out);
+}
+
+static void *metrics_thread(void *_arg) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        printf("METRICS: Couldn't open socket\n");
+        return NULL;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    // A socket left by a previous run would make bind fail, anything else at that path is left alone
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("METRICS: '%s' exists and isn't a socket\n", socket_path);
+            close(sock);
+            return NULL;
+        }
+        unlink(socket_path);
+    }
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+        printf("METRICS: Couldn't listen on '%s'\n", socket_path);
+        close(sock);
+        return NULL;
+    }
+
+    metrics_thread_enter();
+    printf("METRICS: Serving metrics on '%s'\n", socket_path);
+    while (1) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        metrics_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+void metrics_start(const char *path, void (*collect)(Vec *out)) {
+    socket_path     = strdup(path);
+    collect_metrics = collect;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, metrics_thread, NULL);
+    pthread_detach(thread);
+}
@@ -0,0 +1,28 @@
+// vi:ft=c
+#ifndef METRICS_H_
+#define METRICS_H_
+#include "vec.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters are plain integers updated with relaxed atomics, counting never takes a lock
+static inline void     counter_add(uint64_t *counter, uint64_t n) { __atomic_fetch_add(counter, n, __ATOMIC_RELAXED); }
+static inline uint64_t counter_get(const uint64_t *counter) { return __atomic_load_n(counter, __ATOMIC_RELAXED); }
+
+// Count a thread as running until it calls metrics_thread_exit
+void metrics_thread_enter(void);
+void metrics_thread_exit(void);
+
+// Append the HELP and TYPE lines of a metric to a snapshot (in the Prometheus text format)
+void metrics_describe(Vec *out, const char *name, const char *type, const char *help);
+// Append a sample of a metric to a snapshot, labels are put as is between braces (none if NULL)
+void metrics_sample(Vec *out, const char *name, const char *labels, uint64_t value);
+void metrics_sample_double(Vec *out, const char *name, const char *labels, double value);
+// Escape value to be put in a label, the result is truncated to fit in size
+void metrics_escape(char *dst, size_t size, const char *value);
+// Serve snapshots built by collect to every connection on a Unix socket at path, from a thread of its own. Connections that
+// send an HTTP request get an HTTP response, the others just the snapshot.
+void metrics_start(const char *path, void (*collect)(Vec *out));
+
+#endif
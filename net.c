@@ -1,22 +1,44 @@
 // Generated file, do not edit (its not like it'll explode if you do, but its better not to)
 #include "net.h"
 #include <stdio.h>
+#include <string.h>
 
 __attribute__((unused)) static int abs_serialize(struct Abs val, byte *buf);
 __attribute__((unused)) static int abs_deserialize(struct Abs *val, const byte *buf);
 __attribute__((unused)) static void abs_free(struct Abs val);
+__attribute__((unused)) static int abs_length(const byte *buf, size_t len, size_t *offset);
+__attribute__((unused)) static int abs_delta_serialize(struct AbsDelta val, byte *buf);
+__attribute__((unused)) static int abs_delta_deserialize(struct AbsDelta *val, const byte *buf);
+__attribute__((unused)) static void abs_delta_free(struct AbsDelta val);
+__attribute__((unused)) static int abs_delta_length(const byte *buf, size_t len, size_t *offset);
+__attribute__((unused)) static int key_delta_serialize(struct KeyDelta val, byte *buf);
+__attribute__((unused)) static int key_delta_deserialize(struct KeyDelta *val, const byte *buf);
+__attribute__((unused)) static void key_delta_free(struct KeyDelta val);
+__attribute__((unused)) static int key_delta_length(const byte *buf, size_t len, size_t *offset);
 __attribute__((unused)) static int key_serialize(struct Key val, byte *buf);
 __attribute__((unused)) static int key_deserialize(struct Key *val, const byte *buf);
 __attribute__((unused)) static void key_free(struct Key val);
+__attribute__((unused)) static int key_length(const byte *buf, size_t len, size_t *offset);
 __attribute__((unused)) static int rel_serialize(struct Rel val, byte *buf);
 __attribute__((unused)) static int rel_deserialize(struct Rel *val, const byte *buf);
 __attribute__((unused)) static void rel_free(struct Rel val);
+__attribute__((unused)) static int rel_length(const byte *buf, size_t len, size_t *offset);
+__attribute__((unused)) static int rel_delta_serialize(struct RelDelta val, byte *buf);
+__attribute__((unused)) static int rel_delta_deserialize(struct RelDelta *val, const byte *buf);
+__attribute__((unused)) static void rel_delta_free(struct RelDelta val);
+__attribute__((unused)) static int rel_delta_length(const byte *buf, size_t len, size_t *offset);
 __attribute__((unused)) static int tag_list_serialize(struct TagList val, byte *buf);
 __attribute__((unused)) static int tag_list_deserialize(struct TagList *val, const byte *buf);
 __attribute__((unused)) static void tag_list_free(struct TagList val);
+__attribute__((unused)) static int tag_list_length(const byte *buf, size_t len, size_t *offset);
 __attribute__((unused)) static int tag_serialize(struct Tag val, byte *buf);
 __attribute__((unused)) static int tag_deserialize(struct Tag *val, const byte *buf);
 __attribute__((unused)) static void tag_free(struct Tag val);
+__attribute__((unused)) static int tag_length(const byte *buf, size_t len, size_t *offset);
+__attribute__((unused)) static int timing_serialize(struct Timing val, byte *buf);
+__attribute__((unused)) static int timing_deserialize(struct Timing *val, const byte *buf);
+__attribute__((unused)) static void timing_free(struct Timing val);
+__attribute__((unused)) static int timing_length(const byte *buf, size_t len, size_t *offset);
 
 static int abs_serialize(struct Abs val, byte *buf) {
     byte * base_buf = buf;
@@ -40,8 +62,58 @@ static int abs_deserialize(struct Abs *val, const byte *buf) {
     buf += 24;
     return (int)(buf - base_buf);
 }
+static int abs_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 24;
+    *offset = off;
+    return 1;
+}
 static void abs_free(struct Abs val) { }
 
+static int abs_delta_serialize(struct AbsDelta val, byte *buf) {
+    byte * base_buf = buf;
+    *(uint32_t *)&buf[0] = val.value;
+    *(uint8_t *)&buf[4] = val.index;
+    buf += 8;
+    return (int)(buf - base_buf);
+}
+static int abs_delta_deserialize(struct AbsDelta *val, const byte *buf) {
+    const byte * base_buf = buf;
+    val->value = *(uint32_t *)&buf[0];
+    val->index = *(uint8_t *)&buf[4];
+    buf += 8;
+    return (int)(buf - base_buf);
+}
+static int abs_delta_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 8;
+    *offset = off;
+    return 1;
+}
+static void abs_delta_free(struct AbsDelta val) { }
+
+static int key_delta_serialize(struct KeyDelta val, byte *buf) {
+    byte * base_buf = buf;
+    *(uint16_t *)&buf[0] = val.index;
+    *(uint8_t *)&buf[2] = val.value;
+    buf += 4;
+    return (int)(buf - base_buf);
+}
+static int key_delta_deserialize(struct KeyDelta *val, const byte *buf) {
+    const byte * base_buf = buf;
+    val->index = *(uint16_t *)&buf[0];
+    val->value = *(uint8_t *)&buf[2];
+    buf += 4;
+    return (int)(buf - base_buf);
+}
+static int key_delta_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 4;
+    *offset = off;
+    return 1;
+}
+static void key_delta_free(struct KeyDelta val) { }
+
 static int key_serialize(struct Key val, byte *buf) {
     byte * base_buf = buf;
     *(uint16_t *)&buf[0] = val.id;
@@ -54,6 +126,12 @@ static int key_deserialize(struct Key *val, const byte *buf) {
     buf += 2;
     return (int)(buf - base_buf);
 }
+static int key_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 2;
+    *offset = off;
+    return 1;
+}
 static void key_free(struct Key val) { }
 
 static int rel_serialize(struct Rel val, byte *buf) {
@@ -68,8 +146,36 @@ static int rel_deserialize(struct Rel *val, const byte *buf) {
     buf += 2;
     return (int)(buf - base_buf);
 }
+static int rel_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 2;
+    *offset = off;
+    return 1;
+}
 static void rel_free(struct Rel val) { }
 
+static int rel_delta_serialize(struct RelDelta val, byte *buf) {
+    byte * base_buf = buf;
+    *(uint32_t *)&buf[0] = val.value;
+    *(uint8_t *)&buf[4] = val.index;
+    buf += 8;
+    return (int)(buf - base_buf);
+}
+static int rel_delta_deserialize(struct RelDelta *val, const byte *buf) {
+    const byte * base_buf = buf;
+    val->value = *(uint32_t *)&buf[0];
+    val->index = *(uint8_t *)&buf[4];
+    buf += 8;
+    return (int)(buf - base_buf);
+}
+static int rel_delta_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 8;
+    *offset = off;
+    return 1;
+}
+static void rel_delta_free(struct RelDelta val) { }
+
 static int tag_list_serialize(struct TagList val, byte *buf) {
     byte * base_buf = buf;
     *(uint16_t *)&buf[0] = val.tags.len;
@@ -93,6 +199,21 @@ static int tag_list_deserialize(struct TagList *val, const byte *buf) {
     buf = (byte*)(((((uintptr_t)buf - 1) >> 1) + 1) << 1);
     return (int)(buf - base_buf);
 }
+static int tag_list_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    if(off + 2 > len)
+        return 0;
+    size_t l0_0 = *(uint16_t *)&buf[off + 0];
+    off += 2;
+    for(size_t i = 0; i < l0_0; i++) {
+        int rc = tag_length(buf, len, &off);
+        if(rc <= 0)
+            return rc;
+    }
+    off = (((off - 1) >> 1) + 1) << 1;
+    *offset = off;
+    return 1;
+}
 static void tag_list_free(struct TagList val) {
     for(size_t i = 0; i < val.tags.len; i++) {
         typeof(val.tags.data[i]) e0 = val.tags.data[i];
@@ -126,10 +247,43 @@ static int tag_deserialize(struct Tag *val, const byte *buf) {
     buf = (byte*)(((((uintptr_t)buf - 1) >> 1) + 1) << 1);
     return (int)(buf - base_buf);
 }
+static int tag_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    if(off + 2 > len)
+        return 0;
+    size_t l0_0 = *(uint16_t *)&buf[off + 0];
+    off += 2;
+    off += l0_0 * 1;
+    off = (((off - 1) >> 1) + 1) << 1;
+    *offset = off;
+    return 1;
+}
 static void tag_free(struct Tag val) {
     free(val.name.data);
 }
 
+static int timing_serialize(struct Timing val, byte *buf) {
+    byte * base_buf = buf;
+    *(uint64_t *)&buf[0] = val.event;
+    *(uint64_t *)&buf[8] = val.sent;
+    buf += 16;
+    return (int)(buf - base_buf);
+}
+static int timing_deserialize(struct Timing *val, const byte *buf) {
+    const byte * base_buf = buf;
+    val->event = *(uint64_t *)&buf[0];
+    val->sent = *(uint64_t *)&buf[8];
+    buf += 16;
+    return (int)(buf - base_buf);
+}
+static int timing_length(const byte *buf, size_t len, size_t *offset) {
+    size_t off = *offset;
+    off += 16;
+    *offset = off;
+    return 1;
+}
+static void timing_free(struct Timing val) { }
+
 int msg_device_serialize(byte *buf, size_t len, DeviceMessage *msg) {
     const byte *base_buf = buf;
     if(len < 2 * MSG_MAGIC_SIZE)
@@ -164,12 +318,18 @@ int msg_device_serialize(byte *buf, size_t len, DeviceMessage *msg) {
     }
     case DeviceTagReport: {
         *(uint16_t *)buf = DeviceTagReport;
-        *(uint16_t *)&buf[2] = msg->report.key.len;
-        *(uint8_t *)&buf[4] = msg->report.slot;
-        *(uint8_t *)&buf[5] = msg->report.index;
-        *(uint8_t *)&buf[6] = msg->report.abs.len;
-        *(uint8_t *)&buf[7] = msg->report.rel.len;
-        buf += 8;
+        *(uint32_t *)&buf[4] = msg->report.seq;
+        *(uint16_t *)&buf[8] = msg->report.key.len;
+        *(uint8_t *)&buf[10] = msg->report.slot;
+        *(uint8_t *)&buf[11] = msg->report.index;
+        *(uint8_t *)&buf[12] = msg->report.abs.len;
+        *(uint8_t *)&buf[13] = msg->report.rel.len;
+        *(uint8_t *)&buf[14] = msg->report.timing.len;
+        buf += 16;
+        for(size_t i = 0; i < msg->report.timing.len; i++) {
+            typeof(msg->report.timing.data[i]) e0 = msg->report.timing.data[i];
+            buf += timing_serialize(e0, &buf[0]);
+        }
         for(size_t i = 0; i < msg->report.abs.len; i++) {
             typeof(msg->report.abs.data[i]) e0 = msg->report.abs.data[i];
             *(uint32_t *)&buf[0] = e0;
@@ -180,11 +340,8 @@ int msg_device_serialize(byte *buf, size_t len, DeviceMessage *msg) {
             *(uint32_t *)&buf[0] = e0;
             buf += 4;
         }
-        for(size_t i = 0; i < msg->report.key.len; i++) {
-            typeof(msg->report.key.data[i]) e0 = msg->report.key.data[i];
-            *(uint8_t *)&buf[0] = e0;
-            buf += 1;
-        }
+        memcpy(buf, msg->report.key.data, (msg->report.key.len + 7) / 8);
+        buf += (msg->report.key.len + 7) / 8;
         buf = (byte*)(((((uintptr_t)buf - 1) >> 3) + 1) << 3);
         break;
     }
@@ -203,10 +360,12 @@ int msg_device_serialize(byte *buf, size_t len, DeviceMessage *msg) {
     }
     case DeviceTagRequest: {
         *(uint16_t *)buf = DeviceTagRequest;
-        msg->request._version = 1UL;
+        msg->request._version = 7UL;
         *(uint64_t *)&buf[8] = msg->request._version;
         *(uint16_t *)&buf[16] = msg->request.requests.len;
-        buf += 18;
+        *(uint16_t *)&buf[18] = msg->request.udp_port;
+        *(bool *)&buf[20] = msg->request.timing;
+        buf += 22;
         for(size_t i = 0; i < msg->request.requests.len; i++) {
             typeof(msg->request.requests.data[i]) e0 = msg->request.requests.data[i];
             buf += tag_list_serialize(e0, &buf[0]);
@@ -220,6 +379,34 @@ int msg_device_serialize(byte *buf, size_t len, DeviceMessage *msg) {
         buf += 8;
         break;
     }
+    case DeviceTagReportDelta: {
+        *(uint16_t *)buf = DeviceTagReportDelta;
+        *(uint16_t *)&buf[2] = msg->report_delta.key.len;
+        *(uint8_t *)&buf[4] = msg->report_delta.slot;
+        *(uint8_t *)&buf[5] = msg->report_delta.index;
+        *(uint8_t *)&buf[6] = msg->report_delta.abs.len;
+        *(uint8_t *)&buf[7] = msg->report_delta.rel.len;
+        *(uint8_t *)&buf[8] = msg->report_delta.timing.len;
+        buf += 16;
+        for(size_t i = 0; i < msg->report_delta.timing.len; i++) {
+            typeof(msg->report_delta.timing.data[i]) e0 = msg->report_delta.timing.data[i];
+            buf += timing_serialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.abs.len; i++) {
+            typeof(msg->report_delta.abs.data[i]) e0 = msg->report_delta.abs.data[i];
+            buf += abs_delta_serialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.rel.len; i++) {
+            typeof(msg->report_delta.rel.data[i]) e0 = msg->report_delta.rel.data[i];
+            buf += rel_delta_serialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.key.len; i++) {
+            typeof(msg->report_delta.key.data[i]) e0 = msg->report_delta.key.data[i];
+            buf += key_delta_serialize(e0, &buf[0]);
+        }
+        buf = (byte*)(((((uintptr_t)buf - 1) >> 3) + 1) << 3);
+        break;
+    }
     }
     *(MsgMagic*)buf = MSG_MAGIC_END;
     buf += MSG_MAGIC_SIZE;
@@ -264,12 +451,18 @@ int msg_device_deserialize(const byte *buf, size_t len, DeviceMessage *msg) {
     }
     case DeviceTagReport: {
         msg->tag = DeviceTagReport;
-        msg->report.key.len = *(uint16_t *)&buf[2];
-        msg->report.slot = *(uint8_t *)&buf[4];
-        msg->report.index = *(uint8_t *)&buf[5];
-        msg->report.abs.len = *(uint8_t *)&buf[6];
-        msg->report.rel.len = *(uint8_t *)&buf[7];
-        buf += 8;
+        msg->report.seq = *(uint32_t *)&buf[4];
+        msg->report.key.len = *(uint16_t *)&buf[8];
+        msg->report.slot = *(uint8_t *)&buf[10];
+        msg->report.index = *(uint8_t *)&buf[11];
+        msg->report.abs.len = *(uint8_t *)&buf[12];
+        msg->report.rel.len = *(uint8_t *)&buf[13];
+        msg->report.timing.len = *(uint8_t *)&buf[14];
+        buf += 16;
+        for(size_t i = 0; i < msg->report.timing.len; i++) {
+            typeof(&msg->report.timing.data[i]) e0 = &msg->report.timing.data[i];
+            buf += timing_deserialize(e0, &buf[0]);
+        }
         for(size_t i = 0; i < msg->report.abs.len; i++) {
             typeof(&msg->report.abs.data[i]) e0 = &msg->report.abs.data[i];
             *e0 = *(uint32_t *)&buf[0];
@@ -280,11 +473,9 @@ int msg_device_deserialize(const byte *buf, size_t len, DeviceMessage *msg) {
             *e0 = *(uint32_t *)&buf[0];
             buf += 4;
         }
-        for(size_t i = 0; i < msg->report.key.len; i++) {
-            typeof(&msg->report.key.data[i]) e0 = &msg->report.key.data[i];
-            *e0 = *(uint8_t *)&buf[0];
-            buf += 1;
-        }
+        memset(msg->report.key.data, 0, (msg->report.key.len + 63) / 64 * 8);
+        memcpy(msg->report.key.data, buf, (msg->report.key.len + 7) / 8);
+        buf += (msg->report.key.len + 7) / 8;
         buf = (byte*)(((((uintptr_t)buf - 1) >> 3) + 1) << 3);
         break;
     }
@@ -305,15 +496,17 @@ int msg_device_deserialize(const byte *buf, size_t len, DeviceMessage *msg) {
         msg->tag = DeviceTagRequest;
         msg->request._version = *(uint64_t *)&buf[8];
         msg->request.requests.len = *(uint16_t *)&buf[16];
-        buf += 18;
+        msg->request.udp_port = *(uint16_t *)&buf[18];
+        msg->request.timing = *(bool *)&buf[20];
+        buf += 22;
         msg->request.requests.data = malloc(msg->request.requests.len * sizeof(typeof(*msg->request.requests.data)));
         for(size_t i = 0; i < msg->request.requests.len; i++) {
             typeof(&msg->request.requests.data[i]) e0 = &msg->request.requests.data[i];
             buf += tag_list_deserialize(e0, &buf[0]);
         }
         buf = (byte*)(((((uintptr_t)buf - 1) >> 3) + 1) << 3);
-        if(msg->request._version != 1UL) {
-            printf("Mismatched version: peers aren't the same version, expected 1 got %lu.\n", msg->request._version);
+        if(msg->request._version != 7UL) {
+            printf("Mismatched version: peers aren't the same version, expected 7 got %lu.\n", msg->request._version);
             msg_device_free(msg);
             return -1;
         }
@@ -325,6 +518,34 @@ int msg_device_deserialize(const byte *buf, size_t len, DeviceMessage *msg) {
         buf += 8;
         break;
     }
+    case DeviceTagReportDelta: {
+        msg->tag = DeviceTagReportDelta;
+        msg->report_delta.key.len = *(uint16_t *)&buf[2];
+        msg->report_delta.slot = *(uint8_t *)&buf[4];
+        msg->report_delta.index = *(uint8_t *)&buf[5];
+        msg->report_delta.abs.len = *(uint8_t *)&buf[6];
+        msg->report_delta.rel.len = *(uint8_t *)&buf[7];
+        msg->report_delta.timing.len = *(uint8_t *)&buf[8];
+        buf += 16;
+        for(size_t i = 0; i < msg->report_delta.timing.len; i++) {
+            typeof(&msg->report_delta.timing.data[i]) e0 = &msg->report_delta.timing.data[i];
+            buf += timing_deserialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.abs.len; i++) {
+            typeof(&msg->report_delta.abs.data[i]) e0 = &msg->report_delta.abs.data[i];
+            buf += abs_delta_deserialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.rel.len; i++) {
+            typeof(&msg->report_delta.rel.data[i]) e0 = &msg->report_delta.rel.data[i];
+            buf += rel_delta_deserialize(e0, &buf[0]);
+        }
+        for(size_t i = 0; i < msg->report_delta.key.len; i++) {
+            typeof(&msg->report_delta.key.data[i]) e0 = &msg->report_delta.key.data[i];
+            buf += key_delta_deserialize(e0, &buf[0]);
+        }
+        buf = (byte*)(((((uintptr_t)buf - 1) >> 3) + 1) << 3);
+        break;
+    }
     }
     if(*(MsgMagic*)buf != MSG_MAGIC_END) {
         msg_device_free(msg);
@@ -338,6 +559,108 @@ int msg_device_deserialize(const byte *buf, size_t len, DeviceMessage *msg) {
     return (int)(buf - base_buf);
 }
 
+int msg_device_length(const byte *buf, size_t len) {
+    if(len < 2 * MSG_MAGIC_SIZE)
+        return 0;
+    if(*(MsgMagic*)buf != MSG_MAGIC_START)
+        return -1;
+    size_t off = MSG_MAGIC_SIZE;
+    switch(*(uint16_t*)&buf[off]) {
+    case DeviceTagInfo: {
+        if(off + 8 > len)
+            return 0;
+        size_t l0_0 = *(uint8_t *)&buf[off + 6];
+        if(l0_0 > 64)
+            return -1;
+        size_t l0_1 = *(uint8_t *)&buf[off + 7];
+        if(l0_1 > 16)
+            return -1;
+        size_t l0_2 = *(uint16_t *)&buf[off + 2];
+        if(l0_2 > 768)
+            return -1;
+        off += 8;
+        off += l0_0 * 24;
+        off += l0_1 * 2;
+        off += l0_2 * 2;
+        off = (((off - 1) >> 3) + 1) << 3;
+        break;
+    }
+    case DeviceTagReport: {
+        if(off + 16 > len)
+            return 0;
+        size_t l0_0 = *(uint8_t *)&buf[off + 14];
+        if(l0_0 > 1)
+            return -1;
+        size_t l0_1 = *(uint8_t *)&buf[off + 12];
+        if(l0_1 > 64)
+            return -1;
+        size_t l0_2 = *(uint8_t *)&buf[off + 13];
+        if(l0_2 > 16)
+            return -1;
+        size_t l0_3 = *(uint16_t *)&buf[off + 8];
+        if(l0_3 > 768)
+            return -1;
+        off += 16;
+        off += l0_0 * 16;
+        off += l0_1 * 4;
+        off += l0_2 * 4;
+        off += (l0_3 + 7) / 8;
+        off = (((off - 1) >> 3) + 1) << 3;
+        break;
+    }
+    case DeviceTagControllerState: {
+        off += 16;
+        break;
+    }
+    case DeviceTagRequest: {
+        if(off + 22 > len)
+            return 0;
+        size_t l0_0 = *(uint16_t *)&buf[off + 16];
+        off += 22;
+        for(size_t i = 0; i < l0_0; i++) {
+            int rc = tag_list_length(buf, len, &off);
+            if(rc <= 0)
+                return rc;
+        }
+        off = (((off - 1) >> 3) + 1) << 3;
+        break;
+    }
+    case DeviceTagDestroy: {
+        off += 8;
+        break;
+    }
+    case DeviceTagReportDelta: {
+        if(off + 16 > len)
+            return 0;
+        size_t l0_0 = *(uint8_t *)&buf[off + 8];
+        if(l0_0 > 1)
+            return -1;
+        size_t l0_1 = *(uint8_t *)&buf[off + 6];
+        if(l0_1 > 64)
+            return -1;
+        size_t l0_2 = *(uint8_t *)&buf[off + 7];
+        if(l0_2 > 16)
+            return -1;
+        size_t l0_3 = *(uint16_t *)&buf[off + 2];
+        if(l0_3 > 768)
+            return -1;
+        off += 16;
+        off += l0_0 * 16;
+        off += l0_1 * 8;
+        off += l0_2 * 8;
+        off += l0_3 * 4;
+        off = (((off - 1) >> 3) + 1) << 3;
+        break;
+    }
+    default:
+        return -1;
+    }
+    off += MSG_MAGIC_SIZE;
+    if(off > len)
+        return 0;
+    return (int)off;
+}
+
 void msg_device_free(DeviceMessage *msg) {
     switch(msg->tag) {
     case DeviceTagNone:
@@ -362,5 +685,49 @@ void msg_device_free(DeviceMessage *msg) {
     case DeviceTagDestroy: {
         break;
     }
+    case DeviceTagReportDelta: {
+        break;
+    }
     }
 }
+
+void msg_device_report_layout(const DeviceReport *msg, DeviceReportLayout *layout) {
+    layout->seq = MSG_MAGIC_SIZE + 4;
+    layout->key_len = MSG_MAGIC_SIZE + 8;
+    layout->slot = MSG_MAGIC_SIZE + 10;
+    layout->index = MSG_MAGIC_SIZE + 11;
+    layout->abs_len = MSG_MAGIC_SIZE + 12;
+    layout->rel_len = MSG_MAGIC_SIZE + 13;
+    layout->timing_len = MSG_MAGIC_SIZE + 14;
+    size_t offset = MSG_MAGIC_SIZE + 16;
+    layout->timing = offset;
+    offset += msg->timing.len * 16;
+    layout->abs = offset;
+    offset += msg->abs.len * 4;
+    layout->rel = offset;
+    offset += msg->rel.len * 4;
+    layout->key = offset;
+    offset += (msg->key.len + 7) / 8;
+    offset = (((offset - 1) >> 3) + 1) << 3;
+    layout->size = offset + MSG_MAGIC_SIZE;
+}
+
+void msg_device_report_delta_layout(const DeviceReportDelta *msg, DeviceReportDeltaLayout *layout) {
+    layout->key_len = MSG_MAGIC_SIZE + 2;
+    layout->slot = MSG_MAGIC_SIZE + 4;
+    layout->index = MSG_MAGIC_SIZE + 5;
+    layout->abs_len = MSG_MAGIC_SIZE + 6;
+    layout->rel_len = MSG_MAGIC_SIZE + 7;
+    layout->timing_len = MSG_MAGIC_SIZE + 8;
+    size_t offset = MSG_MAGIC_SIZE + 16;
+    layout->timing = offset;
+    offset += msg->timing.len * 16;
+    layout->abs = offset;
+    offset += msg->abs.len * 8;
+    layout->rel = offset;
+    offset += msg->rel.len * 8;
+    layout->key = offset;
+    offset += msg->key.len * 4;
+    offset = (((offset - 1) >> 3) + 1) << 3;
+    layout->size = offset + MSG_MAGIC_SIZE;
+}
@@ -21,6 +21,16 @@ typedef struct Abs {
     uint32_t res;
 } Abs;
 
+typedef struct AbsDelta {
+    uint8_t index;
+    uint32_t value;
+} AbsDelta;
+
+typedef struct KeyDelta {
+    uint16_t index;
+    uint8_t value;
+} KeyDelta;
+
 typedef struct Key {
     uint16_t id;
 } Key;
@@ -29,6 +39,11 @@ typedef struct Rel {
     uint16_t id;
 } Rel;
 
+typedef struct RelDelta {
+    uint8_t index;
+    uint32_t value;
+} RelDelta;
+
 typedef struct TagList {
     struct {
         uint16_t len;
@@ -43,6 +58,11 @@ typedef struct Tag {
     } name;
 } Tag;
 
+typedef struct Timing {
+    uint64_t event;
+    uint64_t sent;
+} Timing;
+
 // Device
 
 typedef enum DeviceTag {
@@ -52,6 +72,7 @@ typedef enum DeviceTag {
     DeviceTagControllerState = 3,
     DeviceTagRequest = 4,
     DeviceTagDestroy = 5,
+    DeviceTagReportDelta = 6,
 } DeviceTag;
 
 typedef struct DeviceInfo {
@@ -76,6 +97,7 @@ typedef struct DeviceReport {
     DeviceTag tag;
     uint8_t slot;
     uint8_t index;
+    uint32_t seq;
     struct {
         uint8_t len;
         uint32_t data[64];
@@ -86,8 +108,12 @@ typedef struct DeviceReport {
     } rel;
     struct {
         uint16_t len;
-        uint8_t data[768];
+        uint64_t data[12];
     } key;
+    struct {
+        uint8_t len;
+        struct Timing data[1];
+    } timing;
 } DeviceReport;
 
 typedef struct DeviceControllerState {
@@ -106,6 +132,8 @@ typedef struct DeviceRequest {
         uint16_t len;
         struct TagList *data;
     } requests;
+    uint16_t udp_port;
+    bool timing;
     uint64_t _version;
 } DeviceRequest;
 
@@ -114,6 +142,28 @@ typedef struct DeviceDestroy {
     uint16_t index;
 } DeviceDestroy;
 
+typedef struct DeviceReportDelta {
+    DeviceTag tag;
+    uint8_t slot;
+    uint8_t index;
+    struct {
+        uint8_t len;
+        struct AbsDelta data[64];
+    } abs;
+    struct {
+        uint8_t len;
+        struct RelDelta data[16];
+    } rel;
+    struct {
+        uint16_t len;
+        struct KeyDelta data[768];
+    } key;
+    struct {
+        uint8_t len;
+        struct Timing data[1];
+    } timing;
+} DeviceReportDelta;
+
 typedef union DeviceMessage {
     DeviceTag tag;
     DeviceInfo info;
@@ -121,6 +171,7 @@ typedef union DeviceMessage {
     DeviceControllerState controller_state;
     DeviceRequest request;
     DeviceDestroy destroy;
+    DeviceReportDelta report_delta;
 } DeviceMessage;
 
 // Serialize the message msg to buffer dst of size len, returns the length of the serialized message, or -1 on error (buffer overflow)
@@ -128,6 +179,80 @@ int msg_device_serialize(byte *dst, size_t len, DeviceMessage *msg);
 // Deserialize the message in the buffer src of size len into dst, return the length of the serialized message or -1 on error.
 int msg_device_deserialize(const byte *src, size_t len, DeviceMessage *dst);
 
+// Length of the message at the start of the buffer src of size len (8 aligned), as msg_device_deserialize reads it. Returns
+// 0 if src ends before the message does, or -1 if it can't be a valid message: unknown tag, or a list longer than it can
+// be. msg_device_deserialize doesn't check the lengths it reads against len, this has to be done before.
+int msg_device_length(const byte *src, size_t len);
+
 // Free the message (created by msg_device_deserialize)
 void msg_device_free(DeviceMessage *msg);
+
+// Layouts of the serialized messages marked with #[layout]: the offsets of their fields, from the start of the
+// message, for the lengths of the lists of msg (a list gets the offset of its first element), and the constant layouts
+// of the structs their lists hold. A serialized message can be patched in place with them.
+typedef struct TimingLayout {
+    size_t event;
+    size_t sent;
+    // Size of a serialized element
+    size_t size;
+} TimingLayout;
+static const TimingLayout TIMING_LAYOUT = {.event = 0, .sent = 8, .size = 16};
+
+typedef struct DeviceReportLayout {
+    size_t seq;
+    size_t key_len;
+    size_t slot;
+    size_t index;
+    size_t abs_len;
+    size_t rel_len;
+    size_t timing_len;
+    size_t timing;
+    size_t abs;
+    size_t rel;
+    size_t key;
+    // Size of the serialized message
+    size_t size;
+} DeviceReportLayout;
+void msg_device_report_layout(const DeviceReport *msg, DeviceReportLayout *layout);
+
+typedef struct AbsDeltaLayout {
+    size_t value;
+    size_t index;
+    // Size of a serialized element
+    size_t size;
+} AbsDeltaLayout;
+static const AbsDeltaLayout ABS_DELTA_LAYOUT = {.value = 0, .index = 4, .size = 8};
+
+typedef struct RelDeltaLayout {
+    size_t value;
+    size_t index;
+    // Size of a serialized element
+    size_t size;
+} RelDeltaLayout;
+static const RelDeltaLayout REL_DELTA_LAYOUT = {.value = 0, .index = 4, .size = 8};
+
+typedef struct KeyDeltaLayout {
+    size_t index;
+    size_t value;
+    // Size of a serialized element
+    size_t size;
+} KeyDeltaLayout;
+static const KeyDeltaLayout KEY_DELTA_LAYOUT = {.index = 0, .value = 2, .size = 4};
+
+typedef struct DeviceReportDeltaLayout {
+    size_t key_len;
+    size_t slot;
+    size_t index;
+    size_t abs_len;
+    size_t rel_len;
+    size_t timing_len;
+    size_t timing;
+    size_t abs;
+    size_t rel;
+    size_t key;
+    // Size of the serialized message
+    size_t size;
+} DeviceReportDeltaLayout;
+void msg_device_report_delta_layout(const DeviceReportDelta *msg, DeviceReportDeltaLayout *layout);
+
 #endif
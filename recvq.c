@@ -0,0 +1,86 @@
+#include "recvq.h"
+
+#include "util.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+void recvq_init(RecvQueue *q, size_t cap) {
+    q->buf = malloc(cap);
+    if (q->buf == NULL) {
+        panicf("Error when allocating memory.\n");
+    }
+    q->cap           = cap;
+    q->skipped_total = 0;
+    recvq_reset(q);
+}
+
+void recvq_free(RecvQueue *q) { free(q->buf); }
+
+void recvq_reset(RecvQueue *q) {
+    q->start   = 0;
+    q->end     = 0;
+    q->skipped = 0;
+}
+
+// Move the bytes left to the start of the buffer
+static void recvq_compact(RecvQueue *q) {
+    memmove(q->buf, q->buf + q->start, q->end - q->start);
+    q->end -= q->start;
+    q->start = 0;
+}
+
+ssize_t recvq_fill(RecvQueue *q, int fd) {
+    if (q->start == q->end) {
+        q->start = 0;
+        q->end   = 0;
+    } else if (q->start > 0 && q->cap - q->end < q->cap / 4) {
+        // Only a partial message is left: the copy is short
+        recvq_compact(q);
+    }
+
+    ssize_t len = recv(fd, q->buf + q->end, q->cap - q->end, 0);
+    if (len > 0) {
+        q->end += len;
+    }
+    return len;
+}
+
+// Skip the bytes at the start of the queue up to the next start magic, keeping what may be the start of a magic if there is
+// none
+static void recvq_resync(RecvQueue *q) {
+    size_t   from  = q->start + 1;
+    uint8_t *magic = memmem(q->buf + from, q->end - from, &MSG_MAGIC_START, MSG_MAGIC_SIZE);
+    size_t   to;
+    if (magic != NULL) {
+        to = magic - q->buf;
+    } else {
+        to = q->end - from < MSG_MAGIC_SIZE ? from : q->end - (MSG_MAGIC_SIZE - 1);
+    }
+
+    q->skipped = to - q->start;
+    q->skipped_total += q->skipped;
+    q->start = to;
+}
+
+int recvq_next(RecvQueue *q, DeviceMessage *msg) {
+    // The deserializer aligns to the address of the fields, which needs the message to be 8 aligned (only a resync can
+    // misalign it)
+    if (q->start % 8 != 0) {
+        recvq_compact(q);
+    }
+
+    int len = msg_device_length(q->buf + q->start, q->end - q->start);
+    if (len == 0) {
+        // A message that can't fit in the queue will never be complete
+        if (q->start > 0 || q->end < q->cap) {
+            return 0;
+        }
+    } else if (len > 0 && msg_device_deserialize(q->buf + q->start, len, msg) == len) {
+        q->start += len;
+        return 1;
+    }
+
+    recvq_resync(q);
+    return -1;
+}
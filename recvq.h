@@ -0,0 +1,34 @@
+// vi:ft=c
+#ifndef RECVQ_H_
+#define RECVQ_H_
+#include "net.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Inbound buffer of a stream socket. It is filled with as many bytes as the socket has, and the messages are decoded straight
+// from it, as soon as they are complete: a partial message is kept for the next fill. Messages are 8 aligned in the buffer,
+// as the deserializer expects.
+typedef struct {
+    uint8_t *buf;
+    size_t   cap;
+    // Bytes received but not decoded yet
+    size_t start;
+    size_t end;
+    // Bytes skipped by the last resync, and by all of them
+    size_t   skipped;
+    uint64_t skipped_total;
+} RecvQueue;
+
+void recvq_init(RecvQueue *q, size_t cap);
+void recvq_free(RecvQueue *q);
+// Forget every byte received, for a new connection
+void recvq_reset(RecvQueue *q);
+// Receive as many bytes as fit from fd, returns what recv returned
+ssize_t recvq_fill(RecvQueue *q, int fd);
+// Decode the next message. Returns 1 if msg has been filled, 0 if the next message isn't complete yet and -1 if the bytes at
+// the start of the queue aren't a valid message: they are skipped up to the next start magic (count in skipped).
+int recvq_next(RecvQueue *q, DeviceMessage *msg);
+
+#endif
@@ -0,0 +1,200 @@
+#include "sendq.h"
+
+#include "metrics.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+void sendq_init(SendQueue *q) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->control       = vec_of(uint8_t);
+    q->control_marks = vec_of(SendMark);
+    q->reports       = vec_of(QueuedReport);
+    q->out           = vec_of(uint8_t);
+    q->out_off       = 0;
+    q->failed        = false;
+    q->congested     = false;
+    q->depth         = 0;
+    q->max_depth     = 0;
+    q->coalesced     = 0;
+    q->reports_sent  = 0;
+    q->bytes_sent    = 0;
+    q->short_writes  = 0;
+}
+
+void sendq_free(SendQueue *q) {
+    for (int i = 0; i < q->reports.len; i++) {
+        vec_free(((QueuedReport *)vec_get(&q->reports, i))->bytes);
+    }
+    vec_free(q->control);
+    vec_free(q->control_marks);
+    vec_free(q->reports);
+    vec_free(q->out);
+    pthread_mutex_destroy(&q->lock);
+}
+
+void sendq_lock(SendQueue *q) { pthread_mutex_lock(&q->lock); }
+void sendq_unlock(SendQueue *q) { pthread_mutex_unlock(&q->lock); }
+
+// Get the waiting report of a slot, creating the ones missing
+static QueuedReport *sendq_report(SendQueue *q, int slot) {
+    while (q->reports.len <= slot) {
+        QueuedReport report = {.bytes = vec_of(uint8_t)};
+        vec_push(&q->reports, &report);
+    }
+    return vec_get(&q->reports, slot);
+}
+
+// Move the waiting report of a slot (if any) at the end of the bytes of dst (control or out), it will be sent from there
+static void sendq_move_report(SendQueue *q, QueuedReport *report, Vec *dst) {
+    if (report->bytes.len == 0) {
+        return;
+    }
+
+    if (report->mark.delay != NULL) {
+        SendMark mark = {.at = dst->len + report->mark.at, .delay = report->mark.delay};
+        vec_push(&q->control_marks, &mark);
+    }
+    vec_extend(dst, report->bytes.data, report->bytes.len);
+    vec_clear(&report->bytes);
+    counter_add(&q->reports_sent, 1);
+}
+
+static void sendq_grew(SendQueue *q) {
+    q->depth++;
+    if (q->depth > q->max_depth) {
+        q->max_depth = q->depth;
+    }
+}
+
+bool sendq_push_control(SendQueue *q, int slot, const uint8_t *buf, size_t len) {
+    sendq_lock(q);
+    if (q->failed) {
+        sendq_unlock(q);
+        return false;
+    }
+
+    // The waiting report predates the message, it has to go first
+    sendq_move_report(q, sendq_report(q, slot), &q->control);
+
+    vec_extend(&q->control, (void *)buf, len);
+    sendq_grew(q);
+    sendq_unlock(q);
+    return true;
+}
+
+bool sendq_replaces(SendQueue *q, int slot) {
+    return q->congested && slot < q->reports.len && sendq_report(q, slot)->bytes.len > 0;
+}
+
+void sendq_put_report(SendQueue *q, int slot, const uint8_t *buf, size_t len, size_t sent_at, Histogram *delay) {
+    QueuedReport *report = sendq_report(q, slot);
+    if (report->bytes.len > 0 && q->congested) {
+        q->coalesced++;
+        vec_clear(&report->bytes);
+    } else {
+        // The waiting report keeps its place, ahead of anything queued later
+        sendq_move_report(q, report, &q->control);
+        sendq_grew(q);
+    }
+    vec_extend(&report->bytes, (void *)buf, len);
+    report->mark = (SendMark){.at = sent_at, .delay = delay};
+}
+
+bool sendq_pending(SendQueue *q) {
+    sendq_lock(q);
+    bool pending = !q->failed && (q->out_off < q->out.len || q->depth > 0);
+    sendq_unlock(q);
+    return pending;
+}
+
+const uint8_t *sendq_take(SendQueue *q, size_t *len) {
+    if (q->failed) {
+        return NULL;
+    }
+
+    if (q->out_off >= q->out.len) {
+        if (q->depth == 0) {
+            return NULL;
+        }
+
+        vec_clear(&q->out);
+        q->out_off = 0;
+        vec_extend(&q->out, q->control.data, q->control.len);
+        vec_clear(&q->control);
+        for (int i = 0; i < q->reports.len; i++) {
+            sendq_move_report(q, vec_get(&q->reports, i), &q->out);
+        }
+        q->depth = 0;
+
+        // The batch is about to be sent, the marks of control are now offsets into out as well
+        for (int i = 0; i < q->control_marks.len; i++) {
+            SendMark *mark = vec_get(&q->control_marks, i);
+            sendq_stamp(q->out.data + mark->at, mark->delay);
+        }
+        vec_clear(&q->control_marks);
+    }
+
+    *len = q->out.len - q->out_off;
+    return q->out.data + q->out_off;
+}
+
+void sendq_stamp(uint8_t *field, Histogram *delay) {
+    uint64_t serialized, now = realtime_ns();
+    memcpy(&serialized, field, sizeof(serialized));
+    memcpy(field, &now, sizeof(now));
+    hist_record_span(delay, serialized, now);
+}
+
+void sendq_sent(SendQueue *q, ssize_t len) {
+    if (len < 0) {
+        q->failed = true;
+        return;
+    }
+
+    if (len < q->out.len - q->out_off) {
+        counter_add(&q->short_writes, 1);
+    }
+    counter_add(&q->bytes_sent, len);
+    q->out_off += len;
+}
+
+int sendq_drain(SendQueue *q, int fd) {
+    sendq_lock(q);
+
+    int rc = 1;
+    while (!q->failed) {
+        // A new batch is only taken once the socket has room for it
+        if (q->out_off >= q->out.len) {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if (q->depth == 0) {
+                break;
+            } else if (poll(&pfd, 1, 0) > 0 && pfd.revents & (POLLERR | POLLHUP)) {
+                q->failed = true;
+                break;
+            } else if (!(pfd.revents & POLLOUT)) {
+                rc = 0;
+                break;
+            }
+        }
+
+        size_t         len;
+        const uint8_t *buf = sendq_take(q, &len);
+        ssize_t        n   = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            rc = 0;
+            break;
+        }
+        sendq_sent(q, n);
+    }
+
+    if (q->failed) {
+        rc = -1;
+    }
+    q->congested = rc == 0;
+    sendq_unlock(q);
+    return rc;
+}
@@ -0,0 +1,80 @@
+// vi:ft=c
+#ifndef SENDQ_H_
+#define SENDQ_H_
+#include "hist.h"
+#include "vec.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A report carrying its timing: the time it was serialized, at offset at of the queued bytes, is replaced by the time it is
+// handed to the socket, and the time in between recorded to delay
+typedef struct {
+    size_t     at;
+    Histogram *delay;
+} SendMark;
+
+// Report waiting to be sent for a slot
+typedef struct {
+    // Empty when there is none
+    Vec bytes;
+    // delay is NULL when the report doesn't carry its timing
+    SendMark mark;
+} QueuedReport;
+
+// Outbound queue of a connection. Control messages (device info, destroy) are all sent in order. Reports are too while the
+// socket keeps up, but once it doesn't only the latest report of each slot is kept: a report queued while the previous one
+// of the same slot is still waiting replaces it.
+typedef struct {
+    pthread_mutex_t lock;
+    // Serialized control messages, in order, and the marks of the reports among them (with offsets into control)
+    Vec control;
+    Vec control_marks;
+    // Vec of QueuedReport, for each slot
+    Vec reports;
+    // Bytes being sent (from out_off), nothing more is taken from the queue before they are all sent
+    Vec    out;
+    size_t out_off;
+    // Set once a send failed, every later push is refused
+    bool failed;
+    // Set while the socket doesn't keep up with what is queued, reports are replaced instead of queued behind each other
+    bool congested;
+    // Number of messages waiting (not counting the ones in out), the highest it has been, and number of reports replaced
+    size_t   depth;
+    size_t   max_depth;
+    uint64_t coalesced;
+    // Reports sent (or about to be, they can't be replaced anymore), bytes sent and sends that didn't take all they were
+    // given. Exported as metrics, they are updated with relaxed atomics and can be read without the lock.
+    uint64_t reports_sent;
+    uint64_t bytes_sent;
+    uint64_t short_writes;
+} SendQueue;
+
+void sendq_init(SendQueue *q);
+void sendq_free(SendQueue *q);
+void sendq_lock(SendQueue *q);
+void sendq_unlock(SendQueue *q);
+// Queue a control message of a slot, sent after the report of the slot waiting (if any). Returns false if the queue failed.
+bool sendq_push_control(SendQueue *q, int slot, const uint8_t *buf, size_t len);
+// Whether a report of the slot queued now would replace the one waiting, the lock must be held
+bool sendq_replaces(SendQueue *q, int slot);
+// Queue a report of a slot, replacing the one waiting (if any) when congested, the lock must be held. If delay isn't NULL,
+// the report carries its timing, with the time it was serialized as a u64 at offset sent_at (see SendMark).
+void sendq_put_report(SendQueue *q, int slot, const uint8_t *buf, size_t len, size_t sent_at, Histogram *delay);
+// Whether there is anything left to send
+bool sendq_pending(SendQueue *q);
+// Get the bytes to send next, moving everything queued to out if it has all been sent. Returns NULL if there is nothing to
+// send, the lock must be held.
+const uint8_t *sendq_take(SendQueue *q, size_t *len);
+// Replace the serialization time at field by the current time, and record the time in between to delay
+void sendq_stamp(uint8_t *field, Histogram *delay);
+// Mark len bytes returned by sendq_take as sent, a negative len marks the queue as failed. The lock must be held.
+void sendq_sent(SendQueue *q, ssize_t len);
+// Send as much as possible on fd without blocking. Nothing more is taken from the queue while fd isn't writable, so that
+// reports keep being replaced instead of piling up in the socket. Returns -1 on error, 0 if something is left and 1 when
+// everything has been sent.
+int sendq_drain(SendQueue *q, int fd);
+
+#endif
@@ -32,6 +32,13 @@ static inline const char *array_size_type(uint64_t size) {
     }
 }
 
+static inline bool is_bitset(TypeObject *type) {
+    return type->kind == TypeArray && type->type.array.type->kind == TypePrimitif &&
+           type->type.array.type->type.primitif == Primitif_bit;
+}
+
+static inline uint64_t bitset_words(TypeObject *type) { return (type->type.array.size + 63) / 64; }
+
 static void write_field(Writer *w, Field f, Modifier *mods, size_t len, uint32_t indent);
 // Wrte the *base* type type with indentation
 static void write_type(Writer *w, TypeObject *type, uint32_t indent) {
@@ -53,6 +60,7 @@ static void write_type(Writer *w, TypeObject *type, uint32_t indent) {
             _case(f64, double);
             _case(char, char);
             _case(bool, bool);
+            _case(bit, uint64_t);
         }
 #undef _case
     } else if (type->kind == TypeStruct) {
@@ -61,6 +69,11 @@ static void write_type(Writer *w, TypeObject *type, uint32_t indent) {
         if (type->type.array.sizing == SizingMax) {
             const char *len_type = array_size_type(type->type.array.size);
             wt_format(w, "%*sstruct {\n%*s%s len;\n", indent, "", indent + INDENT, "", len_type);
+            if (is_bitset(type)) {
+                // Bitsets are stored as 64 bits words, len is the number of bits
+                wt_format(w, "%*suint64_t data[%lu];\n%*s} ", indent + INDENT, "", bitset_words(type), indent, "");
+                return;
+            }
             Field f = {.name = STRING_SLICE("data"), .type = type->type.array.type};
             Modifier mod;
             if (type->type.array.heap) {
@@ -289,7 +302,10 @@ static void write_type_serialization(
     Alignment align = al.align;
     size_t offset = al.offset;
 
-    offset += calign_to(al, layout->fields.data[0].type->align);
+    // The padding before the first field counts for the alignment of the next ones
+    uint8_t padding = calign_to(al, layout->fields.data[0].type->align);
+    offset += padding;
+    al = calign_add(al, padding);
 
     if (layout->type->kind == TypeStruct && layout->type->type.struct_.has_funcs && !always_inline) {
         char *name = pascal_to_snake_case(layout->type->type.struct_.name);
@@ -322,6 +338,19 @@ static void write_type_serialization(
             // Access the length instead of data
             flen.indices.data[flen.indices.len - 1] = 0;
 
+            if (farr.type == &PRIMITIF_bit) {
+                // Bitsets are sent as the bytes holding the first len bits
+                wt_format(w, "%*smemcpy(buf, %s", indent, "", base);
+                write_accessor(w, layout->type, farr, ptr);
+                wt_format(w, ", (%s", base);
+                write_accessor(w, layout->type, flen, ptr);
+                wt_format(w, " + 7) / 8);\n%*sbuf += (%s", indent, "", base);
+                write_accessor(w, layout->type, flen, ptr);
+                wt_format(w, " + 7) / 8;\n");
+                field_accessor_drop(flen);
+                continue;
+            }
+
             wt_format(w, "%*sfor(size_t i = 0; i < %s", indent, "", base);
             write_accessor(w, layout->type, flen, ptr);
             field_accessor_drop(flen);
@@ -364,7 +393,10 @@ static void write_type_deserialization(
     Alignment align = al.align;
     size_t offset = al.offset;
 
-    offset += calign_to(al, layout->fields.data[0].type->align);
+    // The padding before the first field counts for the alignment of the next ones
+    uint8_t padding = calign_to(al, layout->fields.data[0].type->align);
+    offset += padding;
+    al = calign_add(al, padding);
 
     if (layout->type->kind == TypeStruct && layout->type->type.struct_.has_funcs && !always_inline) {
         char *name = pascal_to_snake_case(layout->type->type.struct_.name);
@@ -403,6 +435,23 @@ static void write_type_deserialization(
             // Access the length instead of data
             flen.indices.data[flen.indices.len - 1] = 0;
 
+            if (farr.type == &PRIMITIF_bit) {
+                // Clear the words first so the bits past len are zero
+                wt_format(w, "%*smemset(%s", indent, "", base);
+                write_accessor(w, layout->type, farr, ptr);
+                wt_format(w, ", 0, (%s", base);
+                write_accessor(w, layout->type, flen, ptr);
+                wt_format(w, " + 63) / 64 * 8);\n%*smemcpy(%s", indent, "", base);
+                write_accessor(w, layout->type, farr, ptr);
+                wt_format(w, ", buf, (%s", base);
+                write_accessor(w, layout->type, flen, ptr);
+                wt_format(w, " + 7) / 8);\n%*sbuf += (%s", indent, "", base);
+                write_accessor(w, layout->type, flen, ptr);
+                wt_format(w, " + 7) / 8;\n");
+                field_accessor_drop(flen);
+                continue;
+            }
+
             if (is_field_accessor_heap_array(farr, layout->type)) {
                 wt_format(w, "%*s%s", indent, "", base);
                 write_accessor(w, layout->type, farr, ptr);
@@ -445,6 +494,135 @@ static void write_type_deserialization(
     }
 }
 
+// Size of a serialized value of the type of layout, or 0 if it depends on the value (the type holds lists)
+static uint64_t layout_static_size(Layout *layout) {
+    if (layout->fields.len == 0)
+        return 0;
+
+    CurrentAlignment al = {.align = layout->type->align, .offset = 0};
+    uint64_t offset = calign_to(al, layout->fields.data[0].type->align);
+    for (size_t i = 0; i < layout->fields.len; i++) {
+        uint64_t size = layout->fields.data[i].size;
+        if (size == 0)
+            return 0;
+        offset += size;
+        al = calign_add(al, size);
+    }
+    return offset + calign_to(al, layout->type->align);
+}
+
+// The list whose length is the field accessed by fa, NULL if it isn't the length of a list
+static TypeObject *field_accessor_length_of(FieldAccessor fa, TypeObject *base_type) {
+    TypeObject *t = base_type;
+    for (size_t i = 0; i < fa.indices.len; i++) {
+        uint64_t index = fa.indices.data[i];
+
+        if (t->kind == TypeStruct) {
+            StructObject *st = (StructObject *)&t->type.struct_;
+            t = st->fields.data[index].type;
+        } else if (t->kind == TypeArray) {
+            if (t->type.array.sizing == SizingMax && index == 0) {
+                return i == fa.indices.len - 1 ? t : NULL;
+            }
+            t = t->type.array.type;
+        }
+    }
+    return NULL;
+}
+
+// Write the code moving off past a serialized value at off in buf of size len, for the check of the length of a message:
+// the function returns 0 if buf ends before the lengths of the lists do, and -1 if a list is longer than it can be. Same
+// walk as write_type_deserialization.
+static void write_type_length(Writer *w, Layout *layout, CurrentAlignment al, Hashmap *layouts, size_t indent, size_t depth, bool always_inline) {
+    if (layout->fields.len == 0)
+        return;
+
+    Alignment align = al.align;
+    size_t offset = al.offset;
+
+    uint8_t padding = calign_to(al, layout->fields.data[0].type->align);
+    offset += padding;
+    al = calign_add(al, padding);
+
+    if (layout->type->kind == TypeStruct && layout->type->type.struct_.has_funcs && !always_inline) {
+        char *name = pascal_to_snake_case(layout->type->type.struct_.name);
+        if (offset > 0) {
+            wt_format(w, "%*soff += %lu;\n", indent, "", offset);
+        }
+        wt_format(w, "%*sint rc = %s_length(buf, len, &off);\n", indent, "", name);
+        wt_format(w, "%*sif(rc <= 0)\n%*sreturn rc;\n", indent, "", indent + INDENT, "");
+        free(name);
+        return;
+    }
+
+    // Offsets of the fields before the lists
+    uint64_t *offsets = malloc(layout->fields.len * sizeof(uint64_t));
+    assert_alloc(offsets);
+
+    size_t i = 0;
+    for (; i < layout->fields.len && layout->fields.data[i].size != 0; i++) {
+        offsets[i] = offset;
+        offset += layout->fields.data[i].size;
+        al = calign_add(al, layout->fields.data[i].size);
+    }
+
+    if (i < layout->fields.len) {
+        offset += calign_to(al, layout->fields.data[i].type->align);
+        wt_format(w, "%*sif(off + %lu > len)\n%*sreturn 0;\n", indent, "", offset, indent + INDENT, "");
+
+        // The lengths of the lists, in the order of the lists
+        size_t first_list = i;
+        for (size_t j = first_list; j < layout->fields.len; j++) {
+            FieldAccessor flen = field_accessor_clone(&layout->fields.data[j]);
+            flen.indices.data[flen.indices.len - 1] = 0;
+
+            size_t k = 0;
+            for (; k < first_list; k++) {
+                UInt64Vec indices = layout->fields.data[k].indices;
+                if (indices.len == flen.indices.len && memcmp(indices.data, flen.indices.data, indices.len * sizeof(uint64_t)) == 0)
+                    break;
+            }
+            assert(k < first_list, "List without a length (How ?)");
+
+            TypeObject *list = field_accessor_length_of(layout->fields.data[k], layout->type);
+            wt_format(w, "%*ssize_t l%lu_%lu = *(", indent, "", depth, j - first_list);
+            write_type(w, layout->fields.data[k].type, 0);
+            wt_format(w, "*)&buf[off + %lu];\n", offsets[k]);
+            if (list != NULL && !list->type.array.heap) {
+                wt_format(w, "%*sif(l%lu_%lu > %lu)\n%*sreturn -1;\n", indent, "", depth, j - first_list, list->type.array.size, indent + INDENT, "");
+            }
+            field_accessor_drop(flen);
+        }
+        wt_format(w, "%*soff += %lu;\n", indent, "", offset);
+
+        for (size_t j = first_list; j < layout->fields.len; j++) {
+            FieldAccessor farr = layout->fields.data[j];
+            if (farr.type == &PRIMITIF_bit) {
+                wt_format(w, "%*soff += (l%lu_%lu + 7) / 8;\n", indent, "", depth, j - first_list);
+                continue;
+            }
+
+            Layout *arr_layout = hashmap_get(layouts, &(Layout){.type = farr.type});
+            assert(arr_layout != NULL, "Type has no layout (How ?)");
+            uint64_t size = layout_static_size(arr_layout);
+            if (size != 0) {
+                wt_format(w, "%*soff += l%lu_%lu * %lu;\n", indent, "", depth, j - first_list, size);
+                continue;
+            }
+
+            wt_format(w, "%*sfor(size_t i = 0; i < l%lu_%lu; i++) {\n", indent, "", depth, j - first_list);
+            write_type_length(w, arr_layout, (CurrentAlignment){.align = farr.type->align, .offset = 0}, layouts, indent + INDENT, depth + 1, false);
+            wt_format(w, "%*s}\n", indent, "");
+        }
+        wt_format(w, "%*soff = (((off - 1) >> %u) + 1) << %u;\n", indent, "", align.po2, align.po2);
+    } else {
+        offset += calign_to(al, align);
+        wt_format(w, "%*soff += %lu;\n", indent, "", offset);
+    }
+
+    free(offsets);
+}
+
 static int write_type_free(Writer *w, const char *base, TypeObject *type, Hashmap *layouts, size_t indent, size_t depth, bool always_inline) {
     if (type->kind == TypePrimitif) {
         return 0;
@@ -518,6 +696,7 @@ static void write_struct_func_decl(Writer *w, StructObject *obj, void *_user_dat
     wt_format(w, "__attribute__((unused)) static int %s_serialize(struct %.*s val, byte *buf);\n", snake_case_name, sname.len, sname.ptr);
     wt_format(w, "__attribute__((unused)) static int %s_deserialize(struct %.*s *val, const byte *buf);\n", snake_case_name, sname.len, sname.ptr);
     wt_format(w, "__attribute__((unused)) static void %s_free(struct %.*s val);\n", snake_case_name, sname.len, sname.ptr);
+    wt_format(w, "__attribute__((unused)) static int %s_length(const byte *buf, size_t len, size_t *offset);\n", snake_case_name);
     free(snake_case_name);
 }
 
@@ -543,6 +722,14 @@ static void write_struct_func(Writer *w, StructObject *obj, void *user_data) {
     wt_format(w, "%*sreturn (int)(buf - base_buf);\n", INDENT, "");
     wt_format(w, "}\n");
 
+    // Moves *offset past the value, returns 1, or 0 if buf ends before its lists do, -1 if a list is longer than it can be
+    wt_format(w, "static int %s_length(const byte *buf, size_t len, size_t *offset) {\n", snake_case_name);
+    wt_format(w, "%*ssize_t off = *offset;\n", INDENT, "");
+    write_type_length(w, layout, (CurrentAlignment){.offset = 0, .align = t->align}, layouts, INDENT, 0, true);
+    wt_format(w, "%*s*offset = off;\n", INDENT, "");
+    wt_format(w, "%*sreturn 1;\n", INDENT, "");
+    wt_format(w, "}\n");
+
     wt_format(w, "static void %s_free(struct %.*s val) {", snake_case_name, sname.len, sname.ptr);
     BufferedWriter b = buffered_writer_init();
     int f = write_type_free((Writer*)&b, "val", t, layouts, INDENT, 0, true);
@@ -556,6 +743,181 @@ static void write_struct_func(Writer *w, StructObject *obj, void *user_data) {
     free(snake_case_name);
 }
 
+// Whether the offsets of the fields of a serialized message only depend on the lengths of its lists: all their elements
+// have a constant size
+static bool has_static_layout(Layout *layout, Hashmap *layouts) {
+    if (layout->fields.len == 0)
+        return false;
+
+    for (size_t i = 0; i < layout->fields.len; i++) {
+        FieldAccessor fa = layout->fields.data[i];
+        if (fa.size != 0 || fa.type == &PRIMITIF_bit)
+            continue;
+        if (is_field_accessor_heap_array(fa, layout->type))
+            return false;
+        Layout *arr_layout = hashmap_get(layouts, &(Layout){.type = fa.type});
+        if (arr_layout == NULL || layout_static_size(arr_layout) == 0)
+            return false;
+    }
+    return true;
+}
+
+// Write the name of the member of a layout struct for the field accessed by fa: its path joined with '_', the length of a
+// list is <list>_len and its elements are <list>
+static void write_layout_member(Writer *w, TypeObject *base_type, FieldAccessor fa) {
+    TypeObject *t = base_type;
+    for (size_t j = 0; j < fa.indices.len; j++) {
+        uint64_t index = fa.indices.data[j];
+
+        if (t->kind == TypeStruct) {
+            StructObject *st = (StructObject *)&t->type.struct_;
+            if (j != 0)
+                wt_write(w, "_", 1);
+            wt_write(w, st->fields.data[index].name.ptr, st->fields.data[index].name.len);
+            t = st->fields.data[index].type;
+        } else if (t->kind == TypeArray) {
+            if (t->type.array.sizing == SizingMax) {
+                if (index == 0) {
+                    wt_write(w, "_len", 4);
+                }
+            } else {
+                wt_format(w, "_%lu", index);
+            }
+            t = t->type.array.type;
+        }
+    }
+}
+
+// Write the layout of a struct held by the lists of a message with a layout to the header: the offsets of its fields in a
+// serialized element, and the size of an element, as a constant
+static void write_element_layout(Writer *header, Layout *layout) {
+    StringSlice name = layout->type->type.struct_.name;
+    char *snake_case_name = pascal_to_snake_case(name);
+    char *uc_name = snake_case_to_screaming_snake_case((StringSlice){.ptr = snake_case_name, .len = strlen(snake_case_name)});
+
+    wt_format(header, "typedef struct %.*sLayout {\n", name.len, name.ptr);
+    for (size_t i = 0; i < layout->fields.len; i++) {
+        wt_format(header, "%*ssize_t ", INDENT, "");
+        write_layout_member(header, layout->type, layout->fields.data[i]);
+        wt_format(header, ";\n");
+    }
+    wt_format(header, "%*s// Size of a serialized element\n%*ssize_t size;\n", INDENT, "", INDENT, "");
+    wt_format(header, "} %.*sLayout;\n", name.len, name.ptr);
+
+    // Same walk as layout_static_size
+    wt_format(header, "static const %.*sLayout %s_LAYOUT = {", name.len, name.ptr, uc_name);
+    CurrentAlignment al = {.align = layout->type->align, .offset = 0};
+    uint64_t offset = calign_to(al, layout->fields.data[0].type->align);
+    for (size_t i = 0; i < layout->fields.len; i++) {
+        wt_format(header, ".");
+        write_layout_member(header, layout->type, layout->fields.data[i]);
+        wt_format(header, " = %lu, ", offset);
+
+        offset += layout->fields.data[i].size;
+        al = calign_add(al, layout->fields.data[i].size);
+    }
+    wt_format(header, ".size = %lu};\n\n", offset + calign_to(al, layout->type->align));
+
+    free(uc_name);
+    free(snake_case_name);
+}
+
+// Write the layout struct of a message to the header, and the function filling it to the source
+static void write_message_layout(
+    Writer *header, Writer *source, const char *name, StringSlice msgs_name, MessageObject m, Layout *layout, Hashmap *layouts
+) {
+    char *snake_case_name = pascal_to_snake_case(m.name);
+
+    wt_format(header, "typedef struct %.*s%.*sLayout {\n", msgs_name.len, msgs_name.ptr, m.name.len, m.name.ptr);
+    for (size_t i = 0; i < layout->fields.len; i++) {
+        wt_format(header, "%*ssize_t ", INDENT, "");
+        write_layout_member(header, layout->type, layout->fields.data[i]);
+        wt_format(header, ";\n");
+    }
+    wt_format(header, "%*s// Size of the serialized message\n%*ssize_t size;\n", INDENT, "", INDENT, "");
+    wt_format(header, "} %.*s%.*sLayout;\n", msgs_name.len, msgs_name.ptr, m.name.len, m.name.ptr);
+    wt_format(
+        header,
+        "void msg_%s_%s_layout(const %.*s%.*s *msg, %.*s%.*sLayout *layout);\n\n",
+        name,
+        snake_case_name,
+        msgs_name.len,
+        msgs_name.ptr,
+        m.name.len,
+        m.name.ptr,
+        msgs_name.len,
+        msgs_name.ptr,
+        m.name.len,
+        m.name.ptr
+    );
+
+    wt_format(
+        source,
+        "\nvoid msg_%s_%s_layout(const %.*s%.*s *msg, %.*s%.*sLayout *layout) {\n",
+        name,
+        snake_case_name,
+        msgs_name.len,
+        msgs_name.ptr,
+        m.name.len,
+        m.name.ptr,
+        msgs_name.len,
+        msgs_name.ptr,
+        m.name.len,
+        m.name.ptr
+    );
+
+    // Same walk as write_type_serialization, offsets are from the start of the message (before the start magic)
+    CurrentAlignment al = {.align = ALIGN_8, .offset = 2};
+    uint8_t padding = calign_to(al, layout->fields.data[0].type->align);
+    size_t offset = al.offset + padding;
+    al = calign_add(al, padding);
+    size_t i = 0;
+    for (; i < layout->fields.len && layout->fields.data[i].size != 0; i++) {
+        FieldAccessor fa = layout->fields.data[i];
+        wt_format(source, "%*slayout->", INDENT, "");
+        write_layout_member(source, layout->type, fa);
+        wt_format(source, " = MSG_MAGIC_SIZE + %lu;\n", offset);
+
+        offset += fa.size;
+        al = calign_add(al, fa.size);
+    }
+
+    if (i < layout->fields.len) {
+        offset += calign_to(al, layout->fields.data[i].type->align);
+        wt_format(source, "%*ssize_t offset = MSG_MAGIC_SIZE + %lu;\n", INDENT, "", offset);
+
+        for (; i < layout->fields.len; i++) {
+            FieldAccessor farr = layout->fields.data[i];
+            FieldAccessor flen = field_accessor_clone(&farr);
+            // Access the length instead of data
+            flen.indices.data[flen.indices.len - 1] = 0;
+
+            wt_format(source, "%*slayout->", INDENT, "");
+            write_layout_member(source, layout->type, farr);
+            wt_format(source, " = offset;\n%*soffset += ", INDENT, "");
+            if (farr.type == &PRIMITIF_bit) {
+                wt_format(source, "(msg");
+                write_accessor(source, layout->type, flen, true);
+                wt_format(source, " + 7) / 8;\n");
+            } else {
+                Layout *arr_layout = hashmap_get(layouts, &(Layout){.type = farr.type});
+                wt_format(source, "msg");
+                write_accessor(source, layout->type, flen, true);
+                wt_format(source, " * %lu;\n", layout_static_size(arr_layout));
+            }
+            field_accessor_drop(flen);
+        }
+        wt_format(source, "%*soffset = (((offset - 1) >> %u) + 1) << %u;\n", INDENT, "", al.align.po2, al.align.po2);
+        wt_format(source, "%*slayout->size = offset + MSG_MAGIC_SIZE;\n", INDENT, "");
+    } else {
+        offset += calign_to(al, al.align);
+        wt_format(source, "%*slayout->size = MSG_MAGIC_SIZE + %lu + MSG_MAGIC_SIZE;\n", INDENT, "", offset);
+    }
+    wt_format(source, "}\n");
+
+    free(snake_case_name);
+}
+
 void codegen_c(Writer *header, Writer *source, const char *name, Program *p) {
     char *uc_name = snake_case_to_screaming_snake_case((StringSlice){.ptr = name, .len = strlen(name)});
     wt_format(
@@ -585,6 +947,7 @@ void codegen_c(Writer *header, Writer *source, const char *name, Program *p) {
         "// Generated file\n"
         "#include \"%s.h\"\n"
         "#include <stdio.h>\n"
+        "#include <string.h>\n"
         "\n",
         name
     );
@@ -677,6 +1040,16 @@ void codegen_c(Writer *header, Writer *source, const char *name, Program *p) {
             msgs.name.len,
             msgs.name.ptr
         );
+        wt_format(
+            header,
+            "// Length of the message at the start of the buffer src of size len (8 aligned), as msg_%s_deserialize reads it. "
+            "Returns\n// 0 if src ends before the message does, or -1 if it can't be a valid message: unknown tag, or a list "
+            "longer than it can\n// be. msg_%s_deserialize doesn't check the lengths it reads against len, this has to be "
+            "done before.\n",
+            name,
+            name
+        );
+        wt_format(header, "int msg_%s_length(const byte *src, size_t len);\n\n", name);
         wt_format(
             header,
             "// Free the message (created by msg_%s_deserialize)\n"
@@ -831,6 +1204,33 @@ void codegen_c(Writer *header, Writer *source, const char *name, Program *p) {
             wt_format(source, "}\n");
         }
 
+        {
+            wt_format(source, "\nint msg_%s_length(const byte *buf, size_t len) {\n", name);
+            wt_format(source, "%*sif(len < 2 * MSG_MAGIC_SIZE)\n", INDENT, "");
+            wt_format(source, "%*sreturn 0;\n", INDENT * 2, "");
+            wt_format(source, "%*sif(*(MsgMagic*)buf != MSG_MAGIC_START)\n", INDENT, "");
+            wt_format(source, "%*sreturn -1;\n", INDENT * 2, "");
+            wt_format(source, "%*ssize_t off = MSG_MAGIC_SIZE;\n", INDENT, "");
+            wt_format(source, "%*sswitch(*(uint16_t*)&buf[off]) {\n", INDENT, "");
+
+            for (size_t j = 0; j < msgs.messages.len; j++) {
+                MessageObject m = msgs.messages.data[j];
+                Layout *layout = hashmap_get(p->layouts, &(Layout){.type = message_tos.data[j]});
+                assert(layout != NULL, "What ?");
+
+                wt_format(source, "%*scase %s%.*s: {\n", INDENT, "", tag_type, m.name.len, m.name.ptr);
+                write_type_length(source, layout, (CurrentAlignment){.align = ALIGN_8, .offset = 2}, p->layouts, INDENT * 2, 0, false);
+                wt_format(source, "%*sbreak;\n%*s}\n", INDENT * 2, "", INDENT, "");
+            }
+            wt_format(source, "%*sdefault:\n%*sreturn -1;\n", INDENT, "", INDENT * 2, "");
+            wt_format(source, "%*s}\n", INDENT, "");
+            wt_format(source, "%*soff += MSG_MAGIC_SIZE;\n", INDENT, "");
+            wt_format(source, "%*sif(off > len)\n", INDENT, "");
+            wt_format(source, "%*sreturn 0;\n", INDENT * 2, "");
+            wt_format(source, "%*sreturn (int)off;\n", INDENT, "");
+            wt_format(source, "}\n");
+        }
+
         {
             wt_format(source, "\nvoid msg_%s_free(%.*sMessage *msg) {\n", name, msgs.name.len, msgs.name.ptr);
 
@@ -855,6 +1255,51 @@ void codegen_c(Writer *header, Writer *source, const char *name, Program *p) {
             wt_format(source, "}\n");
         }
 
+        // Structs held by the lists of the messages with a layout, their layout is written before the first of them
+        PointerVec element_layouts = vec_init();
+        bool layouts_described = false;
+        for (size_t j = 0; j < msgs.messages.len; j++) {
+            MessageObject m = msgs.messages.data[j];
+            if (!(m.attributes & Attr_layout))
+                continue;
+
+            Layout *layout = hashmap_get(p->layouts, &(Layout){.type = message_tos.data[j]});
+            assert(
+                has_static_layout(layout, p->layouts),
+                "Message %.*s has a layout but holds a list of elements of variable size",
+                m.name.len,
+                m.name.ptr
+            );
+
+            if (!layouts_described) {
+                wt_format(
+                    header,
+                    "\n// Layouts of the serialized messages marked with #[layout]: the offsets of their fields, from the start of the"
+                    "\n// message, for the lengths of the lists of msg (a list gets the offset of its first element), and the constant "
+                    "layouts\n// of the structs their lists hold. A serialized message can be patched in place with them.\n"
+                );
+                layouts_described = true;
+            }
+            for (size_t k = 0; k < layout->fields.len; k++) {
+                FieldAccessor fa = layout->fields.data[k];
+                if (fa.size != 0 || fa.type->kind != TypeStruct)
+                    continue;
+
+                Layout *arr_layout = hashmap_get(p->layouts, &(Layout){.type = fa.type});
+                bool written = false;
+                for (size_t l = 0; l < element_layouts.len; l++) {
+                    written |= element_layouts.data[l] == arr_layout;
+                }
+                if (!written) {
+                    vec_push(&element_layouts, arr_layout);
+                    write_element_layout(header, arr_layout);
+                }
+            }
+
+            write_message_layout(header, source, name, msgs.name, m, layout, p->layouts);
+        }
+        vec_drop(element_layouts);
+
         for (size_t j = 0; j < message_tos.len; j++) {
             TypeObject *to = message_tos.data[j];
             StructObject *s = (StructObject *)&to->type.struct_;
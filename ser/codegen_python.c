@@ -21,6 +21,7 @@ static void write_type_name(Writer *w, TypeObject *type, Hashmap *defined) {
             _case(f64, "float");
             _case(bool, "bool");
             _case(char, "str");
+            _case(bit, "bool");
         }
 #undef _case
     } else if (type->kind == TypeArray) {
@@ -226,6 +227,7 @@ static void write_type_funcs(
             _case(f64, "d");
             _case(bool, "?");
             _case(char, "c");
+            _case(bit, "?");
         }
 #undef _case
         al = calign_add(al, fa.size);
@@ -292,6 +294,22 @@ static void write_type_funcs(
             continue;
         }
 
+        if (fa.type->kind == TypePrimitif && fa.type->type.primitif == Primitif_bit) {
+            // Bitsets are packed little endian, in the bytes holding the first len bits
+            wt_format(s, "%*sbuf += sum(int(b) << i for i, b in enumerate(", indent, "");
+            write_field_accessor(s, base, fa, type, Read);
+            wt_format(s, ")).to_bytes((len(");
+            write_field_accessor(s, base, fa, type, Read);
+            wt_format(s, ") + 7) // 8, 'little')\n");
+
+            wt_format(d, "%*sbits%lu = int.from_bytes(buf[off:off + (xs%lu[%lu] + 7) // 8], 'little')\n", indent, "", depth, depth, len_index);
+            wt_format(d, "%*s", indent, "");
+            write_field_accessor(d, base, fa, type, Write);
+            wt_format(d, " = [bool(bits%lu >> i & 1) for i in range(xs%lu[%lu])]\n", depth, depth, len_index);
+            wt_format(d, "%*soff += (xs%lu[%lu] + 7) // 8\n", indent, "", depth, len_index);
+            continue;
+        }
+
         wt_format(s, "%*sfor e%lu in ", indent, "", depth);
         write_field_accessor(s, base, fa, type, Read);
         wt_format(s, ":\n");
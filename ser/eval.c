@@ -23,6 +23,7 @@ PRIMITIF_TO(f32, 4);
 PRIMITIF_TO(f64, 8);
 PRIMITIF_TO(char, 1);
 PRIMITIF_TO(bool, 1);
+PRIMITIF_TO(bit, 1);
 #undef PRIMITIF_TO
 
 void array_drop(Array a) { free(a.type); }
@@ -54,6 +55,7 @@ static char *attributes_to_string(Attributes attrs, bool and) {
     if (attrs & Attr_##a) \
         attributes[count++] = Attr_##a;
     handle(versioned);
+    handle(layout);
 #undef handle
     CharVec res = vec_init();
     for (size_t i = 0; i < count; i++) {
@@ -72,6 +74,7 @@ static char *attributes_to_string(Attributes attrs, bool and) {
         break
         switch (attributes[i]) {
             _case(versioned);
+            _case(layout);
         default:
             vec_push_array(&res, "(invalid attribute)", 19);
             break;
@@ -100,6 +103,12 @@ static inline EvalError err_empty(Span span, AstTag type, StringSlice ident) {
     };
 }
 
+static inline EvalError err_bitset(Span span) {
+    return (EvalError){
+        .bitset = {.tag = EETInvalidBitset, .span = span}
+    };
+}
+
 void eval_error_report(Source *src, EvalError *err) {
     switch (err->tag) {
     case EETUnknown: {
@@ -368,6 +377,20 @@ void eval_error_report(Source *src, EvalError *err) {
         );
         break;
     }
+    case EETInvalidBitset: {
+        EvalErrorInvalidBitset bitset = err->bitset;
+        ReportSpan span = {.span = bitset.span, .sev = ReportSeverityError};
+        source_report(
+            src,
+            bitset.span.loc,
+            ReportSeverityError,
+            &span,
+            1,
+            "bits are packed into a bitset, which needs a maximum size: bit[^N]",
+            "Invalid use of type 'bit'"
+        );
+        break;
+    }
     }
     fprintf(stderr, "\n");
 }
@@ -499,6 +522,7 @@ static void _type_print(Hashmap *type_set, TypeObject *type) {
             _case(f64);
             _case(char);
             _case(bool);
+            _case(bit);
         }
 #undef _case
     } else if (type->kind == TypeArray) {
@@ -543,12 +567,25 @@ static TypeObject *ast_type_to_type_obj(EvaluationContext *ctx, AstType type) {
         res->type.array.sizing = ast_size_to_sizing(ctx, type.array.size, &res->type.array.size);
         res->type.array.type = (struct TypeObject *)ast_type_to_type_obj(ctx, *(AstType *)type.array.type);
         res->align.value = 0;
+        // Bitsets need the length to know how many bytes are on the wire, and are always inline
+        if (res->type.array.type == &PRIMITIF_bit && (res->type.array.heap || res->type.array.sizing != SizingMax)) {
+            vec_push(&ctx->errors, err_bitset(type.array.span));
+        }
         return res;
     } else { // Otherwise the type is an identifier
         return resolve_type(ctx, sss_from_token(type.ident.token));
     }
 }
 
+// Same as ast_type_to_type_obj, but for the type of a field (where a bare bit isn't allowed)
+static TypeObject *ast_field_type_to_type_obj(EvaluationContext *ctx, AstType type) {
+    TypeObject *res = ast_type_to_type_obj(ctx, type);
+    if (res == &PRIMITIF_bit) {
+        vec_push(&ctx->errors, err_bitset(type.ident.span));
+    }
+    return res;
+}
+
 static TypeObject *resolve_type(EvaluationContext *ctx, SpannedStringSlice name) {
     TypeDef *type_def = hashmap_get(ctx->typedefs, &(TypeDef){.name = name.slice});
     if (type_def != NULL) { // Type is already resolved
@@ -589,7 +626,7 @@ static TypeObject *resolve_type(EvaluationContext *ctx, SpannedStringSlice name)
             Field f;
             f.name = string_slice_from_token(str.fields.data[i].name);
             f.name_span = str.fields.data[i].name.span;
-            f.type = ast_type_to_type_obj(ctx, str.fields.data[i].type);
+            f.type = ast_field_type_to_type_obj(ctx, str.fields.data[i].type);
             vec_push(&stro->fields, f);
         }
 
@@ -725,6 +762,7 @@ static void add_fields(FieldAccessorVec *v, TypeObject *t, const uint64_t *base,
             _case(i64, 8);
             _case(u64, 8);
             _case(f64, 8);
+            _case(bit, 1);
         }
 #undef _case
         vec_push_array(&fa.indices, base, len);
@@ -1158,6 +1196,7 @@ static void resolve_messages(EvaluationContext *ctx) {
         continue; \
     }
                 _case(versioned);
+                _case(layout);
 
                 // If we get to here none of the above matched
                 vec_push(&ctx->errors, err_unknown(attr.ident.span, ATAttribute, string_slice_from_token(attr.ident)));
@@ -1184,7 +1223,7 @@ static void resolve_messages(EvaluationContext *ctx) {
                     Field f;
                     f.name = string_slice_from_token(msg.fields.data[k].name);
                     f.name_span = msg.fields.data[k].name.span;
-                    f.type = ast_type_to_type_obj(ctx, msg.fields.data[k].type);
+                    f.type = ast_field_type_to_type_obj(ctx, msg.fields.data[k].type);
                     vec_push(&message.fields, f);
 
                     SpannedStringSlice *prev = hashmap_get(field_names, &(SpannedStringSlice){.slice = f.name});
@@ -1243,6 +1282,7 @@ void resolve_additional_type_info(EvaluationContext *ctx) {
     _case(i64);
     _case(char);
     _case(bool);
+    _case(bit);
 #undef _case
 
     ctx->layouts = layouts;
@@ -1300,6 +1340,7 @@ EvaluationResult resolve_statics(AstContext *ctx) {
         add_prim(f64, 8);
         add_prim(char, 1);
         add_prim(bool, 1);
+        add_prim(bit, 1);
 #undef add_prim
     }
 
@@ -48,6 +48,8 @@ typedef enum {
     Primitif_f64,
     Primitif_char,
     Primitif_bool,
+    // Only valid as the element of a max sized array (bit[^N]), which is packed as a bitset
+    Primitif_bit,
 } PrimitifType;
 
 typedef struct {
@@ -115,9 +117,11 @@ void type_decl_drop(TypeDef t);
 typedef enum : uint32_t {
     AttrNone = 0,
     Attr_versioned = 1 << 0,
+    // The C backend generates the layout of the serialized message, for it to be patched in place
+    Attr_layout = 1 << 1,
 } Attributes;
 
-static const uint32_t ATTRIBUTES_COUNT = 1;
+static const uint32_t ATTRIBUTES_COUNT = 2;
 
 typedef struct {
     StringSlice name;
@@ -181,6 +185,7 @@ typedef enum {
     EETCycle,
     EETInfiniteStruct,
     EETEmptyType,
+    EETInvalidBitset,
 } EvalErrorTag;
 
 typedef struct {
@@ -218,6 +223,11 @@ typedef struct {
     AstTag type;
 } EvalErrorEmptyType;
 
+typedef struct {
+    EvalErrorTag tag;
+    Span span;
+} EvalErrorInvalidBitset;
+
 typedef union {
     EvalErrorTag tag;
     EvalErrorDuplicateDefinition dup;
@@ -225,6 +235,7 @@ typedef union {
     EvalErrorCycle cycle;
     EvalErrorInfiniteStruct infs;
     EvalErrorEmptyType empty;
+    EvalErrorInvalidBitset bitset;
 } EvalError;
 
 void eval_error_drop(EvalError err);
@@ -251,5 +262,6 @@ extern const TypeObject PRIMITIF_f32;
 extern const TypeObject PRIMITIF_f64;
 extern const TypeObject PRIMITIF_char;
 extern const TypeObject PRIMITIF_bool;
+extern const TypeObject PRIMITIF_bit;
 
 #endif
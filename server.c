@@ -2,8 +2,13 @@
 
 #include "const.h"
 #include "hid.h"
+#include "hist.h"
 #include "json.h"
+#include "metrics.h"
 #include "net.h"
+#include "recvq.h"
+#include "sendq.h"
+#include "uring.h"
 #include "util.h"
 #include "vec.h"
 
@@ -14,13 +19,19 @@
 #include <netinet/tcp.h>
 #include <poll.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 // Arguments for a connection thread
@@ -28,18 +39,165 @@ struct Connection {
     int      socket;
     uint32_t id;
     bool     closed;
+    // Connected UDP socket reports are sent on, -1 when they go through the TCP socket
+    int udp;
+    // Messages waiting to be sent on the socket
+    SendQueue queue;
+    // Bytes received on the socket, decoded as messages once complete
+    RecvQueue inbox;
+    // eventfd written to by the device threads when the queue couldn't be drained (threaded only)
+    int wake;
+    // eventfd written to once the connection closes, the device threads wait on it along with their device (threaded only)
+    int stop;
 };
 
+struct SharedDevice;
+
+// Number of relative axes a report can hold
+#define REPORT_REL_COUNT (sizeof(((DeviceReport *)0)->rel.data) / sizeof(uint32_t))
+
+// Counters of a device, kept (and exported as metrics) for every device ever held
+typedef struct {
+    uint64_t id;
+    char    *name;
+    uint64_t events;
+    // Times the kernel dropped events of the device (SYN_DROPPED), because they weren't read fast enough
+    uint64_t drops;
+} DeviceCounters;
+
+// Latency histograms of a slot whose client asked for the timing of reports, printed on SIGUSR1
+typedef struct {
+    uint32_t conn;
+    int      slot;
+    // From the read of the events of a frame to its serialization, and from then to the report being handed to the socket
+    Histogram read_serialize;
+    Histogram serialize_send;
+} SlotTimings;
+
+// Forwarding state of a slot holding a device, shared by the threaded and epoll modes
+typedef struct {
+    struct Connection *conn;
+    int                index;
+    Controller        *ctr;
+    // Shared device the slot gets its frames from when it holds a cloneable device, NULL when it reads the device itself
+    struct SharedDevice *source;
+    // eventfd written to by the reader of source when frames are published, and last frame of source consumed
+    int      wake;
+    uint64_t frame;
+    // Whether the client's state of the device is the one of the last frame consumed, deltas of source can be sent then
+    bool in_sync;
+    // Total relative motion of source as of the last frame consumed, if known
+    bool     counted;
+    uint32_t rel_total[REPORT_REL_COUNT];
+    // Set on the state of a shared device's reader, frames are published to the device's ring instead of sent
+    struct SharedDevice *shared;
+    // Counters of the device held by the slot
+    DeviceCounters *counters;
+    // Latency histograms of the slot, NULL if its reports don't carry their timing
+    SlotTimings *timings;
+    // Kernel timestamp of the event closing the current frame, and when the events being handled were read (in ns, only kept
+    // when reports carry their timing)
+    uint64_t event_ns;
+    uint64_t read_ns;
+    // State of the device for the current frame
+    DeviceReport report;
+    // State of the device as last sent to the client, frames are sent as changes from it
+    DeviceReport sent;
+    // Changes of the current frame
+    DeviceReportDelta delta;
+    // Number of delta reports sent since the last full report
+    int since_keyframe;
+    // Set on SYN_DROPPED, the events are ignored until the next SYN_REPORT
+    bool dropping;
+    // Set once the state of the device has been read again after events were dropped, the next frame is sent as a full report
+    // even if nothing changed
+    bool resynced;
+    // The current frame serialized as a full report, patched as the events are applied (see slot_set_abs): it is sent as is,
+    // only its seq and timing are written then. Offsets of its fields, and of the fields of a serialized delta before its
+    // lists (the only ones used, they don't depend on the lists).
+    DeviceReportLayout      wire_layout;
+    DeviceReportDeltaLayout delta_layout;
+    uint8_t                 wire[2048] __attribute__((aligned(8)));
+    uint8_t                 buf[2048] __attribute__((aligned(8)));
+    // Events read from the device, many are read at once to save syscalls
+    struct input_event events[64];
+    // Number of bytes of an incomplete event left at the start of events by the last read
+    size_t carry;
+    // Sequence number of the last report, kept across devices for the client to tell stale datagrams apart
+    uint32_t seq;
+    // Relative motion carried by the report of the slot waiting in the send queue, added to the one replacing it
+    uint32_t queued_rel[REPORT_REL_COUNT];
+    // UDP loss/reorder injector: state of the random generator, and the datagram held back to be sent late
+    unsigned int seed;
+    size_t       held_len;
+    uint8_t      held[2048] __attribute__((aligned(8)));
+} SlotState;
+
 struct DeviceThreadArgs {
     int                index;
-    char             **tags;
+    int               *tags;
     size_t             tag_count;
     Controller       **controller;
     struct Connection *conn;
+    SlotTimings       *timings;
 };
 
+// A frame published by the reader of a shared device, serialized once as a full report (and as a delta from the previous
+// frame when that's smaller) for all the slots holding the device. Slot, index and seq are patched for each slot. Frames always
+// carry their timing, it is cut out for the slots that don't send it.
+typedef struct {
+    // Number of the frame, 0 while it is being written
+    uint64_t     stamp;
+    DeviceReport report;
+    // Total relative motion of the device as of the frame, for slots that skip frames to make up for the motion they missed
+    uint32_t rel_total[REPORT_REL_COUNT];
+    // When the events of the frame were read, the rest of its timing is in report
+    uint64_t     read_ns;
+    int          full_len;
+    // 0 when the frame has to be sent whole
+    int     delta_len;
+    uint8_t full[2048] __attribute__((aligned(8)));
+    uint8_t delta[2048] __attribute__((aligned(8)));
+} SharedFrame;
+
+// A cloneable device, read by a single thread that publishes its frames into a ring every slot holding the device consumes
+// at its own pace. Slots falling too far behind skip to the latest frame.
+typedef struct SharedDevice {
+    Controller ctr;
+    SlotState  state;
+    // Ring of SHARED_DEVICE_RING_SIZE frames, and number of the last frame published
+    SharedFrame *frames;
+    uint64_t     head;
+    // Set once the device is lost, after its last frame
+    bool lost;
+    // Total relative motion of the device as of the last frame published
+    uint32_t rel_total[REPORT_REL_COUNT];
+    // Number of slots subscribed, plus one for the reader
+    int refs;
+    // Protects wakes, the eventfds of the subscribed slots
+    pthread_mutex_t lock;
+    Vec             wakes;
+} SharedDevice;
+
 static void default_timespec(void *ptr) { *(struct timespec *)ptr = POLL_DEVICE_INTERVAL; }
+static void default_rescan_interval(void *ptr) { *(struct timespec *)ptr = RESCAN_DEVICE_INTERVAL; }
+static void default_hidraw_interval(void *ptr) { *(struct timespec *)ptr = HIDRAW_OUTPUT_INTERVAL; }
 static void default_request_timeout(void *ptr) { *(uint32_t *)ptr = REQUEST_TIMEOUT; }
+static void default_server_mode(void *ptr) { *(ServerMode *)ptr = ServerModeThreaded; }
+
+static void tsf_server_mode(void *arg, void *ptr) {
+    char *s = *(char **)arg;
+    if (strcmp(s, "threaded") == 0) {
+        *(ServerMode *)ptr = ServerModeThreaded;
+    } else if (strcmp(s, "epoll") == 0) {
+        *(ServerMode *)ptr = ServerModeEpoll;
+    } else if (strcmp(s, "io_uring") == 0) {
+        *(ServerMode *)ptr = ServerModeUring;
+    } else {
+        printf("JSON: unknown server mode '%s', expected 'threaded', 'epoll' or 'io_uring'\n", s);
+    }
+    free(s);
+}
 
 const JSONPropertyAdapter FilterAdapterProps[] = {
     {".uniq",    &StringAdapter,  offsetof(ControllerFilter, uniq),    default_to_zero_u64,         tsf_uniq_to_u64},
@@ -69,7 +227,15 @@ const JSONAdapter ControllerAdapter = {
 const JSONPropertyAdapter ConfigAdapterProps[] = {
     {".controllers[]",   &ControllerAdapter, offsetof(ServerConfig, controllers),     default_to_null,         NULL                  },
     {".poll_interval",   &NumberAdapter,     offsetof(ServerConfig, poll_interval),   default_timespec,        tsf_numsec_to_timespec},
-    {".request_timeout", &NumberAdapter,     offsetof(ServerConfig, request_timeout), default_request_timeout, tsf_numsec_to_intms   }
+    {".rescan_interval", &NumberAdapter,     offsetof(ServerConfig, rescan_interval), default_rescan_interval, tsf_numsec_to_timespec},
+    {".uevent",          &BooleanAdapter,    offsetof(ServerConfig, uevent),          default_to_false,        NULL                  },
+    {".hidraw_interval", &NumberAdapter,     offsetof(ServerConfig, hidraw_interval), default_hidraw_interval, tsf_numsec_to_timespec},
+    {".request_timeout", &NumberAdapter,     offsetof(ServerConfig, request_timeout), default_request_timeout, tsf_numsec_to_intms   },
+    {".mode",            &StringAdapter,     offsetof(ServerConfig, mode),            default_server_mode,     tsf_server_mode       },
+    {".workers",         &NumberAdapter,     offsetof(ServerConfig, workers),         default_to_one_size,     tsf_double_to_size    },
+    {".udp_loss",        &NumberAdapter,     offsetof(ServerConfig, udp_loss),        default_to_zero_double,  NULL                  },
+    {".udp_reorder",     &NumberAdapter,     offsetof(ServerConfig, udp_reorder),     default_to_zero_double,  NULL                  },
+    {".metrics_socket",  &StringAdapter,     offsetof(ServerConfig, metrics_socket),  default_to_null,         NULL                  },
 };
 const JSONAdapter ConfigAdapter = {
     .props      = ConfigAdapterProps,
@@ -77,9 +243,17 @@ const JSONAdapter ConfigAdapter = {
     .size       = sizeof(ServerConfig),
 };
 
-static ServerConfig  config;
-static pthread_key_t device_args_key;
-static sigset_t      empty_sigset;
+static ServerConfig config;
+static sigset_t     empty_sigset;
+
+// Open connections, Vec of struct Connection *, for the metrics
+static Vec             connections       = {0};
+static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Counters of every device ever held, Vec of DeviceCounters *
+static Vec             device_counters       = {0};
+static pthread_mutex_t device_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Messages that couldn't be serialized
+static uint64_t serialize_failures = 0;
 
 #define TRAP(sig, handler)                                                                                                       \
     if (sigaction(sig, &(struct sigaction){.sa_handler = handler, .sa_mask = empty_sigset, .sa_flags = 0}, NULL) != 0)           \
@@ -94,6 +268,14 @@ static void print_config() {
     printf("SERVER: Config\n");
     printf("  retry_delay: %fs\n", (double)(config.request_timeout) / 1000.0);
     printf("  poll_interval: %fs\n", timespec_to_double(&config.poll_interval));
+    printf("  rescan_interval: %fs\n", timespec_to_double(&config.rescan_interval));
+    printf("  uevent: %s\n", config.uevent ? "true" : "false");
+    printf("  hidraw_interval: %fs\n", timespec_to_double(&config.hidraw_interval));
+    printf("  mode: %s\n", config.mode == ServerModeUring ? "io_uring" : config.mode == ServerModeEpoll ? "epoll" : "threaded");
+    printf("  workers: %lu\n", config.workers);
+    printf("  udp_loss: %f\n", config.udp_loss);
+    printf("  udp_reorder: %f\n", config.udp_reorder);
+    printf("  metrics_socket: %s\n", config.metrics_socket != NULL ? config.metrics_socket : "none");
     printf("  controllers:\n");
     for (size_t i = 0; i < config.controller_count; i++) {
         ServerConfigController *ctr = &config.controllers[i];
@@ -145,379 +327,2238 @@ void print_message_buffer(const uint8_t *buf, int len) {
     }
 }
 
-void device_thread_exit(int _sig) {
-    struct DeviceThreadArgs *args = pthread_getspecific(device_args_key);
-    printf("CONN(%d): [%d] exiting\n", args->conn->id, args->index);
+// Setup the keepalive and low watermark options on a freshly accepted connection
+static void conn_setup_socket(struct Connection *conn) {
+    if (setsockopt(conn->socket, SOL_SOCKET, SO_KEEPALIVE, &TCP_KEEPALIVE_ENABLE, sizeof(int)) != 0)
+        printf("ERR(server_handle_conn): Enabling socket keepalives on client\n");
+    if (setsockopt(conn->socket, SOL_TCP, TCP_KEEPIDLE, &TCP_KEEPALIVE_IDLE_TIME, sizeof(int)) != 0)
+        printf("ERR(server_handle_conn): Setting initial idle-time value\n");
+    if (setsockopt(conn->socket, SOL_TCP, TCP_KEEPCNT, &TCP_KEEPALIVE_RETRY_COUNT, sizeof(int)) != 0)
+        printf("ERR(server_handle_conn): Setting idle retry count\n");
+    if (setsockopt(conn->socket, SOL_TCP, TCP_KEEPINTVL, &TCP_KEEPALIVE_RETRY_INTERVAL, sizeof(int)) != 0)
+        printf("ERR(server_handle_conn): Setting idle retry interval\n");
+    if (setsockopt(conn->socket, SOL_TCP, TCP_NOTSENT_LOWAT, &TCP_NOTSENT_LOW_WATERMARK, sizeof(int)) != 0)
+        printf("ERR(server_handle_conn): Setting unsent low watermark\n");
+}
 
-    Controller *ctr = *args->controller;
-    if (ctr != NULL) {
-        return_device(ctr);
-        free(ctr);
-    }
+// Receive what the peer of a connection sent, the messages are then taken with conn_next_message. Returns false if the peer
+// was lost.
+static bool conn_receive(struct Connection *conn) {
+    ssize_t len = recvq_fill(&conn->inbox, conn->socket);
+    return len > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
 
-    for (int i = 0; i < args->tag_count; i++) {
-        free(args->tags[i]);
+// Take the next message received on a connection. Returns 1 if msg has been filled, 0 once every message received entirely
+// has been taken and -1 if bytes that couldn't be parsed were skipped. Messages are only deserialized once msg_device_length
+// has checked them against what was received (in recvq_next), the lengths of their lists come from the client.
+static int conn_next_message(struct Connection *conn, DeviceMessage *msg) {
+    RecvQueue *q  = &conn->inbox;
+    int        rc = recvq_next(q, msg);
+    if (rc < 0) {
+        printf("CONN(%d): Couldn't parse message:", conn->id);
+        print_message_buffer(q->buf + q->start - q->skipped, q->skipped);
+        printf("\n");
     }
-
-    free(args->tags);
-    free(args);
-    pthread_exit(NULL);
+    return rc;
 }
 
-void *device_thread(void *args_) {
-    struct DeviceThreadArgs *args = args_;
-
-    pthread_setspecific(device_args_key, args);
-
-    TRAP_IGN(SIGPIPE);
-    TRAP(SIGTERM, device_thread_exit);
+// Queue a control message of a slot on a connection, returns -1 if the connection can't send anymore
+static int conn_send(struct Connection *conn, int slot, const uint8_t *buf, size_t len) {
+    return sendq_push_control(&conn->queue, slot, buf, len) ? len : -1;
+}
 
-    uint8_t    buf[2048] __attribute__((aligned(4))) = {0};
-    DeviceInfo dev_info;
+// Send what the device threads queued on a connection, and leave the rest to the connection thread
+static void conn_flush(struct Connection *conn) {
+    if (sendq_drain(&conn->queue, conn->socket) != 1) {
+        eventfd_write(conn->wake, 1);
+    }
+}
 
-    while (true) {
-        if (*args->controller != NULL) {
-            free(*args->controller);
-        }
+// Add a connection to the ones metrics are exported for, its send queue must be initialized
+static void conn_register(struct Connection *conn) {
+    pthread_mutex_lock(&connections_mutex);
+    if (connections.data == NULL) {
+        connections = vec_of(struct Connection *);
+    }
+    vec_push(&connections, &conn);
+    pthread_mutex_unlock(&connections_mutex);
+}
 
-        *args->controller = NULL;
-        uint8_t     controller_index;
-        Controller *ctr = malloc(sizeof(Controller));
-        if (!get_device(args->tags, args->tag_count, &args->conn->closed, ctr, &controller_index)) {
+// Remove a connection from the ones metrics are exported for, before its send queue is freed
+static void conn_unregister(struct Connection *conn) {
+    pthread_mutex_lock(&connections_mutex);
+    for (int i = 0; i < connections.len; i++) {
+        if (*(struct Connection **)vec_get(&connections, i) == conn) {
+            vec_remove(&connections, i, NULL);
             break;
         }
-        *args->controller = ctr;
-        dev_info          = ctr->dev.device_info;
-        dev_info.slot     = args->index;
-        dev_info.index    = controller_index;
-
-        printf("CONN(%d): [%d] Found suitable [%s] device: '%s' (%lu)\n", args->conn->id, args->index, ctr->ctr.tag,
-               ctr->dev.name, ctr->dev.id);
-
-        // Send over device info
-        {
-            int len = msg_device_serialize(buf, 2048, (DeviceMessage *)&dev_info);
-            if (write(args->conn->socket, buf, len) == -1) {
-                printf("CONN(%d): [%d] Couldn't send device info\n", args->conn->id, args->index);
-                break;
-            }
+    }
+    pthread_mutex_unlock(&connections_mutex);
+}
+
+// Log the send queue counters of a connection
+static void conn_print_queue_stats(struct Connection *conn) {
+    printf("CONN(%u): send queue: %lu frames coalesced, max depth %lu\n", conn->id, conn->queue.coalesced,
+           conn->queue.max_depth);
+}
+
+// Open the UDP socket reports of the connection are sent on, towards port on the peer's address. It is bound to the local
+// address and port of the connection: the client only accepts datagrams coming from the peer of its TCP connection.
+static void conn_open_udp(struct Connection *conn, uint16_t port) {
+    struct sockaddr_in addr, local;
+    socklen_t          addr_len = sizeof(addr), local_len = sizeof(local);
+    if (getpeername(conn->socket, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        getsockname(conn->socket, (struct sockaddr *)&local, &local_len) != 0) {
+        printf("CONN(%d): Couldn't get peer address, sending reports over TCP\n", conn->id);
+        return;
+    }
+    addr.sin_port = htons(port);
+
+    // Every connection has its own socket on the same port
+    int udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (udp < 0 || setsockopt(udp, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) != 0 ||
+        setsockopt(udp, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) != 0 ||
+        bind(udp, (struct sockaddr *)&local, sizeof(local)) != 0 || connect(udp, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("CONN(%d): Couldn't open UDP socket, sending reports over TCP\n", conn->id);
+        if (udp >= 0) {
+            close(udp);
         }
+        return;
+    }
 
-        DeviceReport report = {0};
+    printf("CONN(%d): Sending reports over UDP (port %u)\n", conn->id, port);
+    conn->udp = udp;
+}
 
-        report.tag     = DeviceTagReport;
-        report.abs.len = ctr->dev.device_info.abs.len;
-        report.rel.len = ctr->dev.device_info.rel.len;
-        report.key.len = ctr->dev.device_info.key.len;
-        report.slot    = args->index;
-        report.index   = controller_index;
+static void slot_stamp_datagram(SlotState *s, uint8_t *buf);
 
-        while (true) {
-            struct input_event event;
+// Count a report datagram in the counters of the connection, given what its send returned
+static void slot_count_datagram(SlotState *s, ssize_t sent) {
+    if (sent > 0) {
+        counter_add(&s->conn->queue.reports_sent, 1);
+        counter_add(&s->conn->queue.bytes_sent, sent);
+    }
+}
 
-            int len = read(ctr->dev.event, &event, sizeof(struct input_event));
+// Send a report datagram, the loss/reorder injector drops or holds it back according to the config
+static void slot_send_datagram(SlotState *s, uint8_t *buf, size_t len) {
+    double r = (double)rand_r(&s->seed) / RAND_MAX;
+    if (r < config.udp_loss) {
+        return;
+    }
 
-            if (len <= 0) {
-                // We lost the device, so we mark it as broken (we forget it) and try to get a new one (in the next iteration of
-                // the outer while)
-                forget_device(ctr);
-                break;
-            }
+    if (s->held_len == 0 && r < config.udp_loss + config.udp_reorder) {
+        memcpy(s->held, buf, len);
+        s->held_len = len;
+        return;
+    }
 
-            if (len < sizeof(struct input_event)) {
-                printf("CONN(%d): [%d] error reading event\n", args->conn->id, args->index);
-                continue;
-            }
+    // Datagrams that can't be sent right away are dropped, the next report supersedes them anyway
+    slot_stamp_datagram(s, buf);
+    slot_count_datagram(s, send(s->conn->udp, buf, len, MSG_DONTWAIT));
+    if (s->held_len > 0) {
+        slot_stamp_datagram(s, s->held);
+        slot_count_datagram(s, send(s->conn->udp, s->held, s->held_len, MSG_DONTWAIT));
+        s->held_len = 0;
+    }
+}
 
-            if (event.type == EV_SYN) {
-                int len = msg_device_serialize(buf, 2048, (DeviceMessage *)&report);
+// Get the counters of a device, creating them the first time it is held
+static DeviceCounters *device_counters_get(Controller *ctr) {
+    pthread_mutex_lock(&device_counters_mutex);
+    if (device_counters.data == NULL) {
+        device_counters = vec_of(DeviceCounters *);
+    }
 
-                if (len < 0) {
-                    printf("CONN(%d): [%d] Couldn't serialize report %d\n", args->conn->id, args->index, len);
-                    continue;
-                };
-                send(args->conn->socket, buf, len, 0);
-            } else if (event.type == EV_ABS) {
-                int index = ctr->dev.mapping.abs_indices[event.code];
+    for (int i = 0; i < device_counters.len; i++) {
+        DeviceCounters *c = *(DeviceCounters **)vec_get(&device_counters, i);
+        if (c->id == ctr->dev.id) {
+            pthread_mutex_unlock(&device_counters_mutex);
+            return c;
+        }
+    }
 
-                if (index < 0) {
-                    printf("CONN(%d): [%d] Invalid abs\n", args->conn->id, args->index);
-                    continue;
-                };
+    DeviceCounters *c = calloc(1, sizeof(DeviceCounters));
+    c->id             = ctr->dev.id;
+    c->name           = strdup(ctr->dev.name != NULL ? ctr->dev.name : DEVICE_DEFAULT_NAME);
+    vec_push(&device_counters, &c);
+    pthread_mutex_unlock(&device_counters_mutex);
+    return c;
+}
 
-                report.abs.data[index] = event.value;
-            } else if (event.type == EV_REL) {
-                int index = ctr->dev.mapping.rel_indices[event.code];
+// Set a control of the current frame of a slot, in its report and in its serialized report
+static inline void slot_set_abs(SlotState *s, int i, uint32_t value) {
+    s->report.abs.data[i]                                             = value;
+    *(uint32_t *)&s->wire[s->wire_layout.abs + i * sizeof(uint32_t)] = value;
+}
+static inline void slot_set_rel(SlotState *s, int i, uint32_t value) {
+    s->report.rel.data[i]                                             = value;
+    *(uint32_t *)&s->wire[s->wire_layout.rel + i * sizeof(uint32_t)] = value;
+}
+static inline void slot_set_key(SlotState *s, int i, bool value) {
+    word_bit_put(s->report.key.data, i, value);
+    // A bitset is sent as the first bytes of its words
+    uint8_t *byte = &s->wire[s->wire_layout.key + i / 8];
+    *byte         = value ? *byte | (1 << (i % 8)) : *byte & ~(1 << (i % 8));
+}
 
-                if (index < 0) {
-                    printf("CONN(%d): [%d] Invalid rel\n", args->conn->id, args->index);
-                    continue;
-                };
+// Zero the relative axes of the current frame of a slot, they only hold the motion of a frame
+static void slot_clear_rel(SlotState *s) {
+    memset(s->report.rel.data, 0, s->report.rel.len * sizeof(*s->report.rel.data));
+    memset(&s->wire[s->wire_layout.rel], 0, s->report.rel.len * sizeof(*s->report.rel.data));
+}
 
-                report.rel.data[index] = event.value;
-            } else if (event.type == EV_KEY) {
-                int index = ctr->dev.mapping.key_indices[event.code];
+// Set the keys and absolute axes of the report of a slot to the current state of its device, the next frame is sent as a full
+// report. Used when the client's state can't be trusted: at handoff, and after the kernel dropped events (the motion of the
+// dropped relative events is lost).
+static void slot_resync(SlotState *s) {
+    DeviceCaps *caps = s->ctr->dev.caps;
+    int         fd   = s->ctr->dev.event;
+
+    uint64_t keys[(KEY_CNT + 63) / 64] = {0};
+    ioctl(fd, EVIOCGKEY(sizeof(keys)), keys);
+    for (int i = 0; i < caps->device_info.key.len; i++) {
+        slot_set_key(s, i, word_bit_get(keys, caps->device_info.key.data[i].id));
+    }
 
-                if (index < 0) {
-                    printf("CONN(%d): [%d] Invalid key\n", args->conn->id, args->index);
-                    continue;
-                };
-                report.key.data[index] = !!event.value;
-            }
+    for (int i = 0; i < caps->device_info.abs.len; i++) {
+        struct input_absinfo abs;
+        if (ioctl(fd, EVIOCGABS(caps->device_info.abs.data[i].id), &abs) >= 0) {
+            slot_set_abs(s, i, abs.value);
         }
+    }
 
-        // Send device destroy message
-        {
-            DeviceDestroy dstr;
-            dstr.tag  = DeviceTagDestroy;
-            dstr.index = args->index;
+    s->resynced       = true;
+    s->since_keyframe = REPORT_KEYFRAME_INTERVAL;
+}
 
-            int len = msg_device_serialize(buf, 2048, (DeviceMessage *)&dstr);
-            if (write(args->conn->socket, buf, len) == -1) {
-                printf("CONN(%d): [%d] Couldn't send device destroy message\n", args->conn->id, args->index);
-                break;
-            }
+// Reset the report of a slot for a newly acquired device
+static void slot_reset(SlotState *s, Controller *ctr, uint8_t controller_index) {
+    s->ctr      = ctr;
+    s->carry    = 0;
+    s->held_len = 0;
+    s->counters = device_counters_get(ctr);
+
+    memset(&s->report, 0, sizeof(DeviceReport));
+    s->report.tag     = DeviceTagReport;
+    s->report.abs.len = ctr->dev.caps->device_info.abs.len;
+    s->report.rel.len = ctr->dev.caps->device_info.rel.len;
+    s->report.key.len = ctr->dev.caps->device_info.key.len;
+    s->report.slot    = s->index;
+    s->report.index   = controller_index;
+
+    // Shared frames always carry their timing (see SharedFrame)
+    s->report.timing.len = s->timings != NULL || s->shared != NULL;
+    s->delta.timing.len  = s->report.timing.len;
+
+    // The client starts with a zeroed state as well
+    s->sent           = s->report;
+    s->delta.tag      = DeviceTagReportDelta;
+    s->delta.slot     = s->index;
+    s->delta.index    = controller_index;
+    s->since_keyframe = REPORT_KEYFRAME_INTERVAL;
+    s->dropping       = false;
+    s->resynced       = false;
+
+    // The layout of the reports is fixed by the device: they are serialized once, and patched from then on
+    msg_device_serialize(s->wire, sizeof(s->wire), (DeviceMessage *)&s->report);
+    msg_device_report_layout(&s->report, &s->wire_layout);
+    msg_device_report_delta_layout(&s->delta, &s->delta_layout);
+}
+
+static void slot_send_report(SlotState *s);
+
+// Send the info of a newly acquired device, followed by its current state (controls already held aren't left at zero until they
+// move). Returns false if the info couldn't be sent.
+static bool slot_attach(SlotState *s, Controller *ctr, uint8_t controller_index) {
+    s->ctr = ctr;
+
+    printf("CONN(%d): [%d] Found suitable [%s] device: '%s' (%lu)\n", s->conn->id, s->index, ctr->ctr.tag, ctr->dev.name,
+           ctr->dev.id);
+
+    // Send over device info
+    {
+        DeviceInfo dev_info = ctr->dev.caps->device_info;
+        dev_info.slot       = s->index;
+        dev_info.index      = controller_index;
+
+        int len = msg_device_serialize(s->buf, sizeof(s->buf), (DeviceMessage *)&dev_info);
+        if (conn_send(s->conn, s->index, s->buf, len) == -1) {
+            printf("CONN(%d): [%d] Couldn't send device info\n", s->conn->id, s->index);
+            return false;
         }
     }
 
-    device_thread_exit(SIGTERM);
-    return NULL;
+    slot_reset(s, ctr, controller_index);
+
+    // The client starts from a zeroed state
+    s->event_ns = realtime_ns();
+    s->read_ns  = s->event_ns;
+    slot_resync(s);
+    slot_send_report(s);
+    return true;
 }
 
-void *server_handle_conn(void *args_) {
-    struct Connection *args = args_;
+// Size of a serialized ReportDelta
+static inline size_t report_delta_size(DeviceReportDelta *delta) {
+    DeviceReportDeltaLayout layout;
+    msg_device_report_delta_layout(delta, &layout);
+    return layout.size;
+}
 
-    printf("CONN(%u): start\n", args->id);
+// Set the timing of the current frame of a slot as it is about to be serialized, if its reports carry it
+static void slot_stamp(SlotState *s) {
+    if (s->report.timing.len == 0) {
+        return;
+    }
 
-    if (setsockopt(args->socket, SOL_SOCKET, SO_KEEPALIVE, &TCP_KEEPALIVE_ENABLE, sizeof(int)) != 0)
-        printf("ERR(server_handle_conn): Enabling socket keepalives on client\n");
-    if (setsockopt(args->socket, SOL_TCP, TCP_KEEPIDLE, &TCP_KEEPALIVE_IDLE_TIME, sizeof(int)) != 0)
-        printf("ERR(server_handle_conn): Setting initial idle-time value\n");
-    if (setsockopt(args->socket, SOL_TCP, TCP_KEEPCNT, &TCP_KEEPALIVE_RETRY_COUNT, sizeof(int)) != 0)
-        printf("ERR(server_handle_conn): Setting idle retry count\n");
-    if (setsockopt(args->socket, SOL_TCP, TCP_KEEPINTVL, &TCP_KEEPALIVE_RETRY_INTERVAL, sizeof(int)) != 0)
-        printf("ERR(server_handle_conn): Setting idle retry interval\n");
+    // The send time holds the serialization time until the report is handed to the socket
+    Timing timing            = {.event = s->event_ns, .sent = realtime_ns()};
+    s->report.timing.data[0] = timing;
+    s->delta.timing.data[0]  = timing;
+    *(uint64_t *)&s->wire[s->wire_layout.timing + TIMING_LAYOUT.event] = timing.event;
+    *(uint64_t *)&s->wire[s->wire_layout.timing + TIMING_LAYOUT.sent]  = timing.sent;
 
-    uint8_t buf[2048] __attribute__((aligned(4))) = {0};
+    if (s->timings != NULL) {
+        hist_record_span(&s->timings->read_serialize, s->read_ns, timing.sent);
+    }
+}
 
-    char *closing_message    = "";
-    bool  got_request        = false;
-    Vec   device_threads     = vec_of(pthread_t);
-    Vec   device_controllers = vec_of(Controller *);
+// Set the send time of a report datagram about to be sent, if the slot sends the timing of reports
+static void slot_stamp_datagram(SlotState *s, uint8_t *buf) {
+    if (s->timings != NULL) {
+        sendq_stamp(&buf[s->wire_layout.timing + TIMING_LAYOUT.sent], &s->timings->serialize_send);
+    }
+}
 
-    struct pollfd pfd = {.fd = args->socket, .events = POLLIN};
+// Queue a serialized report (or delta) of a slot on its connection, the send queue's lock must be held
+static void slot_queue_report(SlotState *s, const uint8_t *buf, bool delta, int len) {
+    size_t sent_at = (delta ? s->delta_layout.timing : s->wire_layout.timing) + TIMING_LAYOUT.sent;
+    sendq_put_report(&s->conn->queue, s->index, buf, len, sent_at, s->timings != NULL ? &s->timings->serialize_send : NULL);
+}
 
-    while (1) {
-        int rc = poll(&pfd, 1, config.request_timeout);
+// Fill the delta of a slot with the changes of the current frame since the last one sent, returns false if nothing changed
+static bool slot_build_delta(SlotState *s) {
+    DeviceReport      *report = &s->report;
+    DeviceReport      *sent   = &s->sent;
+    DeviceReportDelta *delta  = &s->delta;
 
-        // If poll timed out
-        if (rc == 0) {
-            if (!got_request) {
-                printf("CONN(%d): Didn't get a device request within %i.%03ds\n", args->id, config.request_timeout / 1000,
-                       config.request_timeout % 1000);
-                closing_message = "Timed out";
-                goto conn_end;
-            }
+    delta->abs.len = 0;
+    delta->rel.len = 0;
+    delta->key.len = 0;
 
-            continue;
-        } else if (rc < 0) { // If poll failed (basically never)
-            closing_message = "Poll error";
-            goto conn_end;
+    for (int i = 0; i < report->abs.len; i++) {
+        if (report->abs.data[i] != sent->abs.data[i]) {
+            delta->abs.data[delta->abs.len++] = (AbsDelta){.index = i, .value = report->abs.data[i]};
         }
+    }
 
-        // Test for error on socket
-        if (pfd.revents & POLLHUP || pfd.revents & POLLERR) {
-            closing_message = "Lost peer";
-            goto conn_end;
+    // Relative axes only hold the motion of the current frame
+    for (int i = 0; i < report->rel.len; i++) {
+        if (report->rel.data[i] != 0) {
+            delta->rel.data[delta->rel.len++] = (RelDelta){.index = i, .value = report->rel.data[i]};
         }
+    }
 
-        // Receive data
-        int len = recv(args->socket, buf, 2048, 0);
-        if (len <= 0) {
-            closing_message = "Lost peer (from recv)";
-            goto conn_end;
-        } else if (len > 1) {
-            printf("CONN(%d):  Got message: ", args->id);
-            printf("\n");
-        } else {
-            printf("CONN(%d):  Malformed message\n", args->id);
-        }
+    // Keys are bitsets, changes are found a word at a time
+    for (size_t w = 0; w < words_for_bits(report->key.len); w++) {
+        uint64_t changed = report->key.data[w] ^ sent->key.data[w];
+        while (changed != 0) {
+            int i = w * 64 + __builtin_ctzll(changed);
+            changed &= changed - 1;
 
-        // Parse message
-        DeviceMessage msg;
-        int     msg_len = msg_device_deserialize(buf, len, &msg);
-        if (msg_len < 0) {
-            if (len > 1) {
-                printf("CONN(%d): Couldn't parse message: ", args->id);
-                print_message_buffer(buf, len);
-                printf("\n");
-            } else {
-                printf("CONN(%d): Couldn't parse message", args->id);
-            }
-            continue;
+            delta->key.data[delta->key.len++] = (KeyDelta){.index = i, .value = word_bit_get(report->key.data, i)};
         }
+    }
 
-        // Handle message
-        if (msg.tag == DeviceTagControllerState) {
-            int i = msg.controller_state.index;
-            if (i >= device_controllers.len) {
-                printf("CONN(%d): Invalid controller index in controller state message\n", args->id);
-                continue;
-            }
+    return delta->abs.len > 0 || delta->rel.len > 0 || delta->key.len > 0;
+}
 
-            Controller *ctr = *(Controller **)vec_get(&device_controllers, i);
-            if (ctr == NULL) {
-                printf("CONN(%d): Received controller state message but the device hasn't yet been received\n", args->id);
-                continue;
-            }
+// Whether the delta of a slot should be sent as a full report instead, a keyframe is due or it wouldn't be smaller. Counts
+// the keyframes.
+static bool slot_keyframe(SlotState *s) {
+    if (s->since_keyframe >= REPORT_KEYFRAME_INTERVAL || report_delta_size(&s->delta) >= s->wire_layout.size) {
+        s->since_keyframe = 0;
+        return true;
+    }
 
-            apply_controller_state(ctr, &msg.controller_state);
-        } else if (msg.tag == DeviceTagRequest) {
-            if (got_request) {
-                printf("CONN(%d): Illegal Request message after initial request\n", args->id);
-                msg_device_free(&msg);
-                continue;
+    s->since_keyframe++;
+    return false;
+}
+
+// The current frame of a slot has been sent, it becomes the base of the next delta
+static void slot_frame_sent(SlotState *s) {
+    DeviceReport *report = &s->report;
+    DeviceReport *sent   = &s->sent;
+
+    memcpy(sent->abs.data, report->abs.data, report->abs.len * sizeof(*report->abs.data));
+    memcpy(sent->key.data, report->key.data, words_for_bits(report->key.len) * sizeof(*report->key.data));
+    slot_clear_rel(s);
+}
+
+// Queue the current frame as the changes since the last one queued, or as a full report when that's smaller or a keyframe is
+// due. Nothing is queued if nothing changed. A frame replaces the one of the slot still waiting in the send queue.
+static void slot_send_report(SlotState *s) {
+    DeviceReport *report = &s->report;
+    SendQueue    *queue  = &s->conn->queue;
+
+    report->seq                                = ++s->seq;
+    *(uint32_t *)&s->wire[s->wire_layout.seq] = report->seq;
+
+    // Datagrams can be lost, so every frame is sent whole and the client keeps the latest one
+    if (s->conn->udp >= 0) {
+        slot_stamp(s);
+        // A resynced state has to get there (and after the info at handoff), it goes through the connection instead. Until it
+        // does no datagram is sent, the connection only refuses it once it failed and is about to stop the slot.
+        if (s->resynced) {
+            if (conn_send(s->conn, s->index, s->wire, s->wire_layout.size) == -1) {
+                printf("CONN(%d): [%d] Couldn't send resynced report\n", s->conn->id, s->index);
+                return;
             }
+            s->resynced = false;
+        } else {
+            slot_send_datagram(s, s->wire, s->wire_layout.size);
+        }
+        slot_clear_rel(s);
+        return;
+    }
 
-            got_request = true;
+    sendq_lock(queue);
 
-            printf("CONN(%d): Got client request\n", args->id);
+    // The waiting frame will never be sent: its motion is carried over, and as the delta would be against it, a full report
+    // is sent instead
+    bool replacing = sendq_replaces(queue, s->index);
+    if (replacing) {
+        for (int i = 0; i < report->rel.len; i++) {
+            slot_set_rel(s, i, report->rel.data[i] + s->queued_rel[i]);
+        }
+    }
 
-            for (int i = 0; i < msg.request.requests.len; i++) {
-                int         index = device_controllers.len;
-                Controller *ctr   = NULL;
-                vec_push(&device_controllers, &ctr);
+    if (!slot_build_delta(s) && !s->resynced) {
+        sendq_unlock(queue);
+        return;
+    }
+    slot_stamp(s);
+    s->resynced = false;
+
+    bool full = replacing;
+    if (replacing) {
+        s->since_keyframe = 0;
+    } else {
+        full = slot_keyframe(s);
+    }
 
-                struct DeviceThreadArgs *dev_args = malloc(sizeof(struct DeviceThreadArgs));
+    // A full report is already serialized, only the delta has to be
+    if (full) {
+        slot_queue_report(s, s->wire, false, s->wire_layout.size);
+    } else {
+        int len = msg_device_serialize(s->buf, sizeof(s->buf), (DeviceMessage *)&s->delta);
+        if (len < 0) {
+            printf("CONN(%d): [%d] Couldn't serialize report %d\n", s->conn->id, s->index, len);
+            counter_add(&serialize_failures, 1);
+            sendq_unlock(queue);
+            return;
+        }
+        slot_queue_report(s, s->buf, true, len);
+    }
+    sendq_unlock(queue);
 
-                dev_args->controller = vec_get(&device_controllers, index);
-                dev_args->tag_count  = msg.request.requests.data[i].tags.len;
-                dev_args->tags       = malloc(dev_args->tag_count * sizeof(char *));
-                dev_args->conn       = args;
-                dev_args->index      = index;
+    memcpy(s->queued_rel, report->rel.data, report->rel.len * sizeof(*report->rel.data));
+    slot_frame_sent(s);
+}
 
-                for (int j = 0; j < dev_args->tag_count; j++) {
-                    Tag t = msg.request.requests.data[i].tags.data[j];
-                    dev_args->tags[j] = strndup(t.name.data, t.name.len);
-                }
+static void shared_publish(struct SharedDevice *d);
 
-                pthread_t thread;
-                pthread_create(&thread, NULL, device_thread, dev_args);
-                vec_push(&device_threads, &thread);
-            }
+// Apply an event of the slot's device to the report, and send the report on EV_SYN
+static void slot_handle_event(SlotState *s, struct input_event *event) {
+    Controller *ctr = s->ctr;
 
-            msg_device_free(&msg);
+    // The kernel's buffer overflowed: what's left of the frame is unreliable, the state is read again once the frame ends
+    if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+        printf("HID:     Events of '%s' (%lu) dropped, resyncing\n", ctr->dev.name, ctr->dev.id);
+        counter_add(&s->counters->drops, 1);
+        s->dropping = true;
+        return;
+    }
+
+    if (s->dropping) {
+        if (event->type != EV_SYN || event->code != SYN_REPORT) {
+            return;
+        }
+        s->dropping = false;
+        slot_resync(s);
+    }
+
+    if (event->type == EV_SYN) {
+        s->event_ns = (uint64_t)event->input_event_sec * 1000000000 + (uint64_t)event->input_event_usec * 1000;
+        if (s->shared != NULL) {
+            shared_publish(s->shared);
         } else {
-            printf("CONN(%d): Illegal message\n", args->id);
+            slot_send_report(s);
+        }
+    } else if (event->type == EV_ABS) {
+        uint16_t index = ctr->dev.caps->mapping.abs_indices[event->code];
+
+        // Unmapped codes must not get there: the index is an offset into the serialized report
+        if (index == DEVICE_MAP_NONE) {
+            printf("CONN(%d): [%d] Invalid abs\n", s->conn->id, s->index);
+            return;
+        }
+
+        slot_set_abs(s, index, event->value);
+    } else if (event->type == EV_REL) {
+        uint16_t index = ctr->dev.caps->mapping.rel_indices[event->code];
+
+        if (index == DEVICE_MAP_NONE) {
+            printf("CONN(%d): [%d] Invalid rel\n", s->conn->id, s->index);
+            return;
+        }
+
+        slot_set_rel(s, index, event->value);
+    } else if (event->type == EV_KEY) {
+        uint16_t index = ctr->dev.caps->mapping.key_indices[event->code];
+
+        if (index == DEVICE_MAP_NONE) {
+            printf("CONN(%d): [%d] Invalid key\n", s->conn->id, s->index);
+            return;
         }
+        slot_set_key(s, index, event->value != 0);
     }
+}
 
-conn_end:
-    shutdown(args->socket, SHUT_RDWR);
-    printf("CONN(%u): connection closed (%s)\n", args->id, closing_message);
-    args->closed = true;
-    for (int i = 0; i < device_threads.len; i++) {
-        pthread_t thread = *(pthread_t *)vec_get(&device_threads, i);
-        pthread_kill(thread, SIGTERM);
-        pthread_join(thread, NULL);
+// Where the next read from the slot's device should go, and how much it can read
+static inline void  *slot_read_ptr(SlotState *s) { return (uint8_t *)s->events + s->carry; }
+static inline size_t slot_read_len(SlotState *s) { return sizeof(s->events) - s->carry; }
+
+// Handle the len bytes read at slot_read_ptr, all the complete events are applied in one pass
+static void slot_handle_events(SlotState *s, size_t len) {
+    size_t total = s->carry + len;
+    size_t count = total / sizeof(struct input_event);
+
+    if (s->report.timing.len > 0) {
+        s->read_ns = realtime_ns();
+    }
+
+    counter_add(&s->counters->events, count);
+    for (size_t i = 0; i < count; i++) {
+        slot_handle_event(s, &s->events[i]);
+    }
+
+    // Keep the beginning of a trailing partial event for the next read
+    s->carry = total % sizeof(struct input_event);
+    if (s->carry > 0) {
+        memmove(s->events, &s->events[count], s->carry);
     }
-    free(args);
-    vec_free(device_threads);
-    vec_free(device_controllers);
-    return NULL;
 }
 
-static int sockfd;
+// Tell the client the slot lost its device, returns false if the message couldn't be sent
+static bool slot_detach(SlotState *s) {
+    s->ctr = NULL;
 
-void clean_exit(int _sig) {
-    printf("\rSERVER:  exiting\n");
-    close(sockfd);
-    exit(0);
+    // Send device destroy message
+    DeviceDestroy dstr;
+    dstr.tag   = DeviceTagDestroy;
+    dstr.index = s->index;
+
+    int len = msg_device_serialize(s->buf, sizeof(s->buf), (DeviceMessage *)&dstr);
+    if (conn_send(s->conn, s->index, s->buf, len) == -1) {
+        printf("CONN(%d): [%d] Couldn't send device destroy message\n", s->conn->id, s->index);
+        return false;
+    }
+
+    return true;
 }
 
-void server_run(uint16_t port, char *config_path) {
-    sigemptyset(&empty_sigset);
-    pthread_key_create(&device_args_key, NULL);
-    printf("SERVER:  start\n");
+// Shared devices currently being read, Vec of SharedDevice *
+static Vec             shared_devices       = {0};
+static pthread_mutex_t shared_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    // Parse the config
-    {
-        FILE *configfd = fopen(config_path, "r");
-        if (configfd == NULL) {
-            perror("SERVER:  Couldn't open config file");
-            exit(1);
-        }
+static void shared_unref(SharedDevice *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
 
-        char    *cbuf = malloc(8192);
-        uint8_t *jbuf = (uint8_t *)cbuf + 4096;
+    pthread_mutex_destroy(&d->lock);
+    vec_free(d->wakes);
+    free(d->frames);
+    free(d);
+}
 
-        int len = fread(cbuf, 1, 4096, configfd);
-        if (json_parse(cbuf, len, jbuf, 4096) != 0) {
-            printf("SERVER:  Couldn't parse config, %s (at index %lu)\n", json_strerr(), json_errloc());
-            exit(1);
-        }
+// Publish the current frame of a shared device's reader to the ring and wake up the subscribed slots. Nothing is published
+// if nothing changed.
+static void shared_publish(SharedDevice *d) {
+    SlotState *s = &d->state;
+    if (!slot_build_delta(s) && !s->resynced) {
+        return;
+    }
+    slot_stamp(s);
+    s->resynced = false;
 
-        json_adapt(jbuf, &ConfigAdapter, &config);
+    uint64_t     f = d->head + 1;
+    SharedFrame *e = &d->frames[f % SHARED_DEVICE_RING_SIZE];
 
-#ifdef VERBOSE
-        print_config();
-#endif
+    // Slots reading the frame being overwritten notice the stamp changed and skip ahead
+    __atomic_store_n(&e->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-        free(cbuf);
-        fclose(configfd);
+    for (int i = 0; i < s->report.rel.len; i++) {
+        d->rel_total[i] += s->report.rel.data[i];
     }
 
-    // Start the hid thread
-    {
-        pthread_t _thread;
-        pthread_create(&_thread, NULL, hid_thread, &config);
+    e->report  = s->report;
+    e->read_ns = s->read_ns;
+    memcpy(e->rel_total, d->rel_total, sizeof(d->rel_total));
+    memcpy(e->full, s->wire, s->wire_layout.size);
+    e->full_len  = s->wire_layout.size;
+    e->delta_len = slot_keyframe(s) ? 0 : msg_device_serialize(e->delta, sizeof(e->delta), (DeviceMessage *)&s->delta);
+    if (e->delta_len < 0) {
+        counter_add(&serialize_failures, 1);
     }
 
-    // Start the TCP server
+    __atomic_store_n(&e->stamp, f, __ATOMIC_RELEASE);
+    __atomic_store_n(&d->head, f, __ATOMIC_RELEASE);
+    slot_frame_sent(s);
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        panicf("Couldn't open socket\n");
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < d->wakes.len; i++) {
+        eventfd_write(*(int *)vec_get(&d->wakes, i), 1);
     }
+    pthread_mutex_unlock(&d->lock);
+}
 
-    sockfd = sock;
+// Body of the thread reading a shared device, until the device is lost
+static void *shared_reader(void *arg) {
+    SharedDevice *d = arg;
+    SlotState    *s = &d->state;
 
-    TRAP(SIGINT, clean_exit);
-    TRAP(SIGHUP, clean_exit);
-    TRAP(SIGQUIT, clean_exit);
-    TRAP(SIGTERM, clean_exit);
+    metrics_thread_enter();
 
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
-        printf("SERVER:  error when trying to enable SO_REUSEADDR\n");
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
-        printf("SERVER:  error when trying to enable SO_REUSEPORT\n");
+    while (true) {
+        int len = read(d->ctr.dev.event, slot_read_ptr(s), slot_read_len(s));
+        if (len <= 0) {
+            break;
+        }
+        slot_handle_events(s, len);
+    }
 
-    struct sockaddr_in addr = {0};
-    addr.sin_family         = AF_INET;
-    addr.sin_addr.s_addr    = htonl(INADDR_ANY);
-    addr.sin_port           = htons(port);
+    pthread_mutex_lock(&shared_devices_mutex);
+    for (int i = 0; i < shared_devices.len; i++) {
+        if (*(SharedDevice **)vec_get(&shared_devices, i) == d) {
+            vec_remove(&shared_devices, i, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shared_devices_mutex);
 
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        panicf("Couldn't bind to the socket\n");
+    forget_device(&d->ctr);
+
+    __atomic_store_n(&d->lost, true, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < d->wakes.len; i++) {
+        eventfd_write(*(int *)vec_get(&d->wakes, i), 1);
     }
+    pthread_mutex_unlock(&d->lock);
 
-    if (listen(sock, 16) != 0) {
+    shared_unref(d);
+    metrics_thread_exit();
+    return NULL;
+}
+
+// Get the shared device of a cloneable controller, starting its reader if there isn't one yet
+static SharedDevice *shared_get(Controller *ctr) {
+    pthread_mutex_lock(&shared_devices_mutex);
+    if (shared_devices.data == NULL) {
+        shared_devices = vec_of(SharedDevice *);
+    }
+
+    for (int i = 0; i < shared_devices.len; i++) {
+        SharedDevice *d = *(SharedDevice **)vec_get(&shared_devices, i);
+        if (d->ctr.dev.id == ctr->dev.id) {
+            __atomic_add_fetch(&d->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shared_devices_mutex);
+            return d;
+        }
+    }
+
+    SharedDevice *d = calloc(1, sizeof(SharedDevice));
+    d->ctr          = *ctr;
+    d->ctr.dev.caps = device_caps_ref(ctr->dev.caps);
+    d->frames       = calloc(SHARED_DEVICE_RING_SIZE, sizeof(SharedFrame));
+    d->refs         = 2;
+    d->wakes        = vec_of(int);
+    d->state.shared = d;
+    pthread_mutex_init(&d->lock, NULL);
+    slot_reset(&d->state, &d->ctr, 0);
+    // Frames are full reports as well, they start from the current state of the device
+    slot_resync(&d->state);
+
+    printf("HID:     Reading shared device '%s' (%lu)\n", ctr->dev.name, ctr->dev.id);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, shared_reader, d);
+    pthread_detach(thread);
+
+    vec_push(&shared_devices, &d);
+    pthread_mutex_unlock(&shared_devices_mutex);
+    return d;
+}
+
+// Subscribe a slot to the frames of its cloneable device, starting with the next one. Returns false on failure.
+static bool slot_subscribe(SlotState *s, Controller *ctr) {
+    s->wake = eventfd(0, 0);
+    if (s->wake < 0) {
+        return false;
+    }
+
+    SharedDevice *d = shared_get(ctr);
+    pthread_mutex_lock(&d->lock);
+    vec_push(&d->wakes, &s->wake);
+    s->frame = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&d->lock);
+
+    s->source  = d;
+    s->in_sync = false;
+
+    // The motion of the frames skipped before the first one sent is counted from the frame we start at
+    memset(s->rel_total, 0, sizeof(s->rel_total));
+    s->counted = s->frame == 0;
+    if (s->frame > 0) {
+        SharedFrame *e = &d->frames[s->frame % SHARED_DEVICE_RING_SIZE];
+        memcpy(s->rel_total, e->rel_total, sizeof(s->rel_total));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s->counted = __atomic_load_n(&e->stamp, __ATOMIC_RELAXED) == s->frame;
+    }
+    return true;
+}
+
+static void slot_unsubscribe(SlotState *s) {
+    SharedDevice *d = s->source;
+
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < d->wakes.len; i++) {
+        if (*(int *)vec_get(&d->wakes, i) == s->wake) {
+            vec_remove(&d->wakes, i, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    close(s->wake);
+    s->source = NULL;
+    shared_unref(d);
+}
+
+// Make the shared frame in the buffer of a slot its own
+static void slot_patch_frame(SlotState *s, bool delta) {
+    if (delta) {
+        s->buf[s->delta_layout.slot]  = s->index;
+        s->buf[s->delta_layout.index] = s->report.index;
+    } else {
+        s->buf[s->wire_layout.slot]              = s->index;
+        s->buf[s->wire_layout.index]             = s->report.index;
+        *(uint32_t *)&s->buf[s->wire_layout.seq] = ++s->seq;
+    }
+}
+
+// Cut the timing out of the shared frame in the buffer of a slot, returns the new length of the frame
+static int slot_strip_timing(SlotState *s, bool delta, int len) {
+    size_t at = delta ? s->delta_layout.timing : s->wire_layout.timing;
+
+    // The size of a timing is a multiple of the alignment of the end of a message, that just moves up
+    s->buf[delta ? s->delta_layout.timing_len : s->wire_layout.timing_len] = 0;
+    memmove(&s->buf[at], &s->buf[at + TIMING_LAYOUT.size], len - at - TIMING_LAYOUT.size);
+    return len - TIMING_LAYOUT.size;
+}
+
+// Send a frame of the shared device of a slot as a report of the slot's own, the slot's report is replaced by it
+static void slot_send_own_frame(SlotState *s, DeviceReport *report) {
+    size_t abs_size = report->abs.len * sizeof(*report->abs.data);
+    size_t rel_size = report->rel.len * sizeof(*report->rel.data);
+    memcpy(s->report.abs.data, report->abs.data, abs_size);
+    memcpy(s->report.rel.data, report->rel.data, rel_size);
+    memcpy(s->report.key.data, report->key.data, words_for_bits(report->key.len) * sizeof(*report->key.data));
+    memcpy(&s->wire[s->wire_layout.abs], report->abs.data, abs_size);
+    memcpy(&s->wire[s->wire_layout.rel], report->rel.data, rel_size);
+    // A bitset is sent as the first bytes of its words
+    memcpy(&s->wire[s->wire_layout.key], report->key.data, (report->key.len + 7) / 8);
+    slot_send_report(s);
+}
+
+// Send frame f of the shared device of a slot, returns false if it has been overwritten before it could be read
+static bool slot_send_frame(SlotState *s, uint64_t f) {
+    SharedFrame *e     = &s->source->frames[f % SHARED_DEVICE_RING_SIZE];
+    SendQueue   *queue = &s->conn->queue;
+    bool         udp   = s->conn->udp >= 0;
+    bool         next  = f == s->frame + 1;
+
+    // Read the frame, then check that it wasn't overwritten in the meantime
+    if (__atomic_load_n(&e->stamp, __ATOMIC_ACQUIRE) != f) {
+        return false;
+    }
+
+    bool delta = s->in_sync && next && !udp && e->delta_len > 0;
+    int  len   = delta ? e->delta_len : e->full_len;
+    if (len <= 0 || len > sizeof(s->buf)) {
+        return false;
+    }
+
+    DeviceReport report  = e->report;
+    uint64_t     read_ns = e->read_ns;
+    uint32_t     rel_total[REPORT_REL_COUNT];
+    memcpy(rel_total, e->rel_total, sizeof(rel_total));
+    memcpy(s->buf, delta ? e->delta : e->full, len);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->stamp, __ATOMIC_RELAXED) != f) {
+        return false;
+    }
+
+    // Frames have been skipped, the motion they carried is sent with this one, which then can't be sent as is
+    bool skipped = s->counted && !next;
+    if (skipped) {
+        for (int i = 0; i < report.rel.len; i++) {
+            report.rel.data[i] = rel_total[i] - s->rel_total[i];
+        }
+    }
+    memcpy(s->rel_total, rel_total, sizeof(rel_total));
+    s->counted  = true;
+    s->in_sync  = true;
+    s->event_ns = report.timing.data[0].event;
+    s->read_ns  = read_ns;
+
+    if (skipped) {
+        slot_send_own_frame(s, &report);
+        return true;
+    }
+
+    if (s->timings == NULL) {
+        len = slot_strip_timing(s, delta, len);
+    } else {
+        hist_record_span(&s->timings->read_serialize, read_ns, report.timing.data[0].sent);
+    }
+
+    if (udp) {
+        slot_patch_frame(s, false);
+        slot_send_datagram(s, s->buf, len);
+        return true;
+    }
+
+    sendq_lock(queue);
+
+    // Replacing the waiting report needs a report of the slot's own (see slot_send_report)
+    if (sendq_replaces(queue, s->index)) {
+        sendq_unlock(queue);
+        slot_send_own_frame(s, &report);
+        return true;
+    }
+
+    slot_patch_frame(s, delta);
+    slot_queue_report(s, s->buf, delta, len);
+    sendq_unlock(queue);
+
+    memcpy(s->queued_rel, report.rel.data, report.rel.len * sizeof(*report.rel.data));
+    memcpy(s->sent.abs.data, report.abs.data, report.abs.len * sizeof(*report.abs.data));
+    memcpy(s->sent.key.data, report.key.data, words_for_bits(report.key.len) * sizeof(*report.key.data));
+    return true;
+}
+
+// Send the frames the shared device of a slot published since the last call, returns false once the device is lost
+static bool slot_consume_shared(SlotState *s) {
+    SharedDevice *d = s->source;
+    // The device is only marked lost after its last frame, which has to be sent as well
+    bool     lost   = __atomic_load_n(&d->lost, __ATOMIC_ACQUIRE);
+    uint64_t head   = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+    bool     behind = false;
+
+    while (s->frame < head) {
+        // Skip to the latest frame when the next ones are about to be (or have been) overwritten by the reader
+        behind     = behind || head - s->frame > SHARED_DEVICE_RING_SIZE / 2;
+        uint64_t f = behind ? head : s->frame + 1;
+
+        if (slot_send_frame(s, f)) {
+            s->frame = f;
+        } else {
+            behind = true;
+            head   = __atomic_load_n(&d->head, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return !lost;
+}
+
+// Timings of the slots of every connection, Vec of SlotTimings *
+static Vec             slot_timings       = {0};
+static pthread_mutex_t slot_timings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static SlotTimings *timings_open(uint32_t conn, int slot) {
+    SlotTimings *t = calloc(1, sizeof(SlotTimings));
+    t->conn        = conn;
+    t->slot        = slot;
+
+    pthread_mutex_lock(&slot_timings_mutex);
+    if (slot_timings.data == NULL) {
+        slot_timings = vec_of(SlotTimings *);
+    }
+    vec_push(&slot_timings, &t);
+    pthread_mutex_unlock(&slot_timings_mutex);
+    return t;
+}
+
+// Free the timings of a slot, nothing can record to them anymore
+static void timings_close(SlotTimings *t) {
+    pthread_mutex_lock(&slot_timings_mutex);
+    for (int i = 0; i < slot_timings.len; i++) {
+        if (*(SlotTimings **)vec_get(&slot_timings, i) == t) {
+            vec_remove(&slot_timings, i, NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&slot_timings_mutex);
+    free(t);
+}
+
+static void timings_print(void) {
+    char line[256];
+
+    pthread_mutex_lock(&slot_timings_mutex);
+    printf("SERVER:  Timings of %lu slots\n", slot_timings.len);
+    for (int i = 0; i < slot_timings.len; i++) {
+        SlotTimings *t = *(SlotTimings **)vec_get(&slot_timings, i);
+
+        hist_format(&t->read_serialize, line, sizeof(line));
+        printf("CONN(%u): [%d] read->serialize: %s\n", t->conn, t->slot, line);
+        hist_format(&t->serialize_send, line, sizeof(line));
+        printf("CONN(%u): [%d] serialize->send: %s\n", t->conn, t->slot, line);
+    }
+    pthread_mutex_unlock(&slot_timings_mutex);
+}
+
+// Print the timings every time SIGUSR1 is received, the signal has to be blocked in every thread
+static void *timings_thread(void *_arg) {
+    metrics_thread_enter();
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    int sig;
+    while (sigwait(&set, &sig) == 0) {
+        timings_print();
+    }
+    return NULL;
+}
+
+// Release what a device thread holds once it leaves its loop
+static void device_thread_exit(struct DeviceThreadArgs *args, SlotState *slot) {
+    printf("CONN(%d): [%d] exiting\n", args->conn->id, args->index);
+
+    if (slot->source != NULL) {
+        slot_unsubscribe(slot);
+    }
+
+    Controller *ctr = *args->controller;
+    if (ctr != NULL) {
+        return_device(ctr);
+        free(ctr);
+    }
+
+    free(args->tags);
+    free(args);
+    metrics_thread_exit();
+}
+
+// Wait until fd can be read, returns false once the connection of the device thread is closed. The threads are never
+// interrupted: they hold the locks of the send queue and of shared devices, they always leave through here instead.
+static bool device_thread_wait(struct DeviceThreadArgs *args, int fd) {
+    struct pollfd pfds[2] = {
+        {.fd = fd,               .events = POLLIN},
+        {.fd = args->conn->stop, .events = POLLIN},
+    };
+
+    while (poll(pfds, 2, -1) < 0) {
+        if (errno != EINTR) {
+            printf("CONN(%d): [%d] Poll error\n", args->conn->id, args->index);
+            return false;
+        }
+    }
+    return !(pfds[1].revents & POLLIN);
+}
+
+void *device_thread(void *args_) {
+    struct DeviceThreadArgs *args = args_;
+
+    metrics_thread_enter();
+
+    TRAP_IGN(SIGPIPE);
+
+    SlotState slot = {
+        .conn    = args->conn,
+        .index   = args->index,
+        .seed    = args->conn->id * 256 + args->index,
+        .timings = args->timings,
+    };
+
+    while (true) {
+        *args->controller = NULL;
+        uint8_t     controller_index;
+        Controller *ctr = malloc(sizeof(Controller));
+
+        // Woken up by the connection once it is closed
+        if (!get_device(args->tags, args->tag_count, &args->conn->closed, ctr, &controller_index)) {
+            free(ctr);
+            break;
+        }
+        *args->controller = ctr;
+
+        // Cloneable devices are read by their shared reader, the slot only sends the frames it publishes. It subscribes before
+        // taking its snapshot of the device, no frame published after that is missed.
+        bool duplicate  = ctr->ctr.duplicate;
+        bool subscribed = duplicate && slot_subscribe(&slot, ctr);
+        bool stopped    = false;
+
+        if (!slot_attach(&slot, ctr, controller_index)) {
+            break;
+        }
+        conn_flush(args->conn);
+
+        if (duplicate) {
+            if (subscribed) {
+                eventfd_t value;
+                while (true) {
+                    if (!device_thread_wait(args, slot.wake)) {
+                        stopped = true;
+                        break;
+                    }
+                    if (eventfd_read(slot.wake, &value) != 0 || !slot_consume_shared(&slot)) {
+                        break;
+                    }
+                    conn_flush(args->conn);
+                }
+                slot_unsubscribe(&slot);
+            }
+
+            // The reader lost the device, the slot lets go of it as well
+            *args->controller = NULL;
+            return_device(ctr);
+            free(ctr);
+        }
+
+        while (!duplicate) {
+            // The device is given back on exit
+            if (!device_thread_wait(args, ctr->dev.event)) {
+                stopped = true;
+                break;
+            }
+
+            int len = read(ctr->dev.event, slot_read_ptr(&slot), slot_read_len(&slot));
+
+            if (len <= 0) {
+                // We lost the device, so we mark it as broken (we forget it) and try to get a new one (in the next iteration of
+                // the outer while)
+                *args->controller = NULL;
+                forget_device(ctr);
+                free(ctr);
+                break;
+            }
+
+            slot_handle_events(&slot, len);
+            conn_flush(args->conn);
+        }
+
+        if (stopped || !slot_detach(&slot)) {
+            break;
+        }
+        conn_flush(args->conn);
+    }
+
+    device_thread_exit(args, &slot);
+    return NULL;
+}
+
+void *server_handle_conn(void *args_) {
+    struct Connection *args = args_;
+
+    printf("CONN(%u): start\n", args->id);
+    metrics_thread_enter();
+
+    conn_setup_socket(args);
+    sendq_init(&args->queue);
+    recvq_init(&args->inbox, RECV_QUEUE_SIZE);
+    conn_register(args);
+    args->wake = eventfd(0, EFD_NONBLOCK);
+    args->stop = eventfd(0, EFD_NONBLOCK);
+
+    char *closing_message    = "";
+    bool  got_request        = false;
+    Vec   device_threads     = vec_of(pthread_t);
+    Vec   device_controllers = vec_of(Controller *);
+    // SlotTimings * of the slots, if the client asked for the timing of reports
+    Vec   device_timings     = vec_of(SlotTimings *);
+
+    // The socket, and the eventfd the device threads wake us up with when the send queue needs draining
+    struct pollfd pfds[2] = {
+        {.fd = args->socket, .events = POLLIN},
+        {.fd = args->wake,   .events = POLLIN},
+    };
+    struct pollfd *pfd = &pfds[0];
+
+    while (1) {
+        pfd->events = sendq_pending(&args->queue) ? POLLIN | POLLOUT : POLLIN;
+
+        int rc = poll(pfds, 2, config.request_timeout);
+
+        // If poll timed out
+        if (rc == 0) {
+            if (!got_request) {
+                printf("CONN(%d): Didn't get a device request within %i.%03ds\n", args->id, config.request_timeout / 1000,
+                       config.request_timeout % 1000);
+                closing_message = "Timed out";
+                goto conn_end;
+            }
+
+            continue;
+        } else if (rc < 0) { // If poll failed (basically never)
+            closing_message = "Poll error";
+            goto conn_end;
+        }
+
+        // Test for error on socket
+        if (pfd->revents & POLLHUP || pfd->revents & POLLERR) {
+            closing_message = "Lost peer";
+            goto conn_end;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            eventfd_t value;
+            eventfd_read(args->wake, &value);
+        }
+
+        if (sendq_drain(&args->queue, args->socket) < 0) {
+            closing_message = "Lost peer (from send)";
+            goto conn_end;
+        }
+
+        if (!(pfd->revents & POLLIN)) {
+            continue;
+        }
+
+        if (!conn_receive(args)) {
+            closing_message = "Lost peer (from recv)";
+            goto conn_end;
+        }
+
+        // Handle every message received entirely, a partial one is completed by the next receive
+        DeviceMessage msg;
+        while ((rc = conn_next_message(args, &msg)) != 0) {
+            if (rc < 0) {
+                continue;
+            }
+
+            if (msg.tag == DeviceTagControllerState) {
+                int i = msg.controller_state.index;
+                if (i >= device_controllers.len) {
+                    printf("CONN(%d): Invalid controller index in controller state message\n", args->id);
+                    continue;
+                }
+
+                Controller *ctr = *(Controller **)vec_get(&device_controllers, i);
+                if (ctr == NULL) {
+                    printf("CONN(%d): Received controller state message but the device hasn't yet been received\n", args->id);
+                    continue;
+                }
+
+                apply_controller_state(ctr, &msg.controller_state);
+            } else if (msg.tag == DeviceTagRequest) {
+                if (got_request) {
+                    printf("CONN(%d): Illegal Request message after initial request\n", args->id);
+                    msg_device_free(&msg);
+                    continue;
+                }
+
+                got_request = true;
+
+                printf("CONN(%d): Got client request\n", args->id);
+
+                if (msg.request.udp_port != 0) {
+                    conn_open_udp(args, msg.request.udp_port);
+                }
+
+                for (int i = 0; i < msg.request.requests.len; i++) {
+                    int         index = device_controllers.len;
+                    Controller *ctr   = NULL;
+                    vec_push(&device_controllers, &ctr);
+
+                    struct DeviceThreadArgs *dev_args = malloc(sizeof(struct DeviceThreadArgs));
+
+                    dev_args->controller = vec_get(&device_controllers, index);
+                    dev_args->tag_count  = msg.request.requests.data[i].tags.len;
+                    dev_args->tags       = malloc(dev_args->tag_count * sizeof(int));
+                    dev_args->conn       = args;
+                    dev_args->index      = index;
+                    dev_args->timings    = NULL;
+
+                    if (msg.request.timing) {
+                        dev_args->timings = timings_open(args->id, index);
+                        vec_push(&device_timings, &dev_args->timings);
+                    }
+
+                    for (int j = 0; j < dev_args->tag_count; j++) {
+                        Tag t             = msg.request.requests.data[i].tags.data[j];
+                        dev_args->tags[j] = hid_tag_id(t.name.data, t.name.len);
+                    }
+
+                    pthread_t thread;
+                    pthread_create(&thread, NULL, device_thread, dev_args);
+                    vec_push(&device_threads, &thread);
+                }
+
+                msg_device_free(&msg);
+            } else {
+                printf("CONN(%d): Illegal message\n", args->id);
+            }
+        }
+    }
+
+conn_end:
+    shutdown(args->socket, SHUT_RDWR);
+    printf("CONN(%u): connection closed (%s)\n", args->id, closing_message);
+    args->closed = true;
+    // The device threads see it either waiting for a device or waiting on theirs, and exit on their own
+    wake_device_waiters(&args->closed);
+    eventfd_write(args->stop, 1);
+    for (int i = 0; i < device_threads.len; i++) {
+        pthread_join(*(pthread_t *)vec_get(&device_threads, i), NULL);
+    }
+    if (args->udp >= 0) {
+        close(args->udp);
+    }
+    conn_print_queue_stats(args);
+    conn_unregister(args);
+    sendq_free(&args->queue);
+    recvq_free(&args->inbox);
+    close(args->wake);
+    close(args->stop);
+    for (int i = 0; i < device_timings.len; i++) {
+        timings_close(*(SlotTimings **)vec_get(&device_timings, i));
+    }
+    free(args);
+    vec_free(device_threads);
+    vec_free(device_controllers);
+    vec_free(device_timings);
+    metrics_thread_exit();
+    return NULL;
+}
+
+// Event loop modes: a fixed set of workers accept connections and drive their sockets as well as the event fd of every device
+// their slots hold. A connection and its slots always live on the worker that accepted it. Workers either wait on readiness
+// with epoll and do the reads and sends themselves, or queue the reads and sends on an io_uring and handle completions.
+
+// What a pointer registered in a worker's epoll instance (or ring) points to, always the first member of the pointed to struct
+typedef enum {
+    LoopSourceListen,
+    LoopSourceNotify,
+    LoopSourceConn,
+    LoopSourceSlot,
+} LoopSource;
+
+// Operations of the io_uring backend, stored in the low bits of the user_data, next to the pointer to the source
+typedef enum {
+    UringOpPoll     = 0,
+    UringOpRead     = 1,
+    UringOpSend     = 2,
+    UringOpCancel   = 3,
+    UringOpTimeout  = 4,
+    UringOpWritable = 5,
+} UringOp;
+
+#define URING_OP_MASK 7
+
+struct LoopConn;
+
+typedef struct {
+    LoopSource       source;
+    SlotState        state;
+    struct LoopConn *conn;
+    int             *tags;
+    size_t           tag_count;
+    // The controller held by the slot, only valid when event >= 0
+    Controller controller;
+    // Duplicate of the controller's event fd (or the slot's wake eventfd for cloneable devices), watched by the worker, -1
+    // while waiting for a device
+    int event;
+    // Where the wake eventfd is read to (io_uring only)
+    eventfd_t wakeups;
+    // Whether a read is queued on the ring (io_uring only)
+    bool reading;
+} LoopSlot;
+
+typedef struct LoopConn {
+    LoopSource        source;
+    struct Connection conn;
+    bool              got_request;
+    // Monotonic time (in ms) before which the request has to be received
+    uint64_t deadline;
+    // Vec of LoopSlot *
+    Vec slots;
+    // io_uring only: operations queued on the ring for the connection or its slots, the connection can't be freed before
+    // they all complete
+    int  inflight;
+    bool polling;
+    // Whether a send (or a wait for the socket to be writable) is queued on the ring, with epoll whether the socket is watched
+    // for writability
+    bool sending;
+} LoopConn;
+
+typedef struct {
+    int epoll;
+    // eventfd written to by the hid thread when devices may have become available
+    int notify;
+    // Vec of LoopConn *
+    Vec conns;
+    // io_uring backend, used instead of epoll when uring is true
+    bool                     uring;
+    Uring                    ring;
+    bool                     timeout_armed;
+    struct __kernel_timespec timeout;
+} LoopWorker;
+
+static LoopSource listen_source = LoopSourceListen;
+static LoopSource notify_source = LoopSourceNotify;
+static uint32_t   conn_ids      = 0;
+static int        sockfd;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct io_uring_sqe *uring_sqe(LoopWorker *w, void *ptr, UringOp op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        panicf("SERVER:  io_uring submission queue is full\n");
+    }
+    sqe->user_data = (uintptr_t)ptr | op;
+    return sqe;
+}
+
+static void uring_arm_poll(LoopWorker *w, int fd, LoopSource *source) {
+    struct io_uring_sqe *sqe = uring_sqe(w, source, UringOpPoll);
+    sqe->opcode              = IORING_OP_POLL_ADD;
+    sqe->fd                  = fd;
+    sqe->poll32_events       = POLLIN;
+}
+
+static void uring_arm_read(LoopWorker *w, LoopSlot *slot) {
+    struct io_uring_sqe *sqe = uring_sqe(w, slot, UringOpRead);
+    sqe->opcode              = IORING_OP_READ;
+    sqe->fd                  = slot->event;
+    sqe->addr                = (uintptr_t)slot_read_ptr(&slot->state);
+    sqe->len                 = slot_read_len(&slot->state);
+    if (slot->state.source != NULL) {
+        sqe->addr = (uintptr_t)&slot->wakeups;
+        sqe->len  = sizeof(slot->wakeups);
+    }
+    // The offset is ignored by character devices, -1 means current position
+    sqe->off = -1;
+
+    slot->reading = true;
+    slot->conn->inflight++;
+}
+
+static void uring_cancel(LoopWorker *w, void *ptr, UringOp op) {
+    struct io_uring_sqe *sqe = uring_sqe(w, NULL, UringOpCancel);
+    sqe->opcode              = IORING_OP_ASYNC_CANCEL;
+    sqe->addr                = (uintptr_t)ptr | op;
+}
+
+static void loop_conn_close(LoopWorker *w, LoopConn *c, const char *reason);
+
+// Queue a send of what's left of the batch being sent on a connection, if there isn't already one in flight. A new batch is
+// only taken from the send queue once the socket is writable, reports keep being replaced in the queue until then.
+static void uring_flush(LoopWorker *w, LoopConn *c, bool writable) {
+    SendQueue *q = &c->conn.queue;
+    if (c->conn.closed) {
+        return;
+    } else if (c->sending) {
+        // The last send didn't complete within a round of completions, the socket doesn't keep up
+        sendq_lock(q);
+        q->congested = true;
+        sendq_unlock(q);
+        return;
+    }
+
+    sendq_lock(q);
+
+    if (q->out_off >= q->out.len && !writable) {
+        bool waiting = q->depth > 0 && !q->failed;
+        sendq_unlock(q);
+
+        if (waiting) {
+            struct io_uring_sqe *sqe = uring_sqe(w, c, UringOpWritable);
+            sqe->opcode              = IORING_OP_POLL_ADD;
+            sqe->fd                  = c->conn.socket;
+            sqe->poll32_events       = POLLOUT;
+
+            c->sending = true;
+            c->inflight++;
+        }
+        return;
+    }
+
+    size_t         len;
+    const uint8_t *buf = sendq_take(q, &len);
+    sendq_unlock(q);
+
+    if (buf == NULL) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(w, c, UringOpSend);
+    sqe->opcode              = IORING_OP_SEND;
+    sqe->fd                  = c->conn.socket;
+    sqe->addr                = (uintptr_t)buf;
+    sqe->len                 = len;
+    sqe->msg_flags           = MSG_NOSIGNAL;
+
+    c->sending = true;
+    c->inflight++;
+}
+
+// Send what's queued on a connection, and watch the socket for writability while something is left (epoll only)
+static void loop_flush(LoopWorker *w, LoopConn *c) {
+    if (c->conn.closed) {
+        return;
+    }
+
+    int rc = sendq_drain(&c->conn.queue, c->conn.socket);
+    if (rc < 0) {
+        loop_conn_close(w, c, "Lost peer (from send)");
+        return;
+    }
+
+    bool sending = rc == 0;
+    if (sending != c->sending) {
+        struct epoll_event ev = {.events = sending ? EPOLLIN | EPOLLOUT : EPOLLIN, .data.ptr = c};
+        epoll_ctl(w->epoll, EPOLL_CTL_MOD, c->conn.socket, &ev);
+        c->sending = sending;
+    }
+}
+
+// Start watching the device of a slot, returns false on failure
+static bool loop_watch_slot(LoopWorker *w, LoopSlot *slot) {
+    if (w->uring) {
+        uring_arm_read(w, slot);
+        return true;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = slot};
+    return epoll_ctl(w->epoll, EPOLL_CTL_ADD, slot->event, &ev) == 0;
+}
+
+// Start watching a connection's socket, returns false on failure
+static bool loop_watch_conn(LoopWorker *w, LoopConn *c) {
+    if (w->uring) {
+        uring_arm_poll(w, c->conn.socket, &c->source);
+        c->polling = true;
+        c->inflight++;
+        return true;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    return epoll_ctl(w->epoll, EPOLL_CTL_ADD, c->conn.socket, &ev) == 0;
+}
+
+// Close the descriptor watched for a slot
+static void loop_slot_close_event(LoopSlot *slot) {
+    if (slot->state.source != NULL) {
+        slot_unsubscribe(&slot->state);
+    } else {
+        close(slot->event);
+    }
+    slot->event = -1;
+}
+
+// Try to give a device to a waiting slot
+static void loop_slot_acquire(LoopWorker *w, LoopSlot *slot) {
+    if (slot->event >= 0 || slot->conn->conn.closed) {
+        return;
+    }
+
+    uint8_t controller_index;
+    if (!try_get_device(slot->tags, slot->tag_count, &slot->controller, &controller_index)) {
+        return;
+    }
+
+    // Cloneable devices are read by their shared reader, the slot watches the eventfd it is woken up with instead
+    if (slot->controller.ctr.duplicate) {
+        slot->event = slot_subscribe(&slot->state, &slot->controller) ? slot->state.wake : -1;
+    } else {
+        slot->event = dup(slot->controller.dev.event);
+    }
+    if (slot->event < 0) {
+        return_device(&slot->controller);
+        return;
+    }
+
+    if (!slot_attach(&slot->state, &slot->controller, controller_index)) {
+        loop_slot_close_event(slot);
+        return_device(&slot->controller);
+        loop_conn_close(w, slot->conn, "Lost peer (from send)");
+        return;
+    }
+
+    if (!loop_watch_slot(w, slot)) {
+        printf("CONN(%d): [%d] Couldn't watch device\n", slot->conn->conn.id, slot->state.index);
+        loop_slot_close_event(slot);
+        return_device(&slot->controller);
+        slot_detach(&slot->state);
+    }
+}
+
+// Try to give a device to every waiting slot of the worker
+static void loop_acquire_all(LoopWorker *w) {
+    for (int i = 0; i < w->conns.len; i++) {
+        LoopConn *c = *(LoopConn **)vec_get(&w->conns, i);
+        for (int j = 0; j < c->slots.len; j++) {
+            loop_slot_acquire(w, *(LoopSlot **)vec_get(&c->slots, j));
+        }
+    }
+}
+
+// Stop watching the device of a slot
+static void loop_slot_release(LoopWorker *w, LoopSlot *slot) {
+    if (w->uring) {
+        if (slot->reading) {
+            uring_cancel(w, slot, UringOpRead);
+        }
+    } else {
+        epoll_ctl(w->epoll, EPOLL_CTL_DEL, slot->event, NULL);
+    }
+    loop_slot_close_event(slot);
+    slot->state.ctr = NULL;
+}
+
+// The device of a slot is gone, forget it (unless its shared reader already did) and try to get a new one
+static void loop_slot_lost(LoopWorker *w, LoopSlot *slot) {
+    if (slot->state.source == NULL) {
+        forget_device(&slot->controller);
+    } else {
+        return_device(&slot->controller);
+    }
+    loop_slot_release(w, slot);
+    if (!slot_detach(&slot->state)) {
+        loop_conn_close(w, slot->conn, "Lost peer (from send)");
+        return;
+    }
+    loop_slot_acquire(w, slot);
+}
+
+static void loop_slot_readable(LoopWorker *w, LoopSlot *slot) {
+    if (slot->event < 0 || slot->conn->conn.closed) {
+        return;
+    }
+
+    if (slot->state.source != NULL) {
+        eventfd_read(slot->event, &slot->wakeups);
+        if (!slot_consume_shared(&slot->state)) {
+            loop_slot_lost(w, slot);
+        }
+        return;
+    }
+
+    int len = read(slot->event, slot_read_ptr(&slot->state), slot_read_len(&slot->state));
+
+    if (len <= 0) {
+        loop_slot_lost(w, slot);
+        return;
+    }
+
+    slot_handle_events(&slot->state, len);
+}
+
+static void loop_handle_request(LoopWorker *w, LoopConn *c, DeviceRequest *req) {
+    for (int i = 0; i < req->requests.len; i++) {
+        LoopSlot *slot = calloc(1, sizeof(LoopSlot));
+
+        slot->source      = LoopSourceSlot;
+        slot->conn        = c;
+        slot->event       = -1;
+        slot->state.conn  = &c->conn;
+        slot->state.index = c->slots.len;
+        slot->state.seed  = c->conn.id * 256 + slot->state.index;
+        slot->tag_count   = req->requests.data[i].tags.len;
+        slot->tags        = malloc(slot->tag_count * sizeof(int));
+
+        for (int j = 0; j < slot->tag_count; j++) {
+            Tag t         = req->requests.data[i].tags.data[j];
+            slot->tags[j] = hid_tag_id(t.name.data, t.name.len);
+        }
+
+        if (req->timing) {
+            slot->state.timings = timings_open(c->conn.id, slot->state.index);
+        }
+
+        vec_push(&c->slots, &slot);
+    }
+
+    for (int i = 0; i < c->slots.len; i++) {
+        loop_slot_acquire(w, *(LoopSlot **)vec_get(&c->slots, i));
+    }
+}
+
+// Handle a message received on a connection
+static void loop_conn_handle(LoopWorker *w, LoopConn *c, DeviceMessage *msg) {
+    if (msg->tag == DeviceTagControllerState) {
+        int i = msg->controller_state.index;
+        if (i >= c->slots.len) {
+            printf("CONN(%d): Invalid controller index in controller state message\n", c->conn.id);
+            return;
+        }
+
+        LoopSlot *slot = *(LoopSlot **)vec_get(&c->slots, i);
+        if (slot->event < 0) {
+            printf("CONN(%d): Received controller state message but the device hasn't yet been received\n", c->conn.id);
+            return;
+        }
+
+        apply_controller_state(&slot->controller, &msg->controller_state);
+    } else if (msg->tag == DeviceTagRequest) {
+        if (c->got_request) {
+            printf("CONN(%d): Illegal Request message after initial request\n", c->conn.id);
+            msg_device_free(msg);
+            return;
+        }
+
+        c->got_request = true;
+
+        printf("CONN(%d): Got client request\n", c->conn.id);
+
+        if (msg->request.udp_port != 0) {
+            conn_open_udp(&c->conn, msg->request.udp_port);
+        }
+
+        loop_handle_request(w, c, &msg->request);
+        msg_device_free(msg);
+    } else {
+        printf("CONN(%d): Illegal message\n", c->conn.id);
+    }
+}
+
+static void loop_conn_readable(LoopWorker *w, LoopConn *c, uint32_t events) {
+    if (c->conn.closed) {
+        return;
+    }
+
+    // Test for error on socket
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        loop_conn_close(w, c, "Lost peer");
+        return;
+    }
+
+    // Only writable, the queue is drained by the worker loop
+    if (!(events & EPOLLIN)) {
+        return;
+    }
+
+    if (!conn_receive(&c->conn)) {
+        loop_conn_close(w, c, "Lost peer (from recv)");
+        return;
+    }
+
+    // Handle every message received entirely, a partial one is completed by the next receive
+    DeviceMessage msg;
+    int           rc;
+    while (!c->conn.closed && (rc = conn_next_message(&c->conn, &msg)) != 0) {
+        if (rc > 0) {
+            loop_conn_handle(w, c, &msg);
+        }
+    }
+}
+
+// Close a connection and give back its devices, the connection is only freed by loop_reap
+static void loop_conn_close(LoopWorker *w, LoopConn *c, const char *reason) {
+    if (c->conn.closed) {
+        return;
+    }
+
+    shutdown(c->conn.socket, SHUT_RDWR);
+    printf("CONN(%u): connection closed (%s)\n", c->conn.id, reason);
+    c->conn.closed = true;
+
+    for (int i = 0; i < c->slots.len; i++) {
+        LoopSlot *slot = *(LoopSlot **)vec_get(&c->slots, i);
+        printf("CONN(%d): [%d] exiting\n", c->conn.id, slot->state.index);
+
+        if (slot->event >= 0) {
+            loop_slot_release(w, slot);
+            return_device(&slot->controller);
+        }
+    }
+
+    if (w->uring) {
+        if (c->polling) {
+            uring_cancel(w, &c->source, UringOpPoll);
+        }
+        if (c->sending) {
+            uring_cancel(w, c, UringOpSend);
+            uring_cancel(w, c, UringOpWritable);
+        }
+    } else {
+        epoll_ctl(w->epoll, EPOLL_CTL_DEL, c->conn.socket, NULL);
+    }
+    close(c->conn.socket);
+    if (c->conn.udp >= 0) {
+        close(c->conn.udp);
+    }
+    conn_print_queue_stats(&c->conn);
+}
+
+// Free the closed connections that don't have any operation in flight
+static void loop_reap(LoopWorker *w) {
+    for (int i = w->conns.len - 1; i >= 0; i--) {
+        LoopConn *c = *(LoopConn **)vec_get(&w->conns, i);
+        if (!c->conn.closed || c->inflight > 0) {
+            continue;
+        }
+
+        for (int j = 0; j < c->slots.len; j++) {
+            LoopSlot *slot = *(LoopSlot **)vec_get(&c->slots, j);
+            free(slot->tags);
+            if (slot->state.timings != NULL) {
+                timings_close(slot->state.timings);
+            }
+            free(slot);
+        }
+
+        conn_unregister(&c->conn);
+        sendq_free(&c->conn.queue);
+        recvq_free(&c->conn.inbox);
+        vec_free(c->slots);
+        free(c);
+        vec_remove(&w->conns, i, NULL);
+    }
+}
+
+static void loop_accept(LoopWorker *w) {
+    while (1) {
+        struct sockaddr con_addr;
+        socklen_t       con_len = sizeof(con_addr);
+
+        int socket = accept(sockfd, &con_addr, &con_len);
+        if (socket < 0) {
+            // Other workers are woken up for the same connection, and we drain the backlog until there's nothing left
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Couldn't accept connection (%d)\n", socket);
+            }
+            return;
+        }
+
+        printf("SERVER:  got connection\n");
+
+        LoopConn *c    = calloc(1, sizeof(LoopConn));
+        c->source      = LoopSourceConn;
+        c->conn.socket = socket;
+        c->conn.id     = __atomic_fetch_add(&conn_ids, 1, __ATOMIC_RELAXED);
+        c->conn.closed = false;
+        c->conn.udp    = -1;
+        c->deadline    = monotonic_ms() + config.request_timeout;
+        c->slots       = vec_of(LoopSlot *);
+
+        sendq_init(&c->conn.queue);
+        recvq_init(&c->conn.inbox, RECV_QUEUE_SIZE);
+        conn_register(&c->conn);
+
+        printf("CONN(%u): start\n", c->conn.id);
+        conn_setup_socket(&c->conn);
+
+        if (!loop_watch_conn(w, c)) {
+            printf("CONN(%u): Couldn't watch socket\n", c->conn.id);
+            close(socket);
+            conn_unregister(&c->conn);
+            sendq_free(&c->conn.queue);
+            recvq_free(&c->conn.inbox);
+            vec_free(c->slots);
+            free(c);
+            continue;
+        }
+
+        vec_push(&w->conns, &c);
+    }
+}
+
+// Close connections that didn't send their request in time, and return how long (in ms) the worker can block for
+static int loop_check_timeouts(LoopWorker *w) {
+    uint64_t now     = monotonic_ms();
+    int      timeout = -1;
+
+    for (int i = 0; i < w->conns.len; i++) {
+        LoopConn *c = *(LoopConn **)vec_get(&w->conns, i);
+        if (c->got_request || c->conn.closed) {
+            continue;
+        }
+
+        if (c->deadline <= now) {
+            printf("CONN(%d): Didn't get a device request within %i.%03ds\n", c->conn.id, config.request_timeout / 1000,
+                   config.request_timeout % 1000);
+            loop_conn_close(w, c, "Timed out");
+            continue;
+        }
+
+        int left = c->deadline - now;
+        if (timeout < 0 || left < timeout) {
+            timeout = left;
+        }
+    }
+
+    return timeout;
+}
+
+static void *epoll_worker(void *arg) {
+    LoopWorker        *w = arg;
+    struct epoll_event events[64];
+
+    metrics_thread_enter();
+
+    while (1) {
+        int timeout = loop_check_timeouts(w);
+        loop_reap(w);
+
+        int count = epoll_wait(w->epoll, events, 64, timeout);
+        if (count < 0) {
+            if (errno != EINTR) {
+                perror("SERVER:  epoll_wait failed");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            LoopSource *source = events[i].data.ptr;
+
+            switch (*source) {
+            case LoopSourceListen:
+                loop_accept(w);
+                break;
+            case LoopSourceNotify: {
+                eventfd_t value;
+                eventfd_read(w->notify, &value);
+                loop_acquire_all(w);
+                break;
+            }
+            case LoopSourceConn:
+                loop_conn_readable(w, (LoopConn *)source, events[i].events);
+                break;
+            case LoopSourceSlot:
+                loop_slot_readable(w, (LoopSlot *)source);
+                break;
+            }
+        }
+
+        for (int i = 0; i < w->conns.len; i++) {
+            loop_flush(w, *(LoopConn **)vec_get(&w->conns, i));
+        }
+    }
+
+    return NULL;
+}
+
+static void uring_complete(LoopWorker *w, uint64_t user_data, int res) {
+    UringOp op  = user_data & URING_OP_MASK;
+    void   *ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (op) {
+    case UringOpTimeout:
+        w->timeout_armed = false;
+        break;
+    case UringOpCancel:
+        break;
+    case UringOpPoll: {
+        LoopSource *source = ptr;
+
+        if (*source == LoopSourceListen) {
+            loop_accept(w);
+            uring_arm_poll(w, sockfd, source);
+        } else if (*source == LoopSourceNotify) {
+            eventfd_t value;
+            eventfd_read(w->notify, &value);
+            loop_acquire_all(w);
+            uring_arm_poll(w, w->notify, source);
+        } else if (*source == LoopSourceConn) {
+            LoopConn *c = (LoopConn *)source;
+            c->polling  = false;
+            c->inflight--;
+
+            // poll and epoll flags have the same values
+            loop_conn_readable(w, c, res < 0 ? EPOLLERR : res);
+            if (!c->conn.closed) {
+                loop_watch_conn(w, c);
+            }
+        }
+        break;
+    }
+    case UringOpRead: {
+        LoopSlot *slot = ptr;
+        slot->reading  = false;
+        slot->conn->inflight--;
+
+        if (slot->event < 0 || slot->conn->conn.closed) {
+            break;
+        }
+
+        if (res <= 0 || (slot->state.source != NULL && !slot_consume_shared(&slot->state))) {
+            loop_slot_lost(w, slot);
+            break;
+        }
+
+        if (slot->state.source == NULL) {
+            slot_handle_events(&slot->state, res);
+        }
+        if (slot->event >= 0 && !slot->conn->conn.closed) {
+            uring_arm_read(w, slot);
+        }
+        break;
+    }
+    case UringOpSend: {
+        LoopConn *c = ptr;
+        c->sending  = false;
+        c->inflight--;
+
+        if (c->conn.closed) {
+            break;
+        }
+
+        if (res < 0) {
+            loop_conn_close(w, c, "Lost peer (from send)");
+            break;
+        }
+
+        SendQueue *q = &c->conn.queue;
+        sendq_lock(q);
+        sendq_sent(q, res);
+        if (q->out_off >= q->out.len) {
+            q->congested = false;
+        }
+        sendq_unlock(q);
+        break;
+    }
+    case UringOpWritable: {
+        LoopConn *c = ptr;
+        c->sending  = false;
+        c->inflight--;
+
+        if (c->conn.closed) {
+            break;
+        }
+
+        if (res < 0 || res & (POLLERR | POLLHUP)) {
+            loop_conn_close(w, c, "Lost peer (from send)");
+            break;
+        }
+
+        uring_flush(w, c, true);
+        break;
+    }
+    }
+}
+
+static void *uring_worker(void *arg) {
+    LoopWorker *w = arg;
+
+    metrics_thread_enter();
+
+    uring_arm_poll(w, sockfd, &listen_source);
+    uring_arm_poll(w, w->notify, &notify_source);
+
+    while (1) {
+        int timeout = loop_check_timeouts(w);
+        loop_reap(w);
+
+        if (timeout >= 0 && !w->timeout_armed) {
+            w->timeout.tv_sec  = timeout / 1000;
+            w->timeout.tv_nsec = (timeout % 1000) * 1000000;
+
+            struct io_uring_sqe *sqe = uring_sqe(w, NULL, UringOpTimeout);
+            sqe->opcode              = IORING_OP_TIMEOUT;
+            sqe->addr                = (uintptr_t)&w->timeout;
+            sqe->len                 = 1;
+            w->timeout_armed         = true;
+        }
+
+        // Every report queued while handling the last completions goes out in the same submission as the next reads
+        for (int i = 0; i < w->conns.len; i++) {
+            uring_flush(w, *(LoopConn **)vec_get(&w->conns, i), false);
+        }
+
+        int rc = uring_submit(&w->ring, 1);
+        if (rc < 0 && rc != -EBUSY) {
+            printf("SERVER:  io_uring_enter failed (%d)\n", rc);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&w->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int      res       = cqe->res;
+            uring_cqe_seen(&w->ring);
+
+            uring_complete(w, user_data, res);
+        }
+    }
+
+    return NULL;
+}
+
+// Start the workers and turn the current thread into the first one, never returns
+static void loop_run(void) {
+    TRAP_IGN(SIGPIPE);
+
+    // Every worker is woken up on new connections, so accept must not block the ones that lost the race
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    size_t      count   = config.workers > 0 ? config.workers : 1;
+    LoopWorker *workers = calloc(count, sizeof(LoopWorker));
+    bool        uring   = config.mode == ServerModeUring;
+
+    if (uring) {
+        for (size_t i = 0; i < count; i++) {
+            if (!uring_init(&workers[i].ring, 256)) {
+                perror("SERVER:  io_uring unavailable, falling back to epoll");
+                for (size_t j = 0; j < i; j++) {
+                    uring_free(&workers[j].ring);
+                }
+                uring = false;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        LoopWorker *w = &workers[i];
+
+        w->uring  = uring;
+        w->epoll  = uring ? -1 : epoll_create1(0);
+        w->notify = eventfd(0, EFD_NONBLOCK);
+        w->conns  = vec_of(LoopConn *);
+
+        if ((!uring && w->epoll < 0) || w->notify < 0) {
+            panicf("Couldn't setup worker %lu\n", i);
+        }
+
+        if (!uring) {
+            struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_source};
+            struct epoll_event notify_ev = {.events = EPOLLIN, .data.ptr = &notify_source};
+            if (epoll_ctl(w->epoll, EPOLL_CTL_ADD, sockfd, &listen_ev) != 0 ||
+                epoll_ctl(w->epoll, EPOLL_CTL_ADD, w->notify, &notify_ev) != 0) {
+                panicf("Couldn't setup worker %lu\n", i);
+            }
+        }
+
+        add_device_listener(w->notify);
+    }
+
+    printf("SERVER:  running %lu %s worker(s)\n", count, uring ? "io_uring" : "epoll");
+
+    void *(*worker)(void *) = uring ? uring_worker : epoll_worker;
+    for (size_t i = 1; i < count; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, worker, &workers[i]);
+    }
+
+    worker(&workers[0]);
+}
+
+// Metrics exported for every connection
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} conn_metrics[] = {
+    {"jsfw_connection_reports_sent_total",      "counter", "Reports sent on a connection"                                },
+    {"jsfw_connection_bytes_sent_total",        "counter", "Bytes sent on a connection"                                  },
+    {"jsfw_connection_short_writes_total",      "counter", "Sends on a connection that didn't take all they were given"  },
+    {"jsfw_connection_reports_coalesced_total", "counter", "Reports replaced in the send queue of a connection"           },
+    {"jsfw_connection_send_queue_depth",        "gauge",   "Messages waiting in the send queue of a connection"          },
+    {"jsfw_connection_send_queue_max_depth",    "gauge",   "Highest number of messages waiting in the send queue so far"},
+};
+#define CONN_METRIC_COUNT (sizeof(conn_metrics) / sizeof(conn_metrics[0]))
+
+// Get the values of the metrics of a connection, in the order of conn_metrics
+static void conn_metric_values(struct Connection *conn, uint64_t *values) {
+    SendQueue *q = &conn->queue;
+    values[0]    = counter_get(&q->reports_sent);
+    values[1]    = counter_get(&q->bytes_sent);
+    values[2]    = counter_get(&q->short_writes);
+
+    sendq_lock(q);
+    values[3] = q->coalesced;
+    values[4] = q->depth;
+    values[5] = q->max_depth;
+    sendq_unlock(q);
+}
+
+// Build a snapshot of the metrics of the server, for the metrics socket
+static void server_metrics(Vec *out) {
+    char labels[256];
+
+    // The samples of a metric have to be together, the values of all the connections are taken first
+    pthread_mutex_lock(&connections_mutex);
+    size_t    conn_count = connections.len;
+    uint32_t *ids        = malloc(conn_count * sizeof(uint32_t));
+    uint64_t *values     = malloc(conn_count * CONN_METRIC_COUNT * sizeof(uint64_t));
+    for (int i = 0; i < conn_count; i++) {
+        struct Connection *conn = *(struct Connection **)vec_get(&connections, i);
+        ids[i]                  = conn->id;
+        conn_metric_values(conn, &values[i * CONN_METRIC_COUNT]);
+    }
+    pthread_mutex_unlock(&connections_mutex);
+
+    metrics_describe(out, "jsfw_connections", "gauge", "Open connections");
+    metrics_sample(out, "jsfw_connections", NULL, conn_count);
+    for (int m = 0; m < CONN_METRIC_COUNT; m++) {
+        metrics_describe(out, conn_metrics[m].name, conn_metrics[m].type, conn_metrics[m].help);
+        for (int i = 0; i < conn_count; i++) {
+            snprintf(labels, sizeof(labels), "conn=\"%u\"", ids[i]);
+            metrics_sample(out, conn_metrics[m].name, labels, values[i * CONN_METRIC_COUNT + m]);
+        }
+    }
+    free(ids);
+    free(values);
+
+    pthread_mutex_lock(&device_counters_mutex);
+    metrics_describe(out, "jsfw_device_events_total", "counter", "Input events read from a device");
+    for (int i = 0; i < device_counters.len; i++) {
+        DeviceCounters *c = *(DeviceCounters **)vec_get(&device_counters, i);
+
+        char name[128];
+        metrics_escape(name, sizeof(name), c->name);
+        snprintf(labels, sizeof(labels), "device=\"%s\",id=\"%lu\"", name, c->id);
+        metrics_sample(out, "jsfw_device_events_total", labels, counter_get(&c->events));
+    }
+    metrics_describe(out, "jsfw_device_syn_dropped_total", "counter", "Times the kernel dropped events of a device (SYN_DROPPED)");
+    for (int i = 0; i < device_counters.len; i++) {
+        DeviceCounters *c = *(DeviceCounters **)vec_get(&device_counters, i);
+
+        char name[128];
+        metrics_escape(name, sizeof(name), c->name);
+        snprintf(labels, sizeof(labels), "device=\"%s\",id=\"%lu\"", name, c->id);
+        metrics_sample(out, "jsfw_device_syn_dropped_total", labels, counter_get(&c->drops));
+    }
+    pthread_mutex_unlock(&device_counters_mutex);
+
+    metrics_describe(out, "jsfw_serialize_failures_total", "counter", "Messages that couldn't be serialized");
+    metrics_sample(out, "jsfw_serialize_failures_total", NULL, counter_get(&serialize_failures));
+
+    hid_metrics(out);
+}
+
+void clean_exit(int _sig) {
+    printf("\rSERVER:  exiting\n");
+    close(sockfd);
+    exit(0);
+}
+
+void server_run(uint16_t port, char *config_path) {
+    sigemptyset(&empty_sigset);
+    printf("SERVER:  start\n");
+
+    // Parse the config
+    {
+        FILE *configfd = fopen(config_path, "r");
+        if (configfd == NULL) {
+            perror("SERVER:  Couldn't open config file");
+            exit(1);
+        }
+
+        char    *cbuf = malloc(8192);
+        uint8_t *jbuf = (uint8_t *)cbuf + 4096;
+
+        int len = fread(cbuf, 1, 4096, configfd);
+        if (json_parse(cbuf, len, jbuf, 4096) != 0) {
+            printf("SERVER:  Couldn't parse config, %s (at index %lu)\n", json_strerr(), json_errloc());
+            exit(1);
+        }
+
+        json_adapt(jbuf, &ConfigAdapter, &config);
+        hid_init(&config);
+
+#ifdef VERBOSE
+        print_config();
+#endif
+
+        free(cbuf);
+        fclose(configfd);
+    }
+
+    // Print the timings of the slots on SIGUSR1, blocked here before any other thread is started so that it's always handled by
+    // the timings thread
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        pthread_t _thread;
+        pthread_create(&_thread, NULL, timings_thread, NULL);
+    }
+
+    if (config.metrics_socket != NULL) {
+        metrics_start(config.metrics_socket, server_metrics);
+    }
+
+    // Start the hid thread
+    {
+        pthread_t _thread;
+        pthread_create(&_thread, NULL, hid_thread, &config);
+    }
+
+    // Start the TCP server
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        panicf("Couldn't open socket\n");
+    }
+
+    sockfd = sock;
+
+    TRAP(SIGINT, clean_exit);
+    TRAP(SIGHUP, clean_exit);
+    TRAP(SIGQUIT, clean_exit);
+    TRAP(SIGTERM, clean_exit);
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
+        printf("SERVER:  error when trying to enable SO_REUSEADDR\n");
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+        printf("SERVER:  error when trying to enable SO_REUSEPORT\n");
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_ANY);
+    addr.sin_port           = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        panicf("Couldn't bind to the socket\n");
+    }
+
+    if (listen(sock, 16) != 0) {
         panicf("Couldn't listen on socket\n");
     }
 
-    uint32_t ids = 0;
+    if (config.mode != ServerModeThreaded) {
+        loop_run();
+    }
+
     while (1) {
         struct sockaddr   con_addr;
         socklen_t         con_len = sizeof(con_addr);
-        struct Connection conn;
+        struct Connection conn    = {0};
 
         conn.socket = accept(sock, &con_addr, &con_len);
         conn.closed = false;
+        conn.udp    = -1;
 
         if (conn.socket >= 0) {
             printf("SERVER:  got connection\n");
 
-            conn.id = ids++;
+            conn.id = __atomic_fetch_add(&conn_ids, 1, __ATOMIC_RELAXED);
 
             struct Connection *conn_ptr = malloc(sizeof(struct Connection));
             memcpy(conn_ptr, &conn, sizeof(struct Connection));
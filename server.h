@@ -20,15 +20,40 @@ typedef struct {
 typedef struct {
     ControllerFilter filter;
     char            *tag;
-    bool             duplicate;
-    bool             ps4_hidraw;
+    // Id of the tag, shared by the controllers with the same tag (set by hid_init)
+    int  tag_id;
+    bool duplicate;
+    bool ps4_hidraw;
 } ServerConfigController;
 
+typedef enum {
+    // One thread per connection, and one per slot blocking on its device
+    ServerModeThreaded = 0,
+    // A fixed set of workers driving every socket and device through epoll
+    ServerModeEpoll = 1,
+    // Same as epoll, but reads and sends are queued on an io_uring (falls back to epoll if unavailable)
+    ServerModeUring = 2,
+} ServerMode;
+
 typedef struct {
     ServerConfigController *controllers;
     size_t                  controller_count;
-    struct timespec         poll_interval;
     uint32_t                request_timeout;
+    ServerMode              mode;
+    // Time between each look for new devices when they can't be watched for, and between each full rescan when they are
+    struct timespec poll_interval;
+    struct timespec rescan_interval;
+    // Whether to also listen to the kernel's uevents for new devices (on top of watching FSROOT/dev/input)
+    bool uevent;
+    // Minimum time between two writes to the hidraw interface of a device, the states received in between are merged
+    struct timespec hidraw_interval;
+    // Number of worker threads (epoll and io_uring modes only)
+    size_t workers;
+    // Probabilities of dropping and of delaying (behind the next one) a report sent over UDP, for testing
+    double udp_loss;
+    double udp_reorder;
+    // Path of the Unix socket metrics are served on, NULL to not serve them
+    char *metrics_socket;
 } ServerConfig;
 
 void server_run(uint16_t port, char *config_path);
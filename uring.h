@@ -0,0 +1,45 @@
+// vi:ft=c
+#ifndef URING_H_
+#define URING_H_
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring wrapper over the raw syscalls (we don't depend on liburing)
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    // Number of sqes queued since the last submission
+    unsigned to_submit;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void  *sq_ring;
+    size_t sq_ring_size;
+    void  *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+// Setup a ring with at least entries submission slots, returns false if io_uring isn't available
+bool uring_init(Uring *ring, unsigned entries);
+void uring_free(Uring *ring);
+// Get a zeroed sqe to fill, submits what's already queued if the submission queue is full
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+// Submit the queued sqes and wait for at least wait completions, returns the number of sqes submitted or -errno
+int uring_submit(Uring *ring, unsigned wait);
+// Get the next completion or NULL if there is none, uring_cqe_seen must be called once it has been handled
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void                 uring_cqe_seen(Uring *ring);
+
+#endif
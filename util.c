@@ -33,6 +33,12 @@ double timespec_to_double(struct timespec *ts) {
     return secs;
 }
 
+uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 uint8_t parse_hex_digit(char h) {
     if (h >= '0' && h <= '9')
         return h - '0';
@@ -12,6 +12,15 @@ uint16_t parse_port(const char *str);
 
 // Test if the bit with index i is set in the byte array bits
 static inline bool bit_set(uint8_t *bits, int i) { return bits[i / 8] & (1 << (i % 8)); }
+// Test if the bit with index i is set in the word array words (bitsets of net.ser)
+static inline bool word_bit_get(const uint64_t *words, int i) { return (words[i / 64] >> (i % 64)) & 1; }
+// Set the bit with index i of the word array words to value
+static inline void word_bit_put(uint64_t *words, int i, bool value) {
+    uint64_t mask = 1ULL << (i % 64);
+    words[i / 64] = value ? words[i / 64] | mask : words[i / 64] & ~mask;
+}
+// Number of words needed to hold n bits
+static inline size_t words_for_bits(size_t n) { return (n + 63) / 64; }
 // Align n to the next 8 boundary
 static inline size_t align_8(size_t n) { return (((n - 1) >> 3) + 1) << 3; }
 // Align n to the next 4 boundary
@@ -21,6 +30,8 @@ static inline size_t align_2(size_t n) { return (((n - 1) >> 1) + 1) << 1; }
 uint8_t              parse_hex_digit(char h);
 // Convert timespec to double in seconds mostly for printing.
 double timespec_to_double(struct timespec *ts);
+// Current time of CLOCK_REALTIME (the clock of input event timestamps) in ns
+uint64_t realtime_ns(void);
 
 void default_to_null(void *ptr);
 void default_to_false(void *ptr);